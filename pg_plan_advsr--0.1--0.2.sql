@@ -0,0 +1,356 @@
+/* pg_plan_advsr--0.1--0.2.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_plan_advsr UPDATE TO '0.2'" to load this file. \quit
+
+CREATE TYPE plan_repo.hint AS
+(
+	method				text,
+	relids				text[],
+	rows				double precision,
+	workers				int
+);
+
+-- Tables are rebuilt because the type of norm_query_hash changes from MD5
+-- text to bigint, hashtextextended(norm_query_string, 0).  A hash without
+-- its normalized query text is folded from the first half of the MD5.
+DROP VIEW plan_repo.plan_history_pretty;
+ALTER SEQUENCE plan_repo.plan_history_id_seq OWNED BY NONE;
+ALTER SEQUENCE plan_repo.raw_queries_raw_query_id_seq OWNED BY NONE;
+ALTER TABLE plan_repo.plan_history RENAME TO plan_history_old;
+ALTER TABLE plan_repo.norm_queries RENAME TO norm_queries_old;
+ALTER TABLE plan_repo.raw_queries RENAME TO raw_queries_old;
+
+ALTER TABLE plan_repo.norm_queries_old ADD COLUMN new_hash bigint;
+UPDATE plan_repo.norm_queries_old
+SET new_hash = CASE WHEN norm_query_string IS NOT NULL
+					THEN pg_catalog.hashtextextended(norm_query_string, 0)
+					ELSE ('x' || pg_catalog.substr(norm_query_hash, 1, 16))::bit(64)::bigint
+			   END;
+CREATE INDEX ON plan_repo.norm_queries_old (norm_query_hash);
+
+CREATE FUNCTION plan_repo.migrate_norm_query_hash(text)
+RETURNS bigint AS $$
+	SELECT coalesce((SELECT new_hash FROM plan_repo.norm_queries_old
+					 WHERE norm_query_hash = $1 LIMIT 1),
+					('x' || pg_catalog.substr($1, 1, 16))::bit(64)::bigint);
+$$ LANGUAGE sql STABLE STRICT;
+
+-- norm_queries keeps one row per norm_query_hash
+CREATE TABLE plan_repo.norm_queries
+(
+	norm_query_hash		bigint PRIMARY KEY,
+	norm_query_string	text
+);
+INSERT INTO plan_repo.norm_queries
+SELECT DISTINCT ON (new_hash) new_hash, norm_query_string
+FROM plan_repo.norm_queries_old
+WHERE new_hash IS NOT NULL
+ORDER BY new_hash, norm_query_string IS NULL;
+
+-- raw_queries is looked up by norm_query_hash to limit rows per query
+CREATE TABLE plan_repo.raw_queries
+(
+	norm_query_hash		bigint,
+	raw_query_id		integer NOT NULL DEFAULT nextval('plan_repo.raw_queries_raw_query_id_seq'),
+	raw_query_string	text,
+	timestamp			timestamp
+);
+ALTER SEQUENCE plan_repo.raw_queries_raw_query_id_seq OWNED BY plan_repo.raw_queries.raw_query_id;
+CREATE INDEX raw_queries_norm_query_hash_idx
+	ON plan_repo.raw_queries (norm_query_hash);
+INSERT INTO plan_repo.raw_queries
+SELECT plan_repo.migrate_norm_query_hash(norm_query_hash),
+	   raw_query_id, raw_query_string, timestamp
+FROM plan_repo.raw_queries_old;
+
+-- plan_history is partitioned by timestamp and indexed for lookups by
+-- pgsp_planid and norm_query_hash
+CREATE TABLE plan_repo.plan_history
+(
+	id					integer NOT NULL DEFAULT nextval('plan_repo.plan_history_id_seq'),
+	norm_query_hash		bigint,
+	pgsp_queryid		bigint,
+	pgsp_planid			bigint,
+	planid				bigint,
+	execution_time		double precision,
+	rows_hint			text,
+	scan_hint			text,
+	join_hint			text,
+	lead_hint			text,
+	hint_set			plan_repo.hint[],
+	scan_rows_err		double precision,
+	scan_err_ratio		double precision,
+	join_rows_err		double precision,
+	join_err_ratio		double precision,
+	scan_cnt			int,
+	join_cnt			int,
+	application_name	text,
+	timestamp			timestamp,
+	execution_time_median	double precision,
+	execution_time_p90	double precision,
+	shared_hit_ratio	double precision,
+	cache_differs		boolean,
+	param_values		text,
+	param_bucket		bigint,
+	PRIMARY KEY (id, timestamp)
+) PARTITION BY RANGE (timestamp);
+ALTER SEQUENCE plan_repo.plan_history_id_seq OWNED BY plan_repo.plan_history.id;
+CREATE TABLE plan_repo.plan_history_default
+	PARTITION OF plan_repo.plan_history DEFAULT;
+CREATE INDEX plan_history_pgsp_planid_idx
+	ON plan_repo.plan_history (pgsp_planid, id);
+CREATE INDEX plan_history_norm_query_hash_idx
+	ON plan_repo.plan_history (norm_query_hash, id);
+
+-- planid and hint_set of old rows are left NULL
+INSERT INTO plan_repo.plan_history
+	(id, norm_query_hash, pgsp_queryid, pgsp_planid, execution_time,
+	 rows_hint, scan_hint, join_hint, lead_hint,
+	 scan_rows_err, scan_err_ratio, join_rows_err, join_err_ratio,
+	 scan_cnt, join_cnt, application_name, timestamp)
+SELECT id, plan_repo.migrate_norm_query_hash(norm_query_hash),
+	   pgsp_queryid, pgsp_planid, execution_time,
+	   rows_hint, scan_hint, join_hint, lead_hint,
+	   scan_rows_err, scan_err_ratio, join_rows_err, join_err_ratio,
+	   scan_cnt, join_cnt, application_name,
+	   coalesce(timestamp, '-infinity')
+FROM plan_repo.plan_history_old;
+
+DROP FUNCTION plan_repo.migrate_norm_query_hash(text);
+DROP TABLE plan_repo.plan_history_old;
+DROP TABLE plan_repo.norm_queries_old;
+DROP TABLE plan_repo.raw_queries_old;
+
+CREATE VIEW plan_repo.plan_history_pretty
+AS
+SELECT id,
+	   norm_query_hash,
+	   pgsp_queryid,
+	   pgsp_planid,
+	   planid,
+	   execution_time::numeric(18, 3),
+	   rows_hint,
+	   scan_hint,
+	   join_hint,
+	   lead_hint,
+	   hint_set,
+	   scan_rows_err,
+	   scan_err_ratio::numeric(18, 2),
+	   join_rows_err,
+	   join_err_ratio::numeric(18, 2),
+	   scan_cnt,
+	   join_cnt,
+	   application_name,
+	   timestamp,
+	   execution_time_median::numeric(18, 3),
+	   execution_time_p90::numeric(18, 3),
+	   shared_hit_ratio::numeric(18, 2),
+	   cache_differs,
+	   param_values,
+	   param_bucket
+FROM plan_repo.plan_history
+ORDER BY id;
+
+GRANT SELECT ON plan_repo.plan_history TO PUBLIC;
+GRANT SELECT ON plan_repo.norm_queries TO PUBLIC;
+GRANT SELECT ON plan_repo.raw_queries TO PUBLIC;
+
+-- tuning_state keeps the feedback loop state of each query, see auto_pin
+CREATE TABLE plan_repo.tuning_state
+(
+	norm_query_hash		bigint,
+	application_name	text,
+	state				text,
+	iterations			int,
+	planids				bigint[],
+	best_planid			bigint,
+	best_execution_time	double precision,
+	best_hints			text,
+	join_rows_err		double precision,
+	timestamp			timestamp,
+	best_hit_ratio		double precision,
+	cache_differs		boolean,
+	PRIMARY KEY (norm_query_hash, application_name)
+);
+GRANT SELECT ON plan_repo.tuning_state TO PUBLIC;
+
+-- Strip the hints pinned by auto_pin from hint_plan.hints when the tuning
+-- state of a query is deleted, so that tuning restarts from the other hints
+CREATE FUNCTION plan_repo.unpin_hints()
+RETURNS trigger AS $$
+BEGIN
+	IF pg_catalog.to_regclass('hint_plan.hints') IS NULL THEN
+		RETURN NULL;
+	END IF;
+
+	IF TG_OP = 'TRUNCATE' THEN
+		UPDATE hint_plan.hints h
+		SET hints = pg_catalog.rtrim(pg_catalog.left(h.hints,
+					pg_catalog.length(h.hints) - pg_catalog.length(s.best_hints)))
+		FROM plan_repo.tuning_state s
+		JOIN plan_repo.norm_queries n USING (norm_query_hash)
+		WHERE s.state <> 'tuning'
+		  AND h.norm_query_string = n.norm_query_string
+		  AND h.application_name = s.application_name
+		  AND pg_catalog.right(h.hints, pg_catalog.length(s.best_hints)) = s.best_hints;
+	ELSE
+		UPDATE hint_plan.hints h
+		SET hints = pg_catalog.rtrim(pg_catalog.left(h.hints,
+					pg_catalog.length(h.hints) - pg_catalog.length(s.best_hints)))
+		FROM deleted s
+		JOIN plan_repo.norm_queries n USING (norm_query_hash)
+		WHERE s.state <> 'tuning'
+		  AND h.norm_query_string = n.norm_query_string
+		  AND h.application_name = s.application_name
+		  AND pg_catalog.right(h.hints, pg_catalog.length(s.best_hints)) = s.best_hints;
+	END IF;
+
+	RETURN NULL;
+END;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+CREATE TRIGGER unpin_hints_after_delete
+	AFTER DELETE ON plan_repo.tuning_state
+	REFERENCING OLD TABLE AS deleted
+	FOR EACH STATEMENT EXECUTE FUNCTION plan_repo.unpin_hints();
+CREATE TRIGGER unpin_hints_before_truncate
+	BEFORE TRUNCATE ON plan_repo.tuning_state
+	FOR EACH STATEMENT EXECUTE FUNCTION plan_repo.unpin_hints();
+
+-- get_hint() reads plan_history, so it can't be IMMUTABLE
+ALTER FUNCTION plan_repo.get_hint(bigint) STABLE;
+
+-- Delete raw query texts older than the given interval
+CREATE FUNCTION plan_repo.purge_raw_queries(interval)
+RETURNS bigint AS $$
+	WITH deleted AS (
+		DELETE FROM plan_repo.raw_queries
+		WHERE timestamp < (pg_catalog.now() AT TIME ZONE 'UTC') - $1
+		RETURNING 1
+	)
+	SELECT count(*) FROM deleted;
+$$ LANGUAGE sql;
+
+-- Create a partition of plan_history for timestamps in [$1, $2).  Rows of the
+-- range in the default partition are moved to it.
+CREATE FUNCTION plan_repo.create_plan_history_partition(timestamp, timestamp)
+RETURNS text AS $$
+DECLARE
+	partname text := 'plan_history_' || pg_catalog.to_char($1, 'YYYYMMDD_HH24MISS');
+BEGIN
+	EXECUTE pg_catalog.format('CREATE TABLE plan_repo.%I '
+							  '(LIKE plan_repo.plan_history INCLUDING DEFAULTS)', partname);
+	EXECUTE pg_catalog.format('WITH moved AS ('
+							  'DELETE FROM plan_repo.plan_history_default '
+							  'WHERE timestamp >= %L AND timestamp < %L RETURNING *) '
+							  'INSERT INTO plan_repo.%I SELECT * FROM moved',
+							  $1, $2, partname);
+	EXECUTE pg_catalog.format('ALTER TABLE plan_repo.plan_history '
+							  'ATTACH PARTITION plan_repo.%I FOR VALUES FROM (%L) TO (%L)',
+							  partname, $1, $2);
+	RETURN partname;
+END;
+$$ LANGUAGE plpgsql
+SET search_path = pg_catalog, pg_temp
+SET datestyle = 'ISO';
+
+-- Create the partitions of plan_history for the current period and the ones
+-- following it unless they exist, and return the number of created ones
+CREATE FUNCTION plan_repo.prepare_plan_history_partitions(period interval DEFAULT '1 day',
+														  periods int DEFAULT 2)
+RETURNS integer AS $$
+DECLARE
+	now_utc timestamp := pg_catalog.now() AT TIME ZONE 'UTC';
+	lower_bound timestamp := pg_catalog.date_trunc('day', now_utc);
+	created integer := 0;
+BEGIN
+	IF period <= interval '0' THEN
+		RAISE EXCEPTION 'period must be positive';
+	END IF;
+
+	-- periods are aligned to the start of the day
+	WHILE lower_bound + period <= now_utc LOOP
+		lower_bound := lower_bound + period;
+	END LOOP;
+
+	FOR i IN 1..periods LOOP
+		IF pg_catalog.to_regclass('plan_repo.plan_history_' ||
+								  pg_catalog.to_char(lower_bound, 'YYYYMMDD_HH24MISS')) IS NULL THEN
+			BEGIN
+				PERFORM plan_repo.create_plan_history_partition(lower_bound,
+																lower_bound + period);
+				created := created + 1;
+			EXCEPTION WHEN invalid_object_definition THEN
+				-- the period overlaps a partition created by hand
+				NULL;
+			END;
+		END IF;
+		lower_bound := lower_bound + period;
+	END LOOP;
+
+	RETURN created;
+END;
+$$ LANGUAGE plpgsql
+SET search_path = pg_catalog, pg_temp;
+
+-- Drop partitions of plan_history older than the given interval, and
+-- delete such rows from the default partition
+CREATE FUNCTION plan_repo.drop_plan_history_partitions(interval)
+RETURNS integer AS $$
+DECLARE
+	cutoff timestamp := (pg_catalog.now() AT TIME ZONE 'UTC') - $1;
+	part record;
+	dropped integer := 0;
+BEGIN
+	-- The bounds are printed in the DateStyle of the function.  The default
+	-- partition and a MAXVALUE bound have no upper bound to match.
+	FOR part IN
+		SELECT t.relid::regclass AS relname,
+			   pg_get_expr(c.relpartbound, c.oid) AS bound,
+			   EXISTS (SELECT 1 FROM pg_depend d
+					   WHERE d.classid = 'pg_class'::regclass AND
+							 d.objid = t.relid AND d.deptype = 'e') AS member
+		FROM pg_partition_tree('plan_repo.plan_history') t
+		JOIN pg_class c ON c.oid = t.relid
+		WHERE t.level = 1
+	LOOP
+		IF substring(part.bound, 'TO \(''([^'']*)''\)$')::timestamp <= cutoff THEN
+			-- partitions created by CREATE EXTENSION belong to the extension
+			IF part.member THEN
+				EXECUTE format('ALTER EXTENSION pg_plan_advsr DROP TABLE %s', part.relname);
+			END IF;
+			EXECUTE format('DROP TABLE %s', part.relname);
+			dropped := dropped + 1;
+		END IF;
+	END LOOP;
+
+	DELETE FROM plan_repo.plan_history_default WHERE timestamp < cutoff;
+
+	RETURN dropped;
+END;
+$$ LANGUAGE plpgsql
+SET search_path = pg_catalog, pg_temp
+SET datestyle = 'ISO';
+
+-- Run the feedback loop of a query in this backend, see README
+CREATE FUNCTION plan_repo.auto_tune(query text,
+									max_iterations int DEFAULT 10,
+									time_budget interval DEFAULT NULL)
+RETURNS TABLE (iteration int,
+			   planid bigint,
+			   execution_time double precision,
+			   join_rows_err double precision,
+			   scan_rows_err double precision,
+			   converged boolean)
+AS 'MODULE_PATHNAME', 'pg_plan_advsr_auto_tune'
+LANGUAGE C CALLED ON NULL INPUT;
+
+-- Forget the cardinalities learned for scan_correction and join_correction
+CREATE FUNCTION plan_repo.reset_cardinalities()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_plan_advsr_reset_cardinalities'
+LANGUAGE C;
+
+-- Partitions of plan_history for the current period and the next one
+SELECT plan_repo.prepare_plan_history_partitions();
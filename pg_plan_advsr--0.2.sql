@@ -0,0 +1,400 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_plan_advsr" to load this file. \quit
+
+SET search_path = public;
+SET LOCAL client_min_messages = WARNING;
+
+CREATE SCHEMA plan_repo;
+
+-- Register types
+CREATE TYPE plan_repo.hint AS
+(
+	method				text,
+	relids				text[],
+	rows				double precision,
+	workers				int
+);
+
+-- Register tables
+CREATE TABLE plan_repo.plan_history
+(
+	id					serial,
+	norm_query_hash		bigint,
+	pgsp_queryid		bigint,
+	pgsp_planid			bigint,
+	planid				bigint,
+	execution_time		double precision,
+	rows_hint			text,
+	scan_hint			text,
+	join_hint			text,
+	lead_hint			text,
+	hint_set			plan_repo.hint[],
+	scan_rows_err		double precision,
+	scan_err_ratio		double precision,
+	join_rows_err		double precision,
+	join_err_ratio		double precision,
+	scan_cnt			int,
+	join_cnt			int,
+	application_name	text,
+	timestamp			timestamp,
+	execution_time_median	double precision,
+	execution_time_p90	double precision,
+	shared_hit_ratio	double precision,
+	cache_differs		boolean,
+	param_values		text,
+	param_bucket		bigint,
+	PRIMARY KEY (id, timestamp)
+) PARTITION BY RANGE (timestamp);
+CREATE TABLE plan_repo.plan_history_default
+	PARTITION OF plan_repo.plan_history DEFAULT;
+CREATE INDEX plan_history_pgsp_planid_idx
+	ON plan_repo.plan_history (pgsp_planid, id);
+CREATE INDEX plan_history_norm_query_hash_idx
+	ON plan_repo.plan_history (norm_query_hash, id);
+
+CREATE TABLE plan_repo.norm_queries
+(
+	norm_query_hash		bigint PRIMARY KEY,
+	norm_query_string	text
+);
+
+CREATE TABLE plan_repo.raw_queries
+(
+	norm_query_hash		bigint,
+	raw_query_id		serial,
+	raw_query_string	text,
+	timestamp			timestamp
+);
+CREATE INDEX raw_queries_norm_query_hash_idx
+	ON plan_repo.raw_queries (norm_query_hash);
+
+CREATE TABLE plan_repo.tuning_state
+(
+	norm_query_hash		bigint,
+	application_name	text,
+	state				text,
+	iterations			int,
+	planids				bigint[],
+	best_planid			bigint,
+	best_execution_time	double precision,
+	best_hints			text,
+	join_rows_err		double precision,
+	timestamp			timestamp,
+	best_hit_ratio		double precision,
+	cache_differs		boolean,
+	PRIMARY KEY (norm_query_hash, application_name)
+);
+
+-- Register view
+CREATE VIEW plan_repo.plan_history_pretty
+AS
+SELECT id,
+	   norm_query_hash,
+	   pgsp_queryid,
+	   pgsp_planid,
+	   planid,
+	   execution_time::numeric(18, 3),
+	   rows_hint,
+	   scan_hint,
+	   join_hint,
+	   lead_hint,
+	   hint_set,
+	   scan_rows_err,
+	   scan_err_ratio::numeric(18, 2),
+	   join_rows_err,
+	   join_err_ratio::numeric(18, 2),
+	   scan_cnt,
+	   join_cnt,
+	   application_name,
+	   timestamp,
+	   execution_time_median::numeric(18, 3),
+	   execution_time_p90::numeric(18, 3),
+	   shared_hit_ratio::numeric(18, 2),
+	   cache_differs,
+	   param_values,
+	   param_bucket
+FROM plan_repo.plan_history
+ORDER BY id;
+
+-- Register functions
+CREATE FUNCTION pg_plan_advsr_enable_feedback()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION pg_plan_advsr_disable_feedback()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Run the feedback loop of a query in this backend, see README
+CREATE FUNCTION plan_repo.auto_tune(query text,
+									max_iterations int DEFAULT 10,
+									time_budget interval DEFAULT NULL)
+RETURNS TABLE (iteration int,
+			   planid bigint,
+			   execution_time double precision,
+			   join_rows_err double precision,
+			   scan_rows_err double precision,
+			   converged boolean)
+AS 'MODULE_PATHNAME', 'pg_plan_advsr_auto_tune'
+LANGUAGE C CALLED ON NULL INPUT;
+
+-- Forget the cardinalities learned for scan_correction and join_correction
+CREATE FUNCTION plan_repo.reset_cardinalities()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_plan_advsr_reset_cardinalities'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION plan_repo.get_hint(bigint)
+RETURNS text
+	AS 'select ''/*+'' || chr(10) || '
+	   'lead_hint || chr(10) || '
+	   'join_hint || chr(10) || '
+	   'scan_hint || chr(10) || '
+	   '''*/'' || chr(10) || '
+	   '''--'' || pgsp_planid '
+	   'from plan_repo.plan_history '
+	   'where pgsp_planid = $1 '
+	   'order by id desc '
+	   'limit 1;'
+LANGUAGE SQL
+STABLE
+RETURNS NULL ON NULL INPUT;
+
+-- This function can use on PG14 or above with pg_qualstats
+CREATE OR REPLACE FUNCTION plan_repo.get_col_from_qualstats(bigint)
+RETURNS TEXT
+AS $$
+	SELECT pg_catalog.quote_ident(a.attname)
+	FROM pg_qualstats() q
+	JOIN pg_catalog.pg_class c ON coalesce(q.lrelid, q.rrelid) = c.oid
+	JOIN pg_catalog.pg_attribute a ON a.attrelid = c.oid
+	 AND a.attnum = coalesce(q.lattnum, q.rattnum)
+	JOIN pg_catalog.pg_operator op ON op.oid = q.opno
+	WHERE q.qualnodeid = $1
+	  AND q.qualid is not null;
+$$ LANGUAGE sql;
+
+
+CREATE OR REPLACE FUNCTION plan_repo.get_extstat(bigint)
+RETURNS TABLE (suggest text) AS $$
+	with all_quals as (
+		--左
+	    SELECT qualid,
+			   lrelid as rel,
+			   pg_catalog.quote_ident(n.nspname) || '.' ||
+			   pg_catalog.quote_ident(c.relname) as relname,
+			   plan_repo.get_col_from_qualstats(qualnodeid) as col
+	    FROM pg_qualstats() q
+	    JOIN pg_catalog.pg_class c ON q.lrelid = c.oid
+	    JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+		WHERE queryid = $1
+		UNION
+		--右
+	    SELECT qualid,
+			   rrelid as rel,
+			   pg_catalog.quote_ident(n.nspname) || '.' ||
+			   pg_catalog.quote_ident(c.relname) as relname,
+			   plan_repo.get_col_from_qualstats(qualnodeid) as col
+	    FROM pg_qualstats() q
+	    JOIN pg_catalog.pg_class c ON q.rrelid = c.oid
+	    JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+		WHERE queryid = $1
+	),
+	data as (
+		select relname,
+			   col
+		from all_quals
+		where col is not null
+		group by relname, col
+		ORDER BY 1, 2
+	),
+	rels_cols as (
+		select relname,
+			   array_to_string(array_agg(col), ', ') as cols,
+			   count(col) as col_num
+		from data
+		group by relname
+	),
+	nominated as (
+		select relname,
+			   cols
+		from rels_cols
+		where col_num > 1
+	)
+	select 'CREATE STATISTICS ON ' || array_to_string(array_agg(cols), ', ') || ' ' ||
+		   'FROM '|| relname || ';' as suggest
+	from nominated
+	group by relname
+	ORDER BY 1;
+$$ LANGUAGE sql;
+
+
+-- Delete raw query texts older than the given interval
+CREATE FUNCTION plan_repo.purge_raw_queries(interval)
+RETURNS bigint AS $$
+	WITH deleted AS (
+		DELETE FROM plan_repo.raw_queries
+		WHERE timestamp < (pg_catalog.now() AT TIME ZONE 'UTC') - $1
+		RETURNING 1
+	)
+	SELECT count(*) FROM deleted;
+$$ LANGUAGE sql;
+
+
+-- Create a partition of plan_history for timestamps in [$1, $2).  Rows of the
+-- range in the default partition are moved to it.
+CREATE FUNCTION plan_repo.create_plan_history_partition(timestamp, timestamp)
+RETURNS text AS $$
+DECLARE
+	partname text := 'plan_history_' || pg_catalog.to_char($1, 'YYYYMMDD_HH24MISS');
+BEGIN
+	EXECUTE pg_catalog.format('CREATE TABLE plan_repo.%I '
+							  '(LIKE plan_repo.plan_history INCLUDING DEFAULTS)', partname);
+	EXECUTE pg_catalog.format('WITH moved AS ('
+							  'DELETE FROM plan_repo.plan_history_default '
+							  'WHERE timestamp >= %L AND timestamp < %L RETURNING *) '
+							  'INSERT INTO plan_repo.%I SELECT * FROM moved',
+							  $1, $2, partname);
+	EXECUTE pg_catalog.format('ALTER TABLE plan_repo.plan_history '
+							  'ATTACH PARTITION plan_repo.%I FOR VALUES FROM (%L) TO (%L)',
+							  partname, $1, $2);
+	RETURN partname;
+END;
+$$ LANGUAGE plpgsql
+SET search_path = pg_catalog, pg_temp
+SET datestyle = 'ISO';
+
+-- Create the partitions of plan_history for the current period and the ones
+-- following it unless they exist, and return the number of created ones
+CREATE FUNCTION plan_repo.prepare_plan_history_partitions(period interval DEFAULT '1 day',
+														  periods int DEFAULT 2)
+RETURNS integer AS $$
+DECLARE
+	now_utc timestamp := pg_catalog.now() AT TIME ZONE 'UTC';
+	lower_bound timestamp := pg_catalog.date_trunc('day', now_utc);
+	created integer := 0;
+BEGIN
+	IF period <= interval '0' THEN
+		RAISE EXCEPTION 'period must be positive';
+	END IF;
+
+	-- periods are aligned to the start of the day
+	WHILE lower_bound + period <= now_utc LOOP
+		lower_bound := lower_bound + period;
+	END LOOP;
+
+	FOR i IN 1..periods LOOP
+		IF pg_catalog.to_regclass('plan_repo.plan_history_' ||
+								  pg_catalog.to_char(lower_bound, 'YYYYMMDD_HH24MISS')) IS NULL THEN
+			BEGIN
+				PERFORM plan_repo.create_plan_history_partition(lower_bound,
+																lower_bound + period);
+				created := created + 1;
+			EXCEPTION WHEN invalid_object_definition THEN
+				-- the period overlaps a partition created by hand
+				NULL;
+			END;
+		END IF;
+		lower_bound := lower_bound + period;
+	END LOOP;
+
+	RETURN created;
+END;
+$$ LANGUAGE plpgsql
+SET search_path = pg_catalog, pg_temp;
+
+-- Drop partitions of plan_history older than the given interval, and
+-- delete such rows from the default partition
+CREATE FUNCTION plan_repo.drop_plan_history_partitions(interval)
+RETURNS integer AS $$
+DECLARE
+	cutoff timestamp := (pg_catalog.now() AT TIME ZONE 'UTC') - $1;
+	part record;
+	dropped integer := 0;
+BEGIN
+	-- The bounds are printed in the DateStyle of the function.  The default
+	-- partition and a MAXVALUE bound have no upper bound to match.
+	FOR part IN
+		SELECT t.relid::regclass AS relname,
+			   pg_get_expr(c.relpartbound, c.oid) AS bound,
+			   EXISTS (SELECT 1 FROM pg_depend d
+					   WHERE d.classid = 'pg_class'::regclass AND
+							 d.objid = t.relid AND d.deptype = 'e') AS member
+		FROM pg_partition_tree('plan_repo.plan_history') t
+		JOIN pg_class c ON c.oid = t.relid
+		WHERE t.level = 1
+	LOOP
+		IF substring(part.bound, 'TO \(''([^'']*)''\)$')::timestamp <= cutoff THEN
+			-- partitions created by CREATE EXTENSION belong to the extension
+			IF part.member THEN
+				EXECUTE format('ALTER EXTENSION pg_plan_advsr DROP TABLE %s', part.relname);
+			END IF;
+			EXECUTE format('DROP TABLE %s', part.relname);
+			dropped := dropped + 1;
+		END IF;
+	END LOOP;
+
+	DELETE FROM plan_repo.plan_history_default WHERE timestamp < cutoff;
+
+	RETURN dropped;
+END;
+$$ LANGUAGE plpgsql
+SET search_path = pg_catalog, pg_temp
+SET datestyle = 'ISO';
+
+
+-- Strip the hints pinned by auto_pin from hint_plan.hints when the tuning
+-- state of a query is deleted, so that tuning restarts from the other hints
+CREATE FUNCTION plan_repo.unpin_hints()
+RETURNS trigger AS $$
+BEGIN
+	IF pg_catalog.to_regclass('hint_plan.hints') IS NULL THEN
+		RETURN NULL;
+	END IF;
+
+	IF TG_OP = 'TRUNCATE' THEN
+		UPDATE hint_plan.hints h
+		SET hints = pg_catalog.rtrim(pg_catalog.left(h.hints,
+					pg_catalog.length(h.hints) - pg_catalog.length(s.best_hints)))
+		FROM plan_repo.tuning_state s
+		JOIN plan_repo.norm_queries n USING (norm_query_hash)
+		WHERE s.state <> 'tuning'
+		  AND h.norm_query_string = n.norm_query_string
+		  AND h.application_name = s.application_name
+		  AND pg_catalog.right(h.hints, pg_catalog.length(s.best_hints)) = s.best_hints;
+	ELSE
+		UPDATE hint_plan.hints h
+		SET hints = pg_catalog.rtrim(pg_catalog.left(h.hints,
+					pg_catalog.length(h.hints) - pg_catalog.length(s.best_hints)))
+		FROM deleted s
+		JOIN plan_repo.norm_queries n USING (norm_query_hash)
+		WHERE s.state <> 'tuning'
+		  AND h.norm_query_string = n.norm_query_string
+		  AND h.application_name = s.application_name
+		  AND pg_catalog.right(h.hints, pg_catalog.length(s.best_hints)) = s.best_hints;
+	END IF;
+
+	RETURN NULL;
+END;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+CREATE TRIGGER unpin_hints_after_delete
+	AFTER DELETE ON plan_repo.tuning_state
+	REFERENCING OLD TABLE AS deleted
+	FOR EACH STATEMENT EXECUTE FUNCTION plan_repo.unpin_hints();
+CREATE TRIGGER unpin_hints_before_truncate
+	BEFORE TRUNCATE ON plan_repo.tuning_state
+	FOR EACH STATEMENT EXECUTE FUNCTION plan_repo.unpin_hints();
+
+
+-- Grant
+GRANT SELECT ON plan_repo.plan_history TO PUBLIC;
+GRANT SELECT ON plan_repo.norm_queries TO PUBLIC;
+GRANT SELECT ON plan_repo.raw_queries TO PUBLIC;
+GRANT SELECT ON plan_repo.tuning_state TO PUBLIC;
+GRANT USAGE ON SCHEMA plan_repo TO PUBLIC;
+
+-- Partitions of plan_history for the current period and the next one
+SELECT plan_repo.prepare_plan_history_partitions();
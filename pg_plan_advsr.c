@@ -12,32 +12,69 @@
  *-------------------------------------------------------------------------
  */
 #include "postgres.h"
+
+#include <ctype.h>
+#include <math.h>
+
 #include "parser/analyze.h"
 #include "parser/parsetree.h"
 #include "executor/executor.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "lib/ilist.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "nodes/nodeFuncs.h"
 #include "nodes/extensible.h"
 
 #include "commands/explain.h"
 #include "commands/prepare.h"
-#include "common/md5.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "utils/builtins.h"
 #include "utils/ruleutils.h"
 
 #include "access/hash.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif  /* PG_VERSION_NUM */
 #include "utils/lsyscache.h"
 #include "catalog/namespace.h"
 #include "utils/builtins.h"
 #include "access/htup_details.h"
 #include "catalog/indexing.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "utils/varlena.h"
+#include "utils/array.h"
 #include "catalog/pg_extension.h"
+#include "catalog/pg_type.h"
 #include "utils/fmgroids.h"
 #include "optimizer/cost.h"
+#include "optimizer/paths.h"
+#include "optimizer/planner.h"
+#include "storage/bufmgr.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif  /* PG_VERSION_NUM */
+
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
 
 #include "libpq-int.h"
 #if PG_VERSION_NUM >= 110000
@@ -81,6 +118,13 @@ static StringInfo join_str;
 static StringInfo rows_str;
 LeadingContext *leadcxt;
 
+/*
+ * Everything allocated while creating hints of a query lives in this context.
+ * It is reset once the hints are reported, or when the next analysis starts
+ * after an error.
+ */
+static MemoryContext analysis_cxt = NULL;
+
 /* In PostgreSQL 11, queryid becomes a uint64 internally. */
 #if PG_VERSION_NUM >= 110000
 typedef uint64 queryid_t;
@@ -96,8 +140,12 @@ typedef uint32 queryid_t;
  */
 static queryid_t pgsp_queryid;
 
-/* hash value made by normalized_plan */
+/* hash value made by normalized_plan, valid if pgsp_planid_known */
 static uint32 pgsp_planid;
+static bool pgsp_planid_known;
+
+/* 64-bit hash value made by normalized_plan, less likely to collide */
+static uint64 advsr_planid;
 
 /* estimated/actual rows number */
 static double est_rows;
@@ -122,6 +170,65 @@ static char	*aplname;
 /* This is made by generate_normalized_query in post_parse_analyze_hook */
 char	   *normalized_query;
 
+/* the constants stripped from normalized_query, separated by ", " */
+static char *normalized_params = NULL;
+
+/*
+ * Parameter bucket of the statement being planned, see get_param_bucket(),
+ * and the one of the plan of the last top-level statement.
+ */
+static bool planning_bucket_known = false;
+static int64 planning_bucket = 0;
+static PlannedStmt *last_planned_stmt = NULL;
+static int64 last_planned_bucket = 0;
+
+/* parameter bucket of the plan being analyzed, see get_plan_param_bucket() */
+static bool analysis_bucket_known = false;
+static int64 analysis_bucket = 0;
+
+/*
+ * Result of an iteration of plan_repo.auto_tune(), filled in by
+ * store_info_to_tables() while auto_tune_result is set.
+ */
+typedef struct AutoTuneResult
+{
+	bool		stored;			/* the iteration was stored */
+	bool		stopped;		/* tuning_state ended tuning */
+	uint64		planid;
+	double		execution_time;
+	double		join_rows_err;
+	double		scan_rows_err;
+} AutoTuneResult;
+
+static AutoTuneResult *auto_tune_result = NULL;
+
+/*
+ * Execution time and shared buffer usage of each execution of the query,
+ * see pg_plan_advsr.measure_repeats.  The last one is the execution that
+ * EXPLAIN ANALYZE shows.
+ */
+#define MEASURE_MAX_REPEATS		100
+
+/* hit ratios further apart than this were measured at different cache states */
+#define MEASURE_CACHE_DIFF		0.1
+
+static int	measure_nsamples = 0;
+static double measure_times[MEASURE_MAX_REPEATS];
+static int64 measure_hits[MEASURE_MAX_REPEATS];
+static int64 measure_reads[MEASURE_MAX_REPEATS];
+
+/*
+ * A regular statement sampled for capture.  The texts are kept in
+ * TopMemoryContext because the statement may be executed in another message
+ * than the one it was parsed in.
+ */
+static char *capture_source_text = NULL;
+static char *capture_norm_query = NULL;
+static char *capture_norm_params = NULL;
+
+/* true while the sampled statement is being executed and analyzed */
+static bool capture_current = false;
+
 /* Current nesting depth of ExecutorRun+ProcessUtility calls */
 static int	nested_level = 0;
 
@@ -141,6 +248,205 @@ static bool pg_plan_advsr_is_quieted;
 /* enable / disable creating hints evenif query is EXPLAIN without ANALYZE option */
 static bool pg_plan_advsr_widely;
 
+/* enable / disable handing plan_repo writes to the background writer */
+static bool pg_plan_advsr_async_write;
+
+/* database the background writer connects to ("" disables the writer) */
+static char *pg_plan_advsr_writer_database;
+
+/* size of the shared queue between backends and the writer, in kB */
+static int	pg_plan_advsr_queue_size;
+
+/* sleep time of the background writer between batches, in ms */
+static int	pg_plan_advsr_writer_naptime;
+
+/* learn the rows of scans and correct the estimates of base relations */
+static bool pg_plan_advsr_scan_correction;
+
+/* learn the rows of joins and correct the estimates of join relations */
+static bool pg_plan_advsr_join_correction;
+
+/* learn and correct the rows per bucket of parameter selectivities */
+static bool pg_plan_advsr_param_buckets;
+
+/* max number of cardinalities learned in shared memory */
+static int	pg_plan_advsr_max_cardinalities;
+
+/* max number of raw_queries rows per norm_query_hash (-1 is no limit) */
+static int	pg_plan_advsr_raw_query_limit;
+
+/* fraction of raw query texts to store */
+static double pg_plan_advsr_raw_query_sample_rate;
+
+/* max length of a stored raw query text in bytes (0 is no limit) */
+static int	pg_plan_advsr_raw_query_max_length;
+
+/* weight of the stored row count when a ROWS hint is updated */
+static double pg_plan_advsr_rows_hint_smoothing;
+
+/* compute pgsp_planid from EXPLAIN output as pg_store_plans does */
+static bool pg_plan_advsr_compute_pgsp_planid;
+
+/* fraction of regular statements captured like EXPLAIN ANALYZE */
+static double pg_plan_advsr_capture_sample_rate;
+
+/* min execution time of a captured statement to be stored, in ms */
+static int	pg_plan_advsr_capture_min_duration;
+
+/* instrumentation collected for captured statements */
+typedef enum
+{
+	ADVSR_INSTRUMENT_ROWS,		/* row counts only */
+	ADVSR_INSTRUMENT_BUFFERS,	/* row counts and buffer usage */
+	ADVSR_INSTRUMENT_TIMING		/* everything EXPLAIN ANALYZE collects */
+} AdvsrInstrumentLevel;
+
+static const struct config_enum_entry instrumentation_options[] =
+{
+	{"rows", ADVSR_INSTRUMENT_ROWS, false},
+	{"buffers", ADVSR_INSTRUMENT_BUFFERS, false},
+	{"timing", ADVSR_INSTRUMENT_TIMING, false},
+	{NULL, 0, false}
+};
+
+static int	pg_plan_advsr_instrumentation;
+
+/* recommend parallel workers of each scan by Parallel hints */
+static bool pg_plan_advsr_parallel_hint;
+
+/* min scan time to recommend parallel workers, in ms */
+static int	pg_plan_advsr_parallel_min_scan_time;
+
+/* stop tuning at the fastest plan when the plans converge or oscillate */
+static bool pg_plan_advsr_auto_pin;
+
+/* number of recent planids kept to detect convergence and oscillation */
+static int	pg_plan_advsr_tuning_window;
+
+/* number of executions of an EXPLAIN ANALYZE to measure its time */
+static int	pg_plan_advsr_measure_repeats;
+
+/*
+ * A row set to be stored to plan_repo.  This is what the synchronous path
+ * writes directly and what the asynchronous path passes through the queue.
+ */
+typedef struct PlanInfo
+{
+	int64		norm_query_hash;
+	const char *norm_query;
+	const char *raw_query;
+	int			raw_query_limit;	/* raw_query_limit of the backend */
+	uint64		pgsp_queryid;
+	uint64		pgsp_planid;
+	bool		pgsp_planid_known;	/* false to store NULL */
+	uint64		planid;
+	double		execution_time;
+	double		execution_time_median;
+	double		execution_time_p90;
+	double		shared_hit_ratio;	/* negative if no shared buffer was read */
+	bool		cache_differs;
+	const char *param_values;
+	int64		param_bucket;
+	bool		param_bucket_known;
+	const char *rows_hint;
+	const char *scan_hint;
+	const char *join_hint;
+	const char *lead_hint;
+	double		scan_rows_err;
+	double		scan_err_ratio;
+	double		join_rows_err;
+	double		join_err_ratio;
+	int			scan_cnt;
+	int			join_cnt;
+	const char *application_name;
+	TimestampTz timestamp;
+} PlanInfo;
+
+/* number of string fields of PlanInfo, see plan_info_strings() */
+#define PLAN_INFO_NSTRINGS	8
+
+/*
+ * Header of a PlanInfo record in the shared queue.  The string fields
+ * follow the header as NUL-terminated strings, in plan_info_strings() order.
+ */
+typedef struct PlanRecordHeader
+{
+	uint32		len;			/* total length including this header */
+	Oid			dbid;			/* database of the backend */
+	int64		norm_query_hash;
+	int32		raw_query_limit;
+	uint64		pgsp_queryid;
+	uint64		pgsp_planid;
+	bool		pgsp_planid_known;
+	uint64		planid;
+	double		execution_time;
+	double		execution_time_median;
+	double		execution_time_p90;
+	double		shared_hit_ratio;
+	bool		cache_differs;
+	int64		param_bucket;
+	bool		param_bucket_known;
+	double		scan_rows_err;
+	double		scan_err_ratio;
+	double		join_rows_err;
+	double		join_err_ratio;
+	int32		scan_cnt;
+	int32		join_cnt;
+	TimestampTz timestamp;
+	int32		str_len[PLAN_INFO_NSTRINGS];	/* -1 means NULL */
+} PlanRecordHeader;
+
+/*
+ * Shared state: a byte ring buffer of PlanRecords filled by backends and
+ * drained by the background writer.  head and tail are byte positions that
+ * only increase; the position in the buffer is taken modulo queue_size.
+ */
+typedef struct AdvsrSharedState
+{
+	LWLock	   *card_lock;		/* protects cardinality_hash */
+	LWLock	   *lock;			/* protects the fields below */
+	Latch	   *writer_latch;	/* latch of the writer, NULL if not running */
+	Oid			writer_dbid;	/* database the writer is connected to */
+	uint64		head;			/* next position to write */
+	uint64		tail;			/* next position to read */
+	Size		queue_size;
+	char		queue[FLEXIBLE_ARRAY_MEMBER];
+} AdvsrSharedState;
+
+static AdvsrSharedState *advsr_state = NULL;
+
+/*
+ * Shared hash table of the actual rows of relations learned from EXPLAIN
+ * ANALYZE, keyed by queryId and the set of range table indexes of the
+ * relation.  The planner reads it to correct the row estimates of base
+ * relations, which ROWS hints of pg_hint_plan can't, and of joins without
+ * reading hint_plan.hints, see pg_plan_advsr.scan_correction and
+ * join_correction.  Range table indexes beyond CARDINALITY_MAX_RTI are not
+ * learned.
+ */
+#define CARDINALITY_MAX_RTI		63
+
+typedef struct CardinalityKey
+{
+	Oid			dbid;
+	uint64		queryid;
+	int64		bucket;			/* parameter bucket, see get_param_bucket() */
+	uint64		relids;			/* bitmap of range table indexes */
+} CardinalityKey;
+
+typedef struct CardinalityEntry
+{
+	CardinalityKey key;			/* hash key of entry - MUST BE FIRST */
+	Oid			relid;			/* OID of a base relation, or InvalidOid */
+	double		rows;
+} CardinalityEntry;
+
+static HTAB *cardinality_hash = NULL;
+
+/* flags set by signal handlers of the background writer */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
 /* Saved hook values in case of unload */
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility_hook = NULL;
@@ -149,16 +455,32 @@ static ExecutorStart_hook_type prev_ExecutorStart_hook = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun_hook = NULL;
 static ExecutorFinish_hook_type prev_ExecutorFinish_hook = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif  /* PG_VERSION_NUM */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static set_rel_pathlist_hook_type prev_set_rel_pathlist_hook = NULL;
+static set_join_pathlist_hook_type prev_set_join_pathlist_hook = NULL;
+static planner_hook_type prev_planner_hook = NULL;
 
 void		_PG_init(void);
 void		_PG_fini(void);
 
+/* Background writer for plan_repo */
+PGDLLEXPORT void pg_plan_advsr_writer_main(Datum main_arg);
+
 PG_FUNCTION_INFO_V1(pg_plan_advsr_enable_feedback);
 Datum		pg_plan_advsr_enable_feedback(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(pg_plan_advsr_disable_feedback);
 Datum		pg_plan_advsr_disable_feedback(PG_FUNCTION_ARGS);
 
+PG_FUNCTION_INFO_V1(pg_plan_advsr_auto_tune);
+Datum		pg_plan_advsr_auto_tune(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pg_plan_advsr_reset_cardinalities);
+Datum		pg_plan_advsr_reset_cardinalities(PG_FUNCTION_ARGS);
+
 /* Hook functions for pg_plan_advsr */
 static void pg_plan_advsr_post_parse_analyze_hook(ParseState *pstate, Query *query
 #if PG_VERSION_NUM < 140000
@@ -193,9 +515,33 @@ static void pg_plan_advsr_ExecutorRun_hook(QueryDesc *queryDesc, ScanDirection d
 										   uint64 count, bool execute_once);
 static void pg_plan_advsr_ExecutorFinish_hook(QueryDesc *queryDesc);
 static void pg_plan_advsr_ExecutorEnd_hook(QueryDesc *queryDesc);
+#if PG_VERSION_NUM >= 150000
+static void pg_plan_advsr_shmem_request_hook(void);
+#endif  /* PG_VERSION_NUM */
+static void pg_plan_advsr_shmem_startup_hook(void);
+static void pg_plan_advsr_set_rel_pathlist_hook(PlannerInfo *root,
+												RelOptInfo *rel,
+												Index rti,
+												RangeTblEntry *rte);
+static PlannedStmt *pg_plan_advsr_planner_hook(Query *parse,
+#if PG_VERSION_NUM >= 130000
+											   const char *query_string,
+#endif  /* PG_VERSION_NUM */
+											   int cursorOptions,
+											   ParamListInfo boundParams);
+static int64 get_param_bucket(PlannerInfo *root);
+static bool get_plan_param_bucket(PlannedStmt *pstmt, int64 *bucket);
+static void pg_plan_advsr_set_join_pathlist_hook(PlannerInfo *root,
+												 RelOptInfo *joinrel,
+												 RelOptInfo *outerrel,
+												 RelOptInfo *innerrel,
+												 JoinType jointype,
+												 JoinPathExtraData *extra);
 
 /* Utility functions */
 static bool pg_plan_advsr_query_walker(Node *parsetree);
+static bool is_target_explain(Node *utilityStmt);
+static void clear_capture(void);
 
 
 #if PG_VERSION_NUM < 140000
@@ -205,6 +551,17 @@ static const char *get_query_string(ParseState *pstate, Query *query, Query **ju
 
 /* entry point of pg_plan_advsr */
 void		pg_plan_advsr_ExplainPrintPlan(ExplainState *es, QueryDesc *queryDesc);
+static void reset_analysis_context(void);
+static int	explain_instrument_options(ExplainState *es);
+static void measure_execution(PlannedStmt *plan, const char *queryString,
+							  ParamListInfo params, QueryEnvironment *queryEnv,
+							  int instrument_options);
+static void add_measure_sample(Instrumentation *totaltime);
+static void get_measure_stats(PlanInfo *info);
+static bool runs_to_completion(PlanState *planstate, List *ancestors);
+static void correct_rel_rows(RelOptInfo *rel, double rows);
+static void correct_appendrel_rows(PlannerInfo *root, RelOptInfo *rel, Index rti);
+static void create_hints(QueryDesc *queryDesc);
 
 void		CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 									const char *relationship, const char *plan_name,
@@ -212,12 +569,49 @@ void		CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 
 /* This function called by planstate_tree_walker for creating Leading Hints */
 bool		CreateLeadingHint(PlanState *planstate, LeadingContext * lead);
+static int	get_append_subplans(PlanState *planstate, PlanState ***subplans);
+static void CreateSubPlanHints(List *plans, List *ancestors,
+							   const char *relationship, ExplainState *es);
 
 void		store_info_to_tables(double totaltime, const char *sourcetext); /* store query, hints
 																			 * and diff to tables */
 
+/*
+ * Relids of the subtree of each plan node, indexed by plan_node_id.  They are
+ * computed in one bottom-up pass by ExplainPreScanNode().  Relations of other
+ * query blocks, that is of initPlans, subPlans and subqueries, are not in the
+ * relids of the nodes above them.
+ */
+typedef struct PlanRelidsContext
+{
+	Bitmapset **node_relids;	/* relids of the subtree of each node */
+	int			num_node_relids;	/* allocated length of node_relids */
+	Bitmapset  *relids;			/* relids of the subtree being walked */
+	Bitmapset  *all_relids;		/* relids of all the query blocks */
+} PlanRelidsContext;
+
+static PlanRelidsContext plan_relids;
+
+/* refnames of the rtable of the current plan, indexed by rti */
+static List *refnames_rtable = NIL;
+static char **refnames = NULL;
+static int	num_refnames = 0;
+
+/*
+ * Topmost appendrel parent of each rtable entry of the current plan, indexed
+ * by rti.  A partition or an inheritance child is hinted by the name of its
+ * parent, as pg_hint_plan knows only the relations in the query.
+ */
+static Index *refparents = NULL;
+
 /* these functions based on explain.c */
-bool		ExplainPreScanNode(PlanState *planstate, Bitmapset **rels_used);
+bool		ExplainPreScanNode(PlanState *planstate, PlanRelidsContext *context);
+static void build_refnames(ExplainState *es);
+static Bitmapset *lookup_node_relids(PlanRelidsContext *context,
+									 PlanState *planstate);
+static Bitmapset *get_plan_relids(PlanState *planstate);
+static Index get_parent_rti(Index rti);
+static Bitmapset *get_parent_relids(Bitmapset *relids);
 
 bool		pg_plan_advsr_planstate_tree_walker(PlanState *planstate,
 												bool (*walker) (),
@@ -229,7 +623,102 @@ char	   *get_relnames(ExplainState *es, Relids relids);
 char	   *get_target_relname(Index rti, ExplainState *es);
 
 /* inspired from pg_store_plans.c */
-uint32		create_pgsp_planid(QueryDesc *queryDesc);
+bool		create_pgsp_planid(QueryDesc *queryDesc, uint32 *planid32,
+							   uint64 *planid64);
+
+/*
+ * A catalog entry whose name is printed in a plan text: a relation, or an
+ * entry of the syscache cacheid.
+ */
+typedef struct PlanHashDep
+{
+	int			cacheid;		/* PLAN_HASH_DEP_RELATION for a relation */
+	uint32		value;			/* relation OID, or hash value in the syscache */
+} PlanHashDep;
+
+#define PLAN_HASH_DEP_RELATION	(-1)
+
+/* context of plan_hash_walker */
+typedef struct PlanHashContext
+{
+	uint64		hash;			/* node types, relations, indexes, ... */
+	uint64		exprs;			/* expressions, see plan_hash_expr_walker */
+	List	   *rtable;
+	PlanHashDep *deps;			/* catalog entries the plan text depends on */
+	int			ndeps;
+	int			maxdeps;
+} PlanHashContext;
+
+static void plan_hash_dep(PlanHashContext *ctx, int cacheid, Oid oid);
+static void plan_hash_scan(PlanHashContext *ctx, Index scanrelid);
+static void plan_hash_exprs(PlanHashContext *ctx, void *node);
+static void plan_hash_columns(PlanHashContext *ctx, int ncols,
+							  const AttrNumber *cols);
+static bool plan_hash_expr_walker(Node *node, void *context);
+static bool plan_hash_walker(PlanState *planstate, void *context);
+
+/*
+ * Settings of pg_store_plans that change its plan texts.  They are read
+ * by name, as hooks can't be attached to another module's variables.
+ */
+typedef enum PgspSettingId
+{
+	PGSP_LOG_VERBOSE,
+	PGSP_LOG_BUFFERS,
+	PGSP_LOG_TIMING,
+	PGSP_LOG_TRIGGERS,
+	PGSP_NUM_SETTINGS
+} PgspSettingId;
+
+static const char *const pgsp_setting_names[PGSP_NUM_SETTINGS] = {
+	"pg_store_plans.log_verbose",
+	"pg_store_plans.log_buffers",
+	"pg_store_plans.log_timing",
+	"pg_store_plans.log_triggers",
+};
+
+static bool pgsp_setting_is_on(const char *name);
+
+/*
+ * Cache of pgsp_planid.  EXPLAIN runs only for the first execution of a
+ * plan; the entries are keyed by everything which makes up the plan text
+ * pg_store_plans normalizes.  An entry is dropped when one of the catalog
+ * entries printed in the plan text is invalidated, and the least recently
+ * used one is evicted when the cache is full.
+ */
+typedef struct PgspPlanidKey
+{
+	uint64		queryid;
+	uint64		planid;			/* PlanHashContext.hash */
+	uint64		exprs;			/* PlanHashContext.exprs */
+	uint64		settings;		/* pg_store_plans and EXPLAIN settings */
+} PgspPlanidKey;
+
+typedef struct PgspPlanidEntry
+{
+	PgspPlanidKey key;
+	uint32		pgsp_planid;
+	dlist_node	lru_node;		/* in pgsp_planid_lru */
+	int			ndeps;
+	PlanHashDep *deps;			/* allocated in pgsp_planid_cxt */
+} PgspPlanidEntry;
+
+#define PGSP_PLANID_CACHE_SIZE	1024
+
+static MemoryContext pgsp_planid_cxt = NULL;
+static HTAB *pgsp_planid_cache = NULL;
+/* entries of pgsp_planid_cache, most recently used first */
+static dlist_head pgsp_planid_lru = DLIST_STATIC_INIT(pgsp_planid_lru);
+/* true if the whole cache is to be dropped */
+static bool pgsp_planid_cache_stale = false;
+
+static void pgsp_planid_remove(PgspPlanidEntry *entry);
+static void pgsp_planid_invalidate(int cacheid, uint32 value);
+
+static uint32 explain_pgsp_planid(QueryDesc *queryDesc,
+								  const bool *pgsp_settings);
+static void pgsp_planid_syscache_callback(Datum arg, int cacheid,
+										  uint32 hashvalue);
 
 #if PG_VERSION_NUM < 140000
 /* came from pg_store_plans.c */
@@ -240,42 +729,89 @@ static uint32 hash_query(const char *query);
 /* replace all before strings to after strings in buf strings */
 void		replaceAll(char *buf, const char *before, const char *after);
 
+/* a ROWS hint with an absolute row count, keyed by its sorted relation names */
+typedef struct RowsHintEntry
+{
+	char	   *relnames;		/* relation names sorted and separated by a space */
+	double		rows;			/* row count */
+} RowsHintEntry;
+
+/* merge ROWS hints into one entry per relation set */
+static const char *next_hint(const char *str, const char **start,
+							 const char **body, int *bodylen);
+static char **split_hint_words(const char *body, int len, int *nwords);
+static List *parse_hints(const char *hints, StringInfo others, List *rows_hints,
+						 bool merge);
+static bool parse_rows_hint(const char *body, int len, RowsHintEntry *entry);
+static void build_hints(StringInfo buf, const char *others, List *rows_hints);
+static bool make_hint_set(const PlanInfo *info, Datum *result);
+
 /* calculate the difference between estimated rows and actual rows */
 double		get_diff_rows(double est_rows, double act_rows);
 double		get_diff_ratio(double est_rows, double act_rows);
 
 /* plan_repo.plan_history */
-#define Natts_plan_history					17
+#define Natts_plan_history					25
 #define Anum_plan_history_id				1	/* serial */
-#define Anum_plan_history_norm_query_hash	2	/* text */
+#define Anum_plan_history_norm_query_hash	2	/* bigint */
 #define Anum_plan_history_pgsp_queryid		3	/* bigint */
 #define Anum_plan_history_pgsp_planid		4	/* bigint */
-#define Anum_plan_history_execution_time	5	/* double precision */
-#define Anum_plan_history_rows_hint			6	/* text */
-#define Anum_plan_history_scan_hint			7	/* text */
-#define Anum_plan_history_join_hint			8	/* text */
-#define Anum_plan_history_lead_hint			9	/* text */
-#define Anum_plan_history_diff_of_scans		10	/* double precision */
-#define Anum_plan_history_max_diff_ratio_scan	11	/* double precision */
-#define Anum_plan_history_diff_of_joins		12	/* double precision */
-#define Anum_plan_history_max_diff_ratio_join	13	/* double precision */
-#define Anum_plan_history_scan_cnt			14	/* int */
-#define Anum_plan_history_join_cnt			15	/* int */
-#define Anum_plan_history_application_name	16	/* text */
-#define Anum_plan_history_timestamp			17	/* timestamp */
+#define Anum_plan_history_planid			5	/* bigint */
+#define Anum_plan_history_execution_time	6	/* double precision */
+#define Anum_plan_history_rows_hint			7	/* text */
+#define Anum_plan_history_scan_hint			8	/* text */
+#define Anum_plan_history_join_hint			9	/* text */
+#define Anum_plan_history_lead_hint			10	/* text */
+#define Anum_plan_history_hint_set			11	/* plan_repo.hint[] */
+#define Anum_plan_history_diff_of_scans		12	/* double precision */
+#define Anum_plan_history_max_diff_ratio_scan	13	/* double precision */
+#define Anum_plan_history_diff_of_joins		14	/* double precision */
+#define Anum_plan_history_max_diff_ratio_join	15	/* double precision */
+#define Anum_plan_history_scan_cnt			16	/* int */
+#define Anum_plan_history_join_cnt			17	/* int */
+#define Anum_plan_history_application_name	18	/* text */
+#define Anum_plan_history_timestamp			19	/* timestamp */
+#define Anum_plan_history_execution_time_median	20	/* double precision */
+#define Anum_plan_history_execution_time_p90	21	/* double precision */
+#define Anum_plan_history_shared_hit_ratio	22	/* double precision */
+#define Anum_plan_history_cache_differs		23	/* boolean */
+#define Anum_plan_history_param_values		24	/* text */
+#define Anum_plan_history_param_bucket		25	/* bigint */
+
+/* plan_repo.hint */
+#define Natts_hint							4
+#define Anum_hint_method					1	/* text */
+#define Anum_hint_relids					2	/* text[] */
+#define Anum_hint_rows						3	/* double precision */
+#define Anum_hint_workers					4	/* int */
 
 /* plan_repo.norm_queries */
 #define Natts_norm_queries					2
-#define Anum_norm_queries_norm_query_hash	1	/* text */
+#define Anum_norm_queries_norm_query_hash	1	/* bigint */
 #define Anum_norm_queries_norm_query_string	2	/* text */
 
 /* plan_repo.raw_queries */
 #define Natts_raw_queries					4
-#define Anum_raw_queries_norm_query_hash	1	/* text */
+#define Anum_raw_queries_norm_query_hash	1	/* bigint */
 #define Anum_raw_queries_raw_query_id		2	/* serial */
 #define Anum_raw_queries_raw_query_string	3	/* text */
 #define Anum_raw_queries_timestamp			4	/* timestamp */
 
+/* plan_repo.tuning_state */
+#define Natts_tuning_state					12
+#define Anum_tuning_state_norm_query_hash	1	/* bigint */
+#define Anum_tuning_state_application_name	2	/* text */
+#define Anum_tuning_state_state				3	/* text */
+#define Anum_tuning_state_iterations		4	/* int */
+#define Anum_tuning_state_planids			5	/* bigint[] */
+#define Anum_tuning_state_best_planid		6	/* bigint */
+#define Anum_tuning_state_best_execution_time	7	/* double precision */
+#define Anum_tuning_state_best_hints		8	/* text */
+#define Anum_tuning_state_join_rows_err		9	/* double precision */
+#define Anum_tuning_state_timestamp			10	/* timestamp */
+#define Anum_tuning_state_best_hit_ratio	11	/* double precision */
+#define Anum_tuning_state_cache_differs		12	/* boolean */
+
 /* hint_plan.hints */
 #define Natts_hints							4
 #define Anum_hints_id						1	/* serial */
@@ -283,20 +819,174 @@ double		get_diff_ratio(double est_rows, double act_rows);
 #define Anum_hints_application_name			3	/* text */
 #define Anum_hints_hints					4	/* text */
 
+/*
+ * OIDs of the tables used to store plans and hints, resolved once per backend.
+ * Relation OIDs are InvalidOid if the relation does not exist.
+ */
+typedef struct AdvsrCatalogOids
+{
+	bool		valid;			/* all fields are up to date */
+	Oid			ext_owner;		/* owner of pg_plan_advsr, if checked */
+	Oid			plan_history;
+	Oid			plan_history_id_seq;
+	Oid			norm_queries;
+	Oid			raw_queries;
+	Oid			raw_queries_raw_query_id_seq;
+	Oid			raw_queries_norm_query_hash_idx;
+	Oid			tuning_state;
+	Oid			tuning_state_pkey;
+	Oid			hints;
+	Oid			hints_id_seq;
+	Oid			hints_norm_and_app;
+	Oid			hint_type;		/* plan_repo.hint */
+} AdvsrCatalogOids;
+
+static AdvsrCatalogOids catalog_oids;
+
+/* saved plans of INSERT INTO plan_repo tables, see insertPlanHistory() */
+static SPIPlanPtr plan_history_insert_plan = NULL;
+static SPIPlanPtr norm_queries_insert_plan = NULL;
+static bool insert_plans_stale = false;
+
+static const AdvsrCatalogOids *getCatalogOids(void);
+static void invalidate_catalog_oids(void);
+static void advsr_relcache_callback(Datum arg, Oid relid);
+static void advsr_syscache_callback(Datum arg, int cacheid, uint32 hashvalue);
 static Oid	extensionOwner(void);
-static Oid	resolveRelationId(text *relationName, bool missingOk);
-static uint64 getNextVal(const char *sequence);
-static bool insertPlanHistory(const char *norm_query_hash, const uint64 pgsp_queryid, const uint64 pgsp_planid,
-							  const double execution_time, const char *rows_hint, const char *scan_hint,
-							  const char *join_hint, const char *lead_hint,
-							  const double diff_of_scans, const double max_diff_ratio_scan,
-							  const double diff_of_joins, const double max_diff_ratio_join,
-							  const int scan_cnt, const int join_cnt, char *application_name);
-static bool insertNormQueries(const char *norm_query_hash, const char *norm_query_string);
-static bool insertRawQueries(const char *raw_query_hash, const char *raw_query_string);
+static uint64 getNextVal(Oid sequenceId);
+static void free_stale_insert_plans(void);
+static bool insertPlanHistory(const PlanInfo *info);
+static bool insertNormQueries(int64 norm_query_hash, const char *norm_query_string);
+static bool insertRawQueries(int64 raw_query_hash, const char *raw_query_string,
+							 int raw_query_limit, TimestampTz timestamp);
+static bool insertPlanHistoryBatch(const PlanInfo *infos, int ninfos);
+static bool insertNormQueriesBatch(const PlanInfo *infos, int ninfos);
+static bool insertRawQueriesBatch(const PlanInfo *infos, int ninfos);
+static void lockHints(const char *norm_query_string, const char *application_name);
 static void selectHints(const char *norm_query_string, const char *application_name, StringInfo prev_rows_hint);
 static bool deleteHints(const char *norm_query_string, const char *application_name);
 static bool insertHints(const char *norm_query_string, const char *application_name, const char *hints);
+static void store_plan_info(const PlanInfo *info);
+
+/*
+ * What to do with the hints of a query after updating its tuning state, see
+ * updateTuningState().
+ */
+typedef enum
+{
+	TUNING_CONTINUE,			/* keep updating ROWS hints */
+	TUNING_PIN,					/* tuning has just ended, pin the best plan */
+	TUNING_STOPPED				/* tuning ended before, leave hints alone */
+} TuningAction;
+
+static TuningAction updateTuningState(const PlanInfo *info, char **best_hints);
+
+/* Shared queue and background writer */
+static Size pg_plan_advsr_queue_memsize(void);
+static Size pg_plan_advsr_memsize(void);
+static const char *writer_unavailable_reason(void);
+static bool enqueue_plan_info(const PlanInfo *info);
+static bool store_plan_info_batch(const PlanInfo *infos, int ninfos);
+static bool store_queued_plan_info(const PlanInfo *info);
+static void drain_plan_queue(MemoryContext batchcxt);
+static void prepare_plan_history_partitions(void);
+
+static int64 count_raw_queries(Relation rel, Oid indexId, int64 norm_query_hash,
+								int limit);
+static void pg_plan_advsr_xact_callback(XactEvent event, void *arg);
+
+/*
+ * Return the OIDs of plan_repo and hint_plan tables.  They are looked up
+ * only when the cache was invalidated, see advsr_relcache_callback() and
+ * advsr_syscache_callback().
+ */
+static const AdvsrCatalogOids *
+getCatalogOids(void)
+{
+	Oid			plan_repo;
+	Oid			hint_plan;
+
+	if (catalog_oids.valid)
+		return &catalog_oids;
+
+	plan_repo = LookupExplicitNamespace("plan_repo", true);
+	hint_plan = LookupExplicitNamespace("hint_plan", true);
+
+	catalog_oids.ext_owner = InvalidOid;
+	catalog_oids.plan_history = get_relname_relid("plan_history", plan_repo);
+	catalog_oids.plan_history_id_seq = get_relname_relid("plan_history_id_seq", plan_repo);
+	catalog_oids.norm_queries = get_relname_relid("norm_queries", plan_repo);
+	catalog_oids.raw_queries = get_relname_relid("raw_queries", plan_repo);
+	catalog_oids.raw_queries_raw_query_id_seq = get_relname_relid("raw_queries_raw_query_id_seq", plan_repo);
+	catalog_oids.raw_queries_norm_query_hash_idx = get_relname_relid("raw_queries_norm_query_hash_idx", plan_repo);
+	catalog_oids.tuning_state = get_relname_relid("tuning_state", plan_repo);
+	catalog_oids.tuning_state_pkey = get_relname_relid("tuning_state_pkey", plan_repo);
+	catalog_oids.hints = get_relname_relid("hints", hint_plan);
+	catalog_oids.hints_id_seq = get_relname_relid("hints_id_seq", hint_plan);
+	catalog_oids.hints_norm_and_app = get_relname_relid("hints_norm_and_app", hint_plan);
+	catalog_oids.hint_type = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+											 CStringGetDatum("hint"),
+											 ObjectIdGetDatum(plan_repo));
+
+	/*
+	 * Keep looking up while either extension is missing, since creating
+	 * tables in an existing schema is not noticed by the callbacks.
+	 */
+	catalog_oids.valid = OidIsValid(plan_repo) && OidIsValid(hint_plan);
+
+	return &catalog_oids;
+}
+
+static void
+invalidate_catalog_oids(void)
+{
+	catalog_oids.valid = false;
+
+	/* The plans may be running now; they are freed before the next use */
+	insert_plans_stale = true;
+}
+
+/*
+ * Relcache callback: forget the cached OIDs if one of the cached relations
+ * is dropped or altered, or the whole relcache is reset.  The cached
+ * pgsp_planids of the plans which print the relation are forgotten too.
+ */
+static void
+advsr_relcache_callback(Datum arg, Oid relid)
+{
+	/* relation, column and index names are printed in the plan texts */
+	if (!OidIsValid(relid))
+		pgsp_planid_cache_stale = true;
+	else
+		pgsp_planid_invalidate(PLAN_HASH_DEP_RELATION, relid);
+
+	if (!catalog_oids.valid)
+		return;
+
+	if (!OidIsValid(relid) ||
+		relid == catalog_oids.plan_history ||
+		relid == catalog_oids.plan_history_id_seq ||
+		relid == catalog_oids.norm_queries ||
+		relid == catalog_oids.raw_queries ||
+		relid == catalog_oids.raw_queries_raw_query_id_seq ||
+		relid == catalog_oids.raw_queries_norm_query_hash_idx ||
+		relid == catalog_oids.tuning_state ||
+		relid == catalog_oids.tuning_state_pkey ||
+		relid == catalog_oids.hints ||
+		relid == catalog_oids.hints_id_seq ||
+		relid == catalog_oids.hints_norm_and_app)
+		invalidate_catalog_oids();
+}
+
+/*
+ * Syscache callback for pg_namespace and pg_authid: schemas are created and
+ * dropped by CREATE/DROP EXTENSION, and the owner may lose superuser.
+ */
+static void
+advsr_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	invalidate_catalog_oids();
+}
 
 /*
  * Return pg_plan_advsr owner's Oid.
@@ -311,6 +1001,9 @@ extensionOwner(void)
 	Form_pg_extension extensionForm = NULL;
 	Oid			extensionOwner;
 
+	if (getCatalogOids()->valid && OidIsValid(catalog_oids.ext_owner))
+		return catalog_oids.ext_owner;
+
 	relation = table_open(ExtensionRelationId, AccessShareLock);
 
 	ScanKeyInit(&entry[0], Anum_pg_extension_extname,
@@ -337,39 +1030,27 @@ extensionOwner(void)
 	systable_endscan(scandesc);
 	table_close(relation, AccessShareLock);
 
-	return extensionOwner;
-}
-
-/*
- * Return relationname's Oid
- */
-static Oid
-resolveRelationId(text *relationName, bool missingOk)
-{
-	List	   *relationNameList = NIL;
-	RangeVar   *relation = NULL;
-	Oid			relationId = InvalidOid;
-
-	relationNameList = textToQualifiedNameList(relationName);
-	relation = makeRangeVarFromNameList(relationNameList);
-	relationId = RangeVarGetRelid(relation, NoLock, missingOk);
+	if (catalog_oids.valid)
+		catalog_oids.ext_owner = extensionOwner;
 
-	return relationId;
+	return extensionOwner;
 }
 
 /*
  * Get nextVal of the specified sequence
  */
 static uint64
-getNextVal(const char *sequence)
+getNextVal(Oid sequenceId)
 {
-	Oid			sequenceId = InvalidOid;
 	Datum		sequenceIdDatum = 0;
 	Oid			savedUserId = InvalidOid;
 	int			savedSecurityContext = 0;
 	Datum		nextValDatum = 0;
 
-	sequenceId = resolveRelationId(cstring_to_text(sequence), false);
+	if (!OidIsValid(sequenceId))
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("sequence used by pg_plan_advsr does not exist")));
+
 	sequenceIdDatum = ObjectIdGetDatum(sequenceId);
 	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
 	SetUserIdAndSecContext(extensionOwner(), SECURITY_LOCAL_USERID_CHANGE);
@@ -380,159 +1061,405 @@ getNextVal(const char *sequence)
 }
 
 /*
- * Insert a row into plan_repo.plan_history table.
+ * Free the saved INSERT plans if the tables may have changed since they were
+ * prepared.  Called in an SPI connection.
  */
-static bool
-insertPlanHistory(const char *norm_query_hash, const uint64 pgsp_queryid, const uint64 pgsp_planid,
-				  const double execution_time, const char *rows_hint, const char *scan_hint,
-				  const char *join_hint, const char *lead_hint,
-				  const double diff_of_scans, const double max_diff_ratio_scan,
-				  const double diff_of_joins, const double max_diff_ratio_join,
-				  const int scan_cnt, const int join_cnt, char *application_name)
+static void
+free_stale_insert_plans(void)
 {
-	Relation	rel = NULL;
-	TupleDesc	tupleDescriptor = NULL;
-	HeapTuple	heapTuple = NULL;
-	Datum		values[Natts_plan_history];
-	bool		isNulls[Natts_plan_history];
+	/* Parameter types of the plans may be gone with the extension */
+	if (!insert_plans_stale)
+		return;
 
-	Oid			relationId = get_relname_relid("plan_history", LookupExplicitNamespace("plan_repo", true));
+	if (plan_history_insert_plan != NULL)
+		SPI_freeplan(plan_history_insert_plan);
+	if (norm_queries_insert_plan != NULL)
+		SPI_freeplan(norm_queries_insert_plan);
+	plan_history_insert_plan = NULL;
+	norm_queries_insert_plan = NULL;
+	insert_plans_stale = false;
+}
 
-	if (relationId == InvalidOid)
-		return false;
+/* columns of plan_repo.plan_history in the order of Anum_plan_history_* */
+#define PLAN_HISTORY_COLUMNS \
+	"id, norm_query_hash, pgsp_queryid, pgsp_planid, planid, " \
+	"execution_time, rows_hint, scan_hint, join_hint, lead_hint, hint_set, " \
+	"scan_rows_err, scan_err_ratio, join_rows_err, join_err_ratio, " \
+	"scan_cnt, join_cnt, application_name, timestamp, " \
+	"execution_time_median, execution_time_p90, " \
+	"shared_hit_ratio, cache_differs, param_values, param_bucket"
+
+/*
+ * Max number of rows inserted by one multi-row INSERT of the background
+ * writer.  It keeps the number of parameters below the limit of 65535.
+ */
+#define PLAN_REPO_BATCH_ROWS	1000
+
+/*
+ * Get the parameter types of an INSERT of a plan_history row.
+ */
+static void
+plan_history_argtypes(Oid *argtypes)
+{
+	static const Oid types[Natts_plan_history] = {
+		INT4OID, INT8OID, INT8OID, INT8OID, INT8OID, FLOAT8OID,
+		TEXTOID, TEXTOID, TEXTOID, TEXTOID, InvalidOid,
+		FLOAT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID,
+		INT4OID, INT4OID, TEXTOID, TIMESTAMPOID,
+		FLOAT8OID, FLOAT8OID, FLOAT8OID, BOOLOID,
+		TEXTOID, INT8OID
+	};
+
+	memcpy(argtypes, types, sizeof(types));
+	argtypes[Anum_plan_history_hint_set - 1] = get_array_type(catalog_oids.hint_type);
+}
+
+/*
+ * Form the parameters of an INSERT of a plan_history row.  nulls is in the
+ * format of SPI_execute_plan().
+ */
+static void
+form_plan_history_values(const PlanInfo *info, Datum *values, char *nulls)
+{
+	bool		isNulls[Natts_plan_history];
+	int			i;
 
 	/* form new shard tuple */
-	memset(values, 0, sizeof(values));
+	memset(values, 0, sizeof(Datum) * Natts_plan_history);
 	memset(isNulls, false, sizeof(isNulls));
 
-	values[Anum_plan_history_id - 1] = Int64GetDatum(getNextVal("plan_repo.plan_history_id_seq"));
+	values[Anum_plan_history_id - 1] = Int32GetDatum((int32) getNextVal(catalog_oids.plan_history_id_seq));
 	isNulls[Anum_plan_history_id - 1] = false;
 
-	values[Anum_plan_history_norm_query_hash - 1] = CStringGetTextDatum(norm_query_hash);
-	isNulls[Anum_plan_history_norm_query_hash - 1] = (norm_query_hash == NULL) ? true : false;
+	values[Anum_plan_history_norm_query_hash - 1] = Int64GetDatum(info->norm_query_hash);
+	isNulls[Anum_plan_history_norm_query_hash - 1] = false;
 
 #if PG_VERSION_NUM >= 140000
-	values[Anum_plan_history_pgsp_queryid - 1] = Int64GetDatum(pgsp_queryid);
+	values[Anum_plan_history_pgsp_queryid - 1] = Int64GetDatum(info->pgsp_queryid);
 #else
-	values[Anum_plan_history_pgsp_queryid - 1] = Int32GetDatum(pgsp_queryid);
+	values[Anum_plan_history_pgsp_queryid - 1] = Int32GetDatum(info->pgsp_queryid);
 #endif  /* PG_VERSION_NUM */
 	isNulls[Anum_plan_history_pgsp_queryid - 1] = false;
 
-	values[Anum_plan_history_pgsp_planid - 1] = Int64GetDatum(pgsp_planid);
-	isNulls[Anum_plan_history_pgsp_planid - 1] = false;
-	values[Anum_plan_history_execution_time - 1] = Float8GetDatum(execution_time);
+	values[Anum_plan_history_pgsp_planid - 1] = Int64GetDatum(info->pgsp_planid);
+	isNulls[Anum_plan_history_pgsp_planid - 1] = !info->pgsp_planid_known;
+	values[Anum_plan_history_planid - 1] = Int64GetDatum(info->planid);
+	isNulls[Anum_plan_history_planid - 1] = false;
+	values[Anum_plan_history_execution_time - 1] = Float8GetDatum(info->execution_time);
 	isNulls[Anum_plan_history_execution_time - 1] = false;
-	values[Anum_plan_history_rows_hint - 1] = CStringGetTextDatum(rows_hint);
-	isNulls[Anum_plan_history_rows_hint - 1] = (rows_hint == NULL) ? true : false;
-	values[Anum_plan_history_scan_hint - 1] = CStringGetTextDatum(scan_hint);
-	isNulls[Anum_plan_history_scan_hint - 1] = (scan_hint == NULL) ? true : false;
-	values[Anum_plan_history_join_hint - 1] = CStringGetTextDatum(join_hint);
-	isNulls[Anum_plan_history_join_hint - 1] = (join_hint == NULL) ? true : false;
-	values[Anum_plan_history_lead_hint - 1] = CStringGetTextDatum(lead_hint);
-	isNulls[Anum_plan_history_lead_hint - 1] = (lead_hint == NULL) ? true : false;
-
-	values[Anum_plan_history_diff_of_scans - 1] = Float8GetDatum(diff_of_scans);
+	values[Anum_plan_history_rows_hint - 1] = CStringGetTextDatum(info->rows_hint);
+	isNulls[Anum_plan_history_rows_hint - 1] = (info->rows_hint == NULL) ? true : false;
+	values[Anum_plan_history_scan_hint - 1] = CStringGetTextDatum(info->scan_hint);
+	isNulls[Anum_plan_history_scan_hint - 1] = (info->scan_hint == NULL) ? true : false;
+	values[Anum_plan_history_join_hint - 1] = CStringGetTextDatum(info->join_hint);
+	isNulls[Anum_plan_history_join_hint - 1] = (info->join_hint == NULL) ? true : false;
+	values[Anum_plan_history_lead_hint - 1] = CStringGetTextDatum(info->lead_hint);
+	isNulls[Anum_plan_history_lead_hint - 1] = (info->lead_hint == NULL) ? true : false;
+	isNulls[Anum_plan_history_hint_set - 1] =
+		!make_hint_set(info, &values[Anum_plan_history_hint_set - 1]);
+
+	values[Anum_plan_history_diff_of_scans - 1] = Float8GetDatum(info->scan_rows_err);
 	isNulls[Anum_plan_history_diff_of_scans - 1] = false;
-	values[Anum_plan_history_max_diff_ratio_scan - 1] = Float8GetDatum(max_diff_ratio_scan);
+	values[Anum_plan_history_max_diff_ratio_scan - 1] = Float8GetDatum(info->scan_err_ratio);
 	isNulls[Anum_plan_history_max_diff_ratio_scan - 1] = false;
 
-	values[Anum_plan_history_diff_of_joins - 1] = Float8GetDatum(diff_of_joins);
+	values[Anum_plan_history_diff_of_joins - 1] = Float8GetDatum(info->join_rows_err);
 	isNulls[Anum_plan_history_diff_of_joins - 1] = false;
-	values[Anum_plan_history_max_diff_ratio_join - 1] = Float8GetDatum(max_diff_ratio_join);
+	values[Anum_plan_history_max_diff_ratio_join - 1] = Float8GetDatum(info->join_err_ratio);
 	isNulls[Anum_plan_history_max_diff_ratio_join - 1] = false;
 
-	values[Anum_plan_history_scan_cnt - 1] = Int32GetDatum(scan_cnt);
+	values[Anum_plan_history_scan_cnt - 1] = Int32GetDatum(info->scan_cnt);
 	isNulls[Anum_plan_history_scan_cnt - 1] = false;
-	values[Anum_plan_history_join_cnt - 1] = Int32GetDatum(join_cnt);
+	values[Anum_plan_history_join_cnt - 1] = Int32GetDatum(info->join_cnt);
 	isNulls[Anum_plan_history_join_cnt - 1] = false;
 
-	values[Anum_plan_history_application_name - 1] = CStringGetTextDatum(application_name);
-	isNulls[Anum_plan_history_application_name - 1] = (application_name == NULL) ? true : false;
-	values[Anum_plan_history_timestamp - 1] = TimestampGetDatum(GetCurrentTimestamp());
+	values[Anum_plan_history_application_name - 1] = CStringGetTextDatum(info->application_name);
+	isNulls[Anum_plan_history_application_name - 1] = (info->application_name == NULL) ? true : false;
+	values[Anum_plan_history_timestamp - 1] = TimestampGetDatum(info->timestamp);
 	isNulls[Anum_plan_history_timestamp - 1] = false;
 
-	rel = table_open(relationId, RowExclusiveLock);
-	if (rel == NULL)
-		return false;
-	tupleDescriptor = RelationGetDescr(rel);
-	heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
-	CatalogTupleInsert(rel, heapTuple);
-	CommandCounterIncrement();
-	table_close(rel, NoLock);
-
-	return true;
+	values[Anum_plan_history_execution_time_median - 1] = Float8GetDatum(info->execution_time_median);
+	isNulls[Anum_plan_history_execution_time_median - 1] = false;
+	values[Anum_plan_history_execution_time_p90 - 1] = Float8GetDatum(info->execution_time_p90);
+	isNulls[Anum_plan_history_execution_time_p90 - 1] = false;
+	values[Anum_plan_history_shared_hit_ratio - 1] = Float8GetDatum(info->shared_hit_ratio);
+	isNulls[Anum_plan_history_shared_hit_ratio - 1] = (info->shared_hit_ratio < 0);
+	values[Anum_plan_history_cache_differs - 1] = BoolGetDatum(info->cache_differs);
+	isNulls[Anum_plan_history_cache_differs - 1] = false;
+	isNulls[Anum_plan_history_param_values - 1] = (info->param_values == NULL);
+	if (info->param_values != NULL)
+		values[Anum_plan_history_param_values - 1] = CStringGetTextDatum(info->param_values);
+	values[Anum_plan_history_param_bucket - 1] = Int64GetDatum(info->param_bucket);
+	isNulls[Anum_plan_history_param_bucket - 1] = !info->param_bucket_known;
+
+	for (i = 0; i < Natts_plan_history; i++)
+		nulls[i] = isNulls[i] ? 'n' : ' ';
 }
 
 /*
- * Insert a row into plan_repo.norm_queries table.
+ * Insert a row into plan_repo.plan_history table.
+ *
+ * plan_history is partitioned by timestamp, so unlike the other tables the
+ * row is inserted through SPI to let the executor route it to a partition.
  */
 static bool
-insertNormQueries(const char *norm_query_hash, const char *norm_query_string)
+insertPlanHistory(const PlanInfo *info)
 {
-	Relation	rel = NULL;
-	TupleDesc	tupleDescriptor = NULL;
-	HeapTuple	heapTuple = NULL;
-	Datum		values[Natts_norm_queries];
-	bool		isNulls[Natts_norm_queries];
-	Oid			relationId = get_relname_relid("norm_queries", LookupExplicitNamespace("plan_repo", true));
+	Datum		values[Natts_plan_history];
+	char		nulls[Natts_plan_history];
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+	int			ret;
+
+	Oid			relationId = getCatalogOids()->plan_history;
 
 	if (relationId == InvalidOid)
 		return false;
 
-	/* form new shard tuple */
-	memset(values, 0, sizeof(values));
-	memset(isNulls, false, sizeof(isNulls));
+	form_plan_history_values(info, values, nulls);
 
-	values[Anum_norm_queries_norm_query_hash - 1] = CStringGetTextDatum(norm_query_hash);
-	isNulls[Anum_norm_queries_norm_query_hash - 1] = (norm_query_hash == NULL) ? true : false;
-	values[Anum_norm_queries_norm_query_string - 1] = CStringGetTextDatum(norm_query_string);
-	isNulls[Anum_norm_queries_norm_query_string - 1] = (norm_query_string == NULL) ? true : false;
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
 
-	rel = table_open(relationId, RowExclusiveLock);
-	if (rel == NULL)
-		return false;
-	tupleDescriptor = RelationGetDescr(rel);
-	heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
-	CatalogTupleInsert(rel, heapTuple);
-	CommandCounterIncrement();
-	table_close(rel, NoLock);
+	free_stale_insert_plans();
+	if (plan_history_insert_plan == NULL)
+	{
+		Oid			argtypes[Natts_plan_history];
+		SPIPlanPtr	plan;
+
+		plan_history_argtypes(argtypes);
+		plan = SPI_prepare("INSERT INTO plan_repo.plan_history "
+						   "(" PLAN_HISTORY_COLUMNS ") "
+						   "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, "
+						   "$11, $12, $13, $14, $15, $16, $17, $18, $19, "
+						   "$20, $21, $22, $23, $24, $25)",
+						   Natts_plan_history, argtypes);
+		if (plan == NULL)
+			elog(ERROR, "SPI_prepare failed: %s",
+				 SPI_result_code_string(SPI_result));
+		SPI_keepplan(plan);
+		plan_history_insert_plan = plan;
+	}
+
+	/* Users have only SELECT privilege on plan_history */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(extensionOwner(), SECURITY_LOCAL_USERID_CHANGE);
+	ret = SPI_execute_plan(plan_history_insert_plan, values, nulls, false, 0);
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute_plan failed: %s", SPI_result_code_string(ret));
+
+	SPI_finish();
 
 	return true;
 }
 
 /*
- * Insert a row into plan_repo.raw_queries table.
+ * Append the parameter placeholders of a row of a multi-row INSERT, which is
+ * the nrow-th row of natts columns, to sql.
  */
-static bool
-insertRawQueries(const char *raw_query_hash, const char *raw_query_string)
+static void
+append_values_row(StringInfo sql, int nrow, int natts)
 {
-	Relation	rel = NULL;
-	TupleDesc	tupleDescriptor = NULL;
-	HeapTuple	heapTuple = NULL;
-	Datum		values[Natts_raw_queries];
-	bool		isNulls[Natts_raw_queries];
+	int			i;
 
-	Oid			relationId = get_relname_relid("raw_queries", LookupExplicitNamespace("plan_repo", true));
+	appendStringInfoString(sql, nrow > 0 ? ", (" : "(");
+	for (i = 0; i < natts; i++)
+		appendStringInfo(sql, "%s$%d", i > 0 ? ", " : "", nrow * natts + i + 1);
+	appendStringInfoChar(sql, ')');
+}
 
-	if (relationId == InvalidOid)
+/*
+ * Insert the rows of PlanInfos into plan_repo.plan_history by multi-row
+ * INSERTs, up to PLAN_REPO_BATCH_ROWS rows each.  This is what the background
+ * writer does instead of insertPlanHistory().  Called in an SPI connection.
+ */
+static bool
+insertPlanHistoryBatch(const PlanInfo *infos, int ninfos)
+{
+	Oid			rowtypes[Natts_plan_history];
+	Oid		   *argtypes;
+	Datum	   *values;
+	char	   *nulls;
+	StringInfoData sql;
+	int			start;
+
+	if (getCatalogOids()->plan_history == InvalidOid)
 		return false;
 
-	/* form new shard tuple */
-	memset(values, 0, sizeof(values));
-	memset(isNulls, false, sizeof(isNulls));
+	plan_history_argtypes(rowtypes);
+	argtypes = palloc(sizeof(Oid) * Natts_plan_history * PLAN_REPO_BATCH_ROWS);
+	values = palloc(sizeof(Datum) * Natts_plan_history * PLAN_REPO_BATCH_ROWS);
+	nulls = palloc(sizeof(char) * Natts_plan_history * PLAN_REPO_BATCH_ROWS);
+	initStringInfo(&sql);
 
-	values[Anum_raw_queries_norm_query_hash - 1] = CStringGetTextDatum(raw_query_hash);
-	isNulls[Anum_raw_queries_norm_query_hash - 1] = (raw_query_hash == NULL) ? true : false;
-	values[Anum_raw_queries_raw_query_id - 1] = Int64GetDatum(getNextVal("plan_repo.raw_queries_raw_query_id_seq"));
-	isNulls[Anum_raw_queries_raw_query_id - 1] = false;
-	values[Anum_raw_queries_raw_query_string - 1] = CStringGetTextDatum(raw_query_string);
-	isNulls[Anum_raw_queries_raw_query_string - 1] = (raw_query_string == NULL) ? true : false;
-	values[Anum_raw_queries_timestamp - 1] = TimestampGetDatum(GetCurrentTimestamp());
-	isNulls[Anum_raw_queries_timestamp - 1] = false;
+	for (start = 0; start < ninfos; start += PLAN_REPO_BATCH_ROWS)
+	{
+		int			nrows = Min(ninfos - start, PLAN_REPO_BATCH_ROWS);
+		int			ret;
+		int			i;
+
+		resetStringInfo(&sql);
+		appendStringInfoString(&sql, "INSERT INTO plan_repo.plan_history "
+							   "(" PLAN_HISTORY_COLUMNS ") VALUES ");
+		for (i = 0; i < nrows; i++)
+		{
+			form_plan_history_values(&infos[start + i],
+									 values + i * Natts_plan_history,
+									 nulls + i * Natts_plan_history);
+			memcpy(argtypes + i * Natts_plan_history, rowtypes, sizeof(rowtypes));
+			append_values_row(&sql, i, Natts_plan_history);
+		}
 
-	rel = table_open(relationId, RowExclusiveLock);
-	if (rel == NULL)
+		ret = SPI_execute_with_args(sql.data, nrows * Natts_plan_history,
+									argtypes, values, nulls, false, 0);
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "SPI_execute_with_args failed: %s",
+				 SPI_result_code_string(ret));
+	}
+
+	pfree(sql.data);
+	pfree(argtypes);
+	pfree(values);
+	pfree(nulls);
+
+	return true;
+}
+
+/*
+ * Insert a row into plan_repo.norm_queries table unless the norm_query_hash
+ * is already stored.
+ *
+ * ON CONFLICT DO NOTHING lets concurrent sessions insert other normalized
+ * queries without waiting, and one of them inserting the same row waits only
+ * for the other to end.
+ */
+static bool
+insertNormQueries(int64 norm_query_hash, const char *norm_query_string)
+{
+	Datum		values[Natts_norm_queries];
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+	int			ret;
+
+	if (getCatalogOids()->norm_queries == InvalidOid)
+		return false;
+
+	if (norm_query_string == NULL)
+		return true;
+
+	values[Anum_norm_queries_norm_query_hash - 1] = Int64GetDatum(norm_query_hash);
+	values[Anum_norm_queries_norm_query_string - 1] = CStringGetTextDatum(norm_query_string);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	free_stale_insert_plans();
+	if (norm_queries_insert_plan == NULL)
+	{
+		Oid			argtypes[Natts_norm_queries] = {INT8OID, TEXTOID};
+		SPIPlanPtr	plan;
+
+		plan = SPI_prepare("INSERT INTO plan_repo.norm_queries "
+						   "(norm_query_hash, norm_query_string) VALUES ($1, $2) "
+						   "ON CONFLICT (norm_query_hash) DO NOTHING",
+						   Natts_norm_queries, argtypes);
+		if (plan == NULL)
+			elog(ERROR, "SPI_prepare failed: %s",
+				 SPI_result_code_string(SPI_result));
+		SPI_keepplan(plan);
+		norm_queries_insert_plan = plan;
+	}
+
+	/* Users have only SELECT privilege on norm_queries */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(extensionOwner(), SECURITY_LOCAL_USERID_CHANGE);
+	ret = SPI_execute_plan(norm_queries_insert_plan, values, NULL, false, 0);
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute_plan failed: %s", SPI_result_code_string(ret));
+	if (SPI_processed == 0)
+		elog(DEBUG3, "norm_queries: " INT64_FORMAT " is already stored", norm_query_hash);
+
+	SPI_finish();
+
+	return true;
+}
+
+/*
+ * Count raw_queries rows of norm_query_hash, stopping at limit.  The count is
+ * not cached since purge_raw_queries() may delete rows anytime.
+ */
+static int64
+count_raw_queries(Relation rel, Oid indexId, int64 norm_query_hash, int limit)
+{
+	ScanKeyData scanKey[1];
+	SysScanDesc scanDescriptor = NULL;
+	int64		count = 0;
+
+	ScanKeyInit(&scanKey[0], Anum_raw_queries_norm_query_hash,
+				BTEqualStrategyNumber, F_INT8EQ, Int64GetDatum(norm_query_hash));
+	scanDescriptor = systable_beginscan(rel, indexId, OidIsValid(indexId),
+										NULL, 1, scanKey);
+	while (count < limit &&
+		   HeapTupleIsValid(systable_getnext(scanDescriptor)))
+		count++;
+	systable_endscan(scanDescriptor);
+
+	return count;
+}
+
+/*
+ * Insert a row into plan_repo.raw_queries table unless norm_query_hash has
+ * raw_query_limit rows already.  raw_query_string is NULL if the text was not
+ * sampled, see store_info_to_tables().  raw_query_limit is that of the
+ * backend which ran the query, not of the background writer.
+ */
+static bool
+insertRawQueries(int64 raw_query_hash, const char *raw_query_string,
+				 int raw_query_limit, TimestampTz timestamp)
+{
+	Relation	rel = NULL;
+	TupleDesc	tupleDescriptor = NULL;
+	HeapTuple	heapTuple = NULL;
+	Datum		values[Natts_raw_queries];
+	bool		isNulls[Natts_raw_queries];
+	Oid			relationId = getCatalogOids()->raw_queries;
+	Oid			indexId = catalog_oids.raw_queries_norm_query_hash_idx;
+
+	if (relationId == InvalidOid)
+		return false;
+
+	if (raw_query_string == NULL)
+		return true;
+
+	rel = table_open(relationId, RowExclusiveLock);
+	if (rel == NULL)
 		return false;
+
+	if (raw_query_limit >= 0 &&
+		count_raw_queries(rel, indexId, raw_query_hash, raw_query_limit) >= raw_query_limit)
+	{
+		elog(DEBUG3, "raw_queries: " INT64_FORMAT " has enough rows", raw_query_hash);
+		table_close(rel, NoLock);
+		return true;
+	}
+
+	/* form new shard tuple */
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
+
+	values[Anum_raw_queries_norm_query_hash - 1] = Int64GetDatum(raw_query_hash);
+	isNulls[Anum_raw_queries_norm_query_hash - 1] = false;
+	values[Anum_raw_queries_raw_query_id - 1] = Int64GetDatum(getNextVal(catalog_oids.raw_queries_raw_query_id_seq));
+	isNulls[Anum_raw_queries_raw_query_id - 1] = false;
+	values[Anum_raw_queries_raw_query_string - 1] = CStringGetTextDatum(raw_query_string);
+	isNulls[Anum_raw_queries_raw_query_string - 1] = (raw_query_string == NULL) ? true : false;
+	values[Anum_raw_queries_timestamp - 1] = TimestampGetDatum(timestamp);
+	isNulls[Anum_raw_queries_timestamp - 1] = false;
+
 	tupleDescriptor = RelationGetDescr(rel);
 	heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
 	CatalogTupleInsert(rel, heapTuple);
@@ -542,6 +1469,201 @@ insertRawQueries(const char *raw_query_hash, const char *raw_query_string)
 	return true;
 }
 
+/*
+ * Insert the normalized queries of PlanInfos into plan_repo.norm_queries by
+ * multi-row INSERTs, skipping those stored already.  This is what the
+ * background writer does instead of insertNormQueries().  Called in an SPI
+ * connection.
+ */
+static bool
+insertNormQueriesBatch(const PlanInfo *infos, int ninfos)
+{
+	Oid		   *argtypes;
+	Datum	   *values;
+	int64	   *hashes;
+	int			nhashes = 0;
+	StringInfoData sql;
+	int			nrows = 0;
+	int			i;
+
+	if (getCatalogOids()->norm_queries == InvalidOid)
+		return false;
+
+	argtypes = palloc(sizeof(Oid) * Natts_norm_queries * PLAN_REPO_BATCH_ROWS);
+	values = palloc(sizeof(Datum) * Natts_norm_queries * PLAN_REPO_BATCH_ROWS);
+	hashes = palloc(sizeof(int64) * ninfos);
+	initStringInfo(&sql);
+
+	for (i = 0; i <= ninfos; i++)
+	{
+		int			j;
+
+		/* run the INSERT when it is full or at the end */
+		if (nrows > 0 && (i == ninfos || nrows == PLAN_REPO_BATCH_ROWS))
+		{
+			int			ret;
+
+			/* the batch has each key once, so only stored rows conflict */
+			appendStringInfoString(&sql, " ON CONFLICT (norm_query_hash) DO NOTHING");
+			ret = SPI_execute_with_args(sql.data, nrows * Natts_norm_queries,
+										argtypes, values, NULL, false, 0);
+			if (ret != SPI_OK_INSERT)
+				elog(ERROR, "SPI_execute_with_args failed: %s",
+					 SPI_result_code_string(ret));
+			nrows = 0;
+		}
+		if (i == ninfos)
+			break;
+
+		if (infos[i].norm_query == NULL)
+			continue;
+
+		/* store each normalized query of the batch once */
+		for (j = 0; j < nhashes; j++)
+			if (hashes[j] == infos[i].norm_query_hash)
+				break;
+		if (j < nhashes)
+			continue;
+		hashes[nhashes++] = infos[i].norm_query_hash;
+
+		if (nrows == 0)
+		{
+			resetStringInfo(&sql);
+			appendStringInfoString(&sql, "INSERT INTO plan_repo.norm_queries "
+								   "(norm_query_hash, norm_query_string) VALUES ");
+		}
+		j = nrows * Natts_norm_queries;
+		argtypes[j + Anum_norm_queries_norm_query_hash - 1] = INT8OID;
+		values[j + Anum_norm_queries_norm_query_hash - 1] = Int64GetDatum(infos[i].norm_query_hash);
+		argtypes[j + Anum_norm_queries_norm_query_string - 1] = TEXTOID;
+		values[j + Anum_norm_queries_norm_query_string - 1] = CStringGetTextDatum(infos[i].norm_query);
+		append_values_row(&sql, nrows, Natts_norm_queries);
+		nrows++;
+	}
+
+	pfree(sql.data);
+	pfree(argtypes);
+	pfree(values);
+	pfree(hashes);
+
+	return true;
+}
+
+/*
+ * Insert the sampled raw queries of PlanInfos into plan_repo.raw_queries by
+ * multi-row INSERTs, up to raw_query_limit rows per norm_query_hash.  This is
+ * what the background writer does instead of insertRawQueries().  Called in
+ * an SPI connection.
+ */
+static bool
+insertRawQueriesBatch(const PlanInfo *infos, int ninfos)
+{
+	Relation	rel = NULL;
+	Oid			relationId = getCatalogOids()->raw_queries;
+	Oid			indexId = catalog_oids.raw_queries_norm_query_hash_idx;
+	Oid		   *argtypes;
+	Datum	   *values;
+	char	   *nulls;
+	int64	   *hashes;
+	int64	   *counts;
+	int			nhashes = 0;
+	StringInfoData sql;
+	int			nrows = 0;
+	int			i;
+
+	if (relationId == InvalidOid)
+		return false;
+
+	rel = table_open(relationId, RowExclusiveLock);
+	if (rel == NULL)
+		return false;
+
+	argtypes = palloc(sizeof(Oid) * Natts_raw_queries * PLAN_REPO_BATCH_ROWS);
+	values = palloc(sizeof(Datum) * Natts_raw_queries * PLAN_REPO_BATCH_ROWS);
+	nulls = palloc(sizeof(char) * Natts_raw_queries * PLAN_REPO_BATCH_ROWS);
+	hashes = palloc(sizeof(int64) * ninfos);
+	counts = palloc(sizeof(int64) * ninfos);
+	initStringInfo(&sql);
+
+	for (i = 0; i <= ninfos; i++)
+	{
+		const PlanInfo *info = &infos[i];
+		int			j;
+
+		/* run the INSERT when it is full or at the end */
+		if (nrows > 0 && (i == ninfos || nrows == PLAN_REPO_BATCH_ROWS))
+		{
+			int			ret;
+
+			ret = SPI_execute_with_args(sql.data, nrows * Natts_raw_queries,
+										argtypes, values, nulls, false, 0);
+			if (ret != SPI_OK_INSERT)
+				elog(ERROR, "SPI_execute_with_args failed: %s",
+					 SPI_result_code_string(ret));
+			nrows = 0;
+		}
+		if (i == ninfos)
+			break;
+
+		if (info->raw_query == NULL)
+			continue;
+
+		/* count the stored rows once per norm_query_hash of the batch */
+		if (info->raw_query_limit >= 0)
+		{
+			for (j = 0; j < nhashes; j++)
+				if (hashes[j] == info->norm_query_hash)
+					break;
+			if (j == nhashes)
+			{
+				hashes[nhashes] = info->norm_query_hash;
+				counts[nhashes] = count_raw_queries(rel, indexId, info->norm_query_hash,
+													info->raw_query_limit);
+				nhashes++;
+			}
+			if (counts[j] >= info->raw_query_limit)
+			{
+				elog(DEBUG3, "raw_queries: " INT64_FORMAT " has enough rows",
+					 info->norm_query_hash);
+				continue;
+			}
+			counts[j]++;
+		}
+
+		if (nrows == 0)
+		{
+			resetStringInfo(&sql);
+			appendStringInfoString(&sql, "INSERT INTO plan_repo.raw_queries "
+								   "(norm_query_hash, raw_query_id, raw_query_string, timestamp) "
+								   "VALUES ");
+		}
+		j = nrows * Natts_raw_queries;
+		memset(nulls + j, ' ', Natts_raw_queries);
+		argtypes[j + Anum_raw_queries_norm_query_hash - 1] = INT8OID;
+		values[j + Anum_raw_queries_norm_query_hash - 1] = Int64GetDatum(info->norm_query_hash);
+		argtypes[j + Anum_raw_queries_raw_query_id - 1] = INT4OID;
+		values[j + Anum_raw_queries_raw_query_id - 1] =
+			Int32GetDatum((int32) getNextVal(catalog_oids.raw_queries_raw_query_id_seq));
+		argtypes[j + Anum_raw_queries_raw_query_string - 1] = TEXTOID;
+		values[j + Anum_raw_queries_raw_query_string - 1] = CStringGetTextDatum(info->raw_query);
+		argtypes[j + Anum_raw_queries_timestamp - 1] = TIMESTAMPOID;
+		values[j + Anum_raw_queries_timestamp - 1] = TimestampGetDatum(info->timestamp);
+		append_values_row(&sql, nrows, Natts_raw_queries);
+		nrows++;
+	}
+
+	table_close(rel, NoLock);
+
+	pfree(sql.data);
+	pfree(argtypes);
+	pfree(values);
+	pfree(nulls);
+	pfree(hashes);
+	pfree(counts);
+
+	return true;
+}
+
 /*
  * Fetch rows from hint_plan.hints table and append the rows to prev_rows_hint.
  */
@@ -549,8 +1671,7 @@ static void
 selectHints(const char *norm_query_string, const char *application_name, StringInfo prev_rows_hint)
 {
 	Relation	rel = NULL;
-	Oid			relationId = get_relname_relid("hints",
-											   LookupExplicitNamespace("hint_plan", true));
+	Oid			relationId = getCatalogOids()->hints;
 
 	ScanKeyData scanKey[2];
 	SysScanDesc scanDescriptor = NULL;
@@ -558,6 +1679,7 @@ selectHints(const char *norm_query_string, const char *application_name, StringI
 	int			scanKeyCount = 2;
 	bool		indexOK = true;
 	HeapTuple	heapTuple = NULL;
+	Snapshot	snapshot;
 
 	if (relationId == InvalidOid)
 		return;
@@ -571,10 +1693,11 @@ selectHints(const char *norm_query_string, const char *application_name, StringI
 
 	ScanKeyInit(&scanKey[1], Anum_hints_application_name,
 				BTEqualStrategyNumber, F_TEXTEQ, CStringGetTextDatum(application_name));
-	scanDescriptor = systable_beginscan(rel,
-										get_relname_relid("hints_norm_and_app",
-														  LookupExplicitNamespace("hint_plan", true)),
-										indexOK, NULL, scanKeyCount, scanKey);
+
+	/* see the row stored by whoever held lockHints() before us */
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	scanDescriptor = systable_beginscan(rel, catalog_oids.hints_norm_and_app,
+										indexOK, snapshot, scanKeyCount, scanKey);
 	heapTuple = systable_getnext(scanDescriptor);
 	while (HeapTupleIsValid(heapTuple))
 	{
@@ -589,10 +1712,40 @@ selectHints(const char *norm_query_string, const char *application_name, StringI
 	}
 
 	systable_endscan(scanDescriptor);
+	UnregisterSnapshot(snapshot);
 	table_close(rel, NoLock);
 
 }
 
+/*
+ * Serialize the updates of the hints of a normalized query and application
+ * among backends until the end of the transaction.  selectHints, deleteHints
+ * and insertHints are run under this lock, so concurrent tuning sessions
+ * neither lose ROWS hints nor store two rows for the key.
+ *
+ * This is a transaction-level advisory lock on the hash of the key.  The last
+ * field differs from 1 and 2 used by the SQL-level advisory lock functions,
+ * so it doesn't conflict with locks taken by users.
+ */
+#define HINTS_LOCK_FIELD4	0x5041
+
+static void
+lockHints(const char *norm_query_string, const char *application_name)
+{
+	LOCKTAG		tag;
+	uint64		key;
+
+	key = DatumGetUInt64(hash_any_extended((const unsigned char *) norm_query_string,
+										   strlen(norm_query_string), 0));
+	key = hash_combine64(key,
+						 DatumGetUInt64(hash_any_extended((const unsigned char *) application_name,
+														  strlen(application_name), 0)));
+
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, (uint32) (key >> 32), (uint32) key,
+						 HINTS_LOCK_FIELD4);
+	(void) LockAcquire(&tag, ExclusiveLock, false, false);
+}
+
 /*
  * Delete a row from hint_plan.hints
  */
@@ -600,8 +1753,7 @@ static bool
 deleteHints(const char *norm_query_string, const char *application_name)
 {
 	Relation	rel = NULL;
-	Oid			relationId = get_relname_relid("hints",
-											   LookupExplicitNamespace("hint_plan", true));
+	Oid			relationId = getCatalogOids()->hints;
 
 	ScanKeyData scanKey[2];
 	SysScanDesc scanDescriptor = NULL;
@@ -609,11 +1761,12 @@ deleteHints(const char *norm_query_string, const char *application_name)
 	int			scanKeyCount = 2;
 	bool		indexOK = true;
 	HeapTuple	heapTuple = NULL;
+	Snapshot	snapshot;
 
 	if (relationId == InvalidOid)
 		return false;
 
-	rel = table_open(relationId, AccessShareLock);
+	rel = table_open(relationId, RowExclusiveLock);
 	if (rel == NULL)
 		return false;
 
@@ -621,10 +1774,9 @@ deleteHints(const char *norm_query_string, const char *application_name)
 				BTEqualStrategyNumber, F_TEXTEQ, CStringGetTextDatum(norm_query_string));
 	ScanKeyInit(&scanKey[1], Anum_hints_application_name,
 				BTEqualStrategyNumber, F_TEXTEQ, CStringGetTextDatum(application_name));
-	scanDescriptor = systable_beginscan(rel,
-										get_relname_relid("hints_norm_and_app",
-														  LookupExplicitNamespace("hint_plan", true)),
-										indexOK, NULL, scanKeyCount, scanKey);
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	scanDescriptor = systable_beginscan(rel, catalog_oids.hints_norm_and_app,
+										indexOK, snapshot, scanKeyCount, scanKey);
 	heapTuple = systable_getnext(scanDescriptor);
 	while (HeapTupleIsValid(heapTuple))
 	{
@@ -639,6 +1791,7 @@ deleteHints(const char *norm_query_string, const char *application_name)
 	}
 
 	systable_endscan(scanDescriptor);
+	UnregisterSnapshot(snapshot);
 	table_close(rel, NoLock);
 
 	return true;
@@ -655,7 +1808,7 @@ insertHints(const char *norm_query_string, const char *application_name, const c
 	HeapTuple	heapTuple = NULL;
 	Datum		values[Natts_hints];
 	bool		isNulls[Natts_hints];
-	Oid			relationId = get_relname_relid("hints", LookupExplicitNamespace("hint_plan", true));
+	Oid			relationId = getCatalogOids()->hints;
 
 	if (relationId == InvalidOid)
 		return false;
@@ -664,7 +1817,7 @@ insertHints(const char *norm_query_string, const char *application_name, const c
 	memset(values, 0, sizeof(values));
 	memset(isNulls, false, sizeof(isNulls));
 
-	values[Anum_hints_id - 1] = Int64GetDatum(getNextVal("hint_plan.hints_id_seq"));
+	values[Anum_hints_id - 1] = Int64GetDatum(getNextVal(catalog_oids.hints_id_seq));
 	isNulls[Anum_hints_id - 1] = false;
 	values[Anum_hints_norm_query_string - 1] = CStringGetTextDatum(norm_query_string);
 	isNulls[Anum_hints_norm_query_string - 1] = (norm_query_string == NULL) ? true : false;
@@ -686,638 +1839,3390 @@ insertHints(const char *norm_query_string, const char *application_name, const c
 }
 
 
-/* Install hooks */
-void
-_PG_init(void)
+/*
+ * Record an iteration of the feedback loop in plan_repo.tuning_state, and
+ * decide whether tuning of the query goes on.
+ *
+ * Tuning converges when the join row errors are gone or the same plan comes
+ * out twice in a row, and it oscillates when a plan seen earlier in the
+ * window comes back.  Either way it ends, and *best_hints is set to the
+ * Leading, join and scan hints of the fastest plan seen, which reproduce
+ * that plan.  The caller holds lockHints() for the query.
+ */
+static TuningAction
+updateTuningState(const PlanInfo *info, char **best_hints)
 {
-	List       *lib_list;
-	ListCell   *l;
-	int         i = 0;
+	Relation	rel;
+	TupleDesc	tupleDescriptor;
+	HeapTuple	oldTuple;
+	HeapTuple	heapTuple;
+	ScanKeyData scanKey[2];
+	SysScanDesc scanDescriptor;
+	Snapshot	snapshot;
+	Datum		values[Natts_tuning_state];
+	bool		isNulls[Natts_tuning_state];
+	Datum	   *planids = NULL;
+	int			nplanids = 0;
+	int64		planid = (int64) info->planid;
+	bool		repeated;
+	bool		cycled = false;
+	bool		cache_differs = info->cache_differs;
+	const char *state;
+	int			first;
+	int			i;
+	TuningAction action;
+	Oid			relationId = getCatalogOids()->tuning_state;
+	Oid			indexId = catalog_oids.tuning_state_pkey;
+
+	if (relationId == InvalidOid || indexId == InvalidOid ||
+		info->application_name == NULL)
+		return TUNING_CONTINUE;
 
-	if (process_shared_preload_libraries_in_progress == true)
+	rel = table_open(relationId, RowExclusiveLock);
+	tupleDescriptor = RelationGetDescr(rel);
+
+	ScanKeyInit(&scanKey[0], Anum_tuning_state_norm_query_hash,
+				BTEqualStrategyNumber, F_INT8EQ, Int64GetDatum(info->norm_query_hash));
+	ScanKeyInit(&scanKey[1], Anum_tuning_state_application_name,
+				BTEqualStrategyNumber, F_TEXTEQ, CStringGetTextDatum(info->application_name));
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	scanDescriptor = systable_beginscan(rel, indexId, true, snapshot, 2, scanKey);
+	oldTuple = systable_getnext(scanDescriptor);
+	if (HeapTupleIsValid(oldTuple))
+		oldTuple = heap_copytuple(oldTuple);
+	systable_endscan(scanDescriptor);
+	UnregisterSnapshot(snapshot);
+
+	if (HeapTupleIsValid(oldTuple))
 	{
-		SplitIdentifierString(shared_preload_libraries_string, ',', &lib_list);
-		foreach(l, lib_list)
-		{
-			char *curname = (char *) lfirst(l);
-			if (strcmp(curname, "pg_hint_plan") == 0)
-				i++;
-			else if (strcmp(curname, "pg_store_plans") == 0)
-				i++;
-		}
-		if (i != 2)
+		heap_deform_tuple(oldTuple, tupleDescriptor, values, isNulls);
+
+		/* tuning has ended, until the row is deleted */
+		if (!isNulls[Anum_tuning_state_state - 1] &&
+			strcmp(TextDatumGetCString(values[Anum_tuning_state_state - 1]),
+				   "tuning") != 0)
 		{
-			ereport(ERROR,
-				(errmsg("pg_hint_plan and/or pg_store_plans are not loaded."),
-				 errhint("pg_plan_advsr needs them. You can check shared_preload_libraries!")));
+			table_close(rel, NoLock);
+			return TUNING_STOPPED;
 		}
-		pfree(lib_list);
+
+		if (!isNulls[Anum_tuning_state_planids - 1])
+			deconstruct_array(DatumGetArrayTypeP(values[Anum_tuning_state_planids - 1]),
+							  INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd',
+							  &planids, NULL, &nplanids);
+	}
+	else
+	{
+		memset(isNulls, true, sizeof(isNulls));
+		values[Anum_tuning_state_iterations - 1] = Int32GetDatum(0);
+		isNulls[Anum_tuning_state_iterations - 1] = false;
 	}
 
-	prev_post_parse_analyze_hook = post_parse_analyze_hook;
-	post_parse_analyze_hook = pg_plan_advsr_post_parse_analyze_hook;
+	repeated = (nplanids > 0 && DatumGetInt64(planids[nplanids - 1]) == planid);
+	for (i = 0; i < nplanids - 1 && !repeated; i++)
+	{
+		if (DatumGetInt64(planids[i]) == planid)
+			cycled = true;
+	}
 
-	prev_ProcessUtility_hook = ProcessUtility_hook;
-	ProcessUtility_hook = pg_plan_advsr_ProcessUtility_hook;
+	/*
+	 * The comparison with the best plan is unfair if one of them ran with
+	 * much warmer cache than the other.
+	 */
+	if (info->shared_hit_ratio >= 0 &&
+		!isNulls[Anum_tuning_state_best_hit_ratio - 1] &&
+		fabs(info->shared_hit_ratio -
+			 DatumGetFloat8(values[Anum_tuning_state_best_hit_ratio - 1])) > MEASURE_CACHE_DIFF)
+		cache_differs = true;
+
+	/* the fastest plan so far, by the median of the repeated executions */
+	if (isNulls[Anum_tuning_state_best_execution_time - 1] ||
+		info->execution_time_median < DatumGetFloat8(values[Anum_tuning_state_best_execution_time - 1]))
+	{
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "%s %s %s",
+						 info->lead_hint ? info->lead_hint : "",
+						 info->join_hint ? info->join_hint : "",
+						 info->scan_hint ? info->scan_hint : "");
+		values[Anum_tuning_state_best_planid - 1] = Int64GetDatum(planid);
+		values[Anum_tuning_state_best_execution_time - 1] = Float8GetDatum(info->execution_time_median);
+		values[Anum_tuning_state_best_hints - 1] = CStringGetTextDatum(buf.data);
+		values[Anum_tuning_state_best_hit_ratio - 1] = Float8GetDatum(info->shared_hit_ratio);
+		isNulls[Anum_tuning_state_best_hit_ratio - 1] = (info->shared_hit_ratio < 0);
+		isNulls[Anum_tuning_state_best_planid - 1] = false;
+		isNulls[Anum_tuning_state_best_execution_time - 1] = false;
+		isNulls[Anum_tuning_state_best_hints - 1] = false;
+	}
 
-	prev_ExplainOneQuery_hook = ExplainOneQuery_hook;
-	ExplainOneQuery_hook = pg_plan_advsr_ExplainOneQuery_hook;
+	if (info->join_rows_err == 0 || repeated)
+		state = "converged";
+	else if (cycled)
+		state = "oscillating";
+	else
+		state = "tuning";
+	action = strcmp(state, "tuning") == 0 ? TUNING_CONTINUE : TUNING_PIN;
+
+	/* keep the last tuning_window planids */
+	planids = planids ? (Datum *) repalloc(planids, sizeof(Datum) * (nplanids + 1)) :
+		(Datum *) palloc(sizeof(Datum));
+	planids[nplanids++] = Int64GetDatum(planid);
+	first = Max(0, nplanids - pg_plan_advsr_tuning_window);
+
+	values[Anum_tuning_state_norm_query_hash - 1] = Int64GetDatum(info->norm_query_hash);
+	values[Anum_tuning_state_application_name - 1] = CStringGetTextDatum(info->application_name);
+	values[Anum_tuning_state_state - 1] = CStringGetTextDatum(state);
+	values[Anum_tuning_state_iterations - 1] =
+		Int32GetDatum(DatumGetInt32(values[Anum_tuning_state_iterations - 1]) + 1);
+	values[Anum_tuning_state_planids - 1] =
+		PointerGetDatum(construct_array(planids + first, nplanids - first, INT8OID,
+										sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+	values[Anum_tuning_state_join_rows_err - 1] = Float8GetDatum(info->join_rows_err);
+	values[Anum_tuning_state_timestamp - 1] = TimestampGetDatum(info->timestamp);
+	values[Anum_tuning_state_cache_differs - 1] = BoolGetDatum(cache_differs);
+	isNulls[Anum_tuning_state_cache_differs - 1] = false;
+	isNulls[Anum_tuning_state_norm_query_hash - 1] = false;
+	isNulls[Anum_tuning_state_application_name - 1] = false;
+	isNulls[Anum_tuning_state_state - 1] = false;
+	isNulls[Anum_tuning_state_iterations - 1] = false;
+	isNulls[Anum_tuning_state_planids - 1] = false;
+	isNulls[Anum_tuning_state_join_rows_err - 1] = false;
+	isNulls[Anum_tuning_state_timestamp - 1] = false;
 
-	prev_ExecutorStart_hook = ExecutorStart_hook;
-	ExecutorStart_hook = pg_plan_advsr_ExecutorStart_hook;
+	heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
+	if (HeapTupleIsValid(oldTuple))
+		CatalogTupleUpdate(rel, &oldTuple->t_self, heapTuple);
+	else
+		CatalogTupleInsert(rel, heapTuple);
+	CommandCounterIncrement();
+	table_close(rel, NoLock);
 
-	prev_ExecutorRun_hook = ExecutorRun_hook;
-	ExecutorRun_hook = pg_plan_advsr_ExecutorRun_hook;
+	if (action == TUNING_PIN)
+	{
+		*best_hints = TextDatumGetCString(values[Anum_tuning_state_best_hints - 1]);
+		elog(DEBUG1, "pg_plan_advsr: tuning %s, pinned plan " INT64_FORMAT,
+			 state, DatumGetInt64(values[Anum_tuning_state_best_planid - 1]));
+	}
 
-	prev_ExecutorFinish_hook = ExecutorFinish_hook;
-	ExecutorFinish_hook = pg_plan_advsr_ExecutorFinish_hook;
+	return action;
+}
 
-	prev_ExecutorEnd_hook = ExecutorEnd_hook;
-	ExecutorEnd_hook = pg_plan_advsr_ExecutorEnd_hook;
+/*
+ * Store a PlanInfo to plan_repo.plan_history, norm_queries and raw_queries.
+ */
+static void
+store_plan_info(const PlanInfo *info)
+{
+	/* insert totaltime and hints to plan_repo.plan_history */
+	if (insertPlanHistory(info))
+		elog(DEBUG3, "\ninsert success: plan_history\n");
+	else
+		elog(INFO, "\ninsert error: plan_history\n");
 
-	DefineCustomBoolVariable("pg_plan_advsr.enabled",
-							 "Enable / Disable pg_plan_advsr",
-							 NULL,
-							 &pg_plan_advsr_is_enabled,
-							 true,
-							 PGC_USERSET,
-							 0,
-							 NULL,
-							 NULL,
-							 NULL);
+	/* insert queryhash and normalized query text to plan_repo.norm_queries */
+	if (insertNormQueries(info->norm_query_hash, info->norm_query))
+		elog(DEBUG3, "\ninsert success: norm_queries\n");
+	else
+		elog(INFO, "\ninsert error: norm_queries\n");
 
-	DefineCustomBoolVariable("pg_plan_advsr.quieted",
-							 "Enable / Disable pg_plan_advsr's quiet mode",
-							 NULL,
-							 &pg_plan_advsr_is_quieted,
-							 false,
-							 PGC_USERSET,
-							 0,
-							 NULL,
-							 NULL,
-							 NULL);
+	/* insert queryhash and raw query text to plan_repo.raw_queries */
+	if (insertRawQueries(info->norm_query_hash, info->raw_query,
+						 info->raw_query_limit, info->timestamp))
+		elog(DEBUG3, "\ninsert success: raw_queries\n");
+	else
+		elog(INFO, "\ninsert error: raw_queries\n");
+}
 
-	DefineCustomBoolVariable("pg_plan_advsr.widely",
-							 "pg_plan_advsr works with EXPLAIN command without ANALYZE option",
-							 NULL,
-							 &pg_plan_advsr_widely,
-							 false,
-							 PGC_USERSET,
-							 0,
-							 NULL,
-							 NULL,
-							 NULL);
+/*
+ * Return the string fields of a PlanInfo in the order they are queued.
+ */
+static void
+plan_info_strings(PlanInfo *info, const char ***fields)
+{
+	fields[0] = &info->norm_query;
+	fields[1] = &info->raw_query;
+	fields[2] = &info->rows_hint;
+	fields[3] = &info->scan_hint;
+	fields[4] = &info->join_hint;
+	fields[5] = &info->lead_hint;
+	fields[6] = &info->application_name;
+	fields[7] = &info->param_values;
 }
 
-/* Uninstall hooks. */
-void
-_PG_fini(void)
+/*
+ * Transaction callback: forget the per-statement state which an aborted
+ * transaction may have left behind.
+ */
+static void
+pg_plan_advsr_xact_callback(XactEvent event, void *arg)
 {
-	post_parse_analyze_hook = prev_post_parse_analyze_hook;
-	ProcessUtility_hook = prev_ProcessUtility_hook;
-	ExecutorStart_hook = prev_ExecutorStart_hook;
-	ExecutorRun_hook = prev_ExecutorRun_hook;
-	ExecutorFinish_hook = prev_ExecutorFinish_hook;
-	ExecutorEnd_hook = prev_ExecutorEnd_hook;
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			last_planned_stmt = NULL;
+			break;
+		case XACT_EVENT_ABORT:
+			last_planned_stmt = NULL;
+			clear_capture();
+			measure_nsamples = 0;
+			break;
+		default:
+			break;
+	}
 }
 
 /*
- * Enable feedback loop.
- *
- * Following GUC parameters will became "ON" when this function executed.
- *   pg_plan_advsr.enabled
- *   pg_hint_plan.debug_print
- *   pg_hint_plan.enable_hint_table
+ * Make the key of cardinality_hash.  Returns false if the relids can't be a
+ * key.
  */
-Datum
-pg_plan_advsr_enable_feedback(PG_FUNCTION_ARGS)
+static bool
+cardinality_key(CardinalityKey *key, uint64 queryid, int64 bucket,
+				Bitmapset *relids)
 {
-	elog(DEBUG3, "execute pg_plan_advsr_enable_feedback");
+	int			rti = -1;
 
-	(void) set_config_option("pg_plan_advsr.enabled", "ON",
-							 PGC_USERSET, PGC_S_OVERRIDE,
-							 GUC_ACTION_SAVE, true, 0, false);
+	memset(key, 0, sizeof(CardinalityKey));
+	key->dbid = MyDatabaseId;
+	key->queryid = queryid;
+	key->bucket = bucket;
 
-	(void) set_config_option("pg_hint_plan.enable_hint_table", "ON",
-							 PGC_USERSET, PGC_S_OVERRIDE,
-							 GUC_ACTION_SAVE, true, 0, false);
+	if (queryid == 0 || bms_is_empty(relids))
+		return false;
 
-	(void) set_config_option("pg_hint_plan.debug_print", "ON",
-							 PGC_USERSET, PGC_S_OVERRIDE,
-							 GUC_ACTION_SAVE, true, 0, false);
-	PG_RETURN_VOID();
+	while ((rti = bms_next_member(relids, rti)) >= 0)
+	{
+		if (rti > CARDINALITY_MAX_RTI)
+			return false;
+		key->relids |= UINT64CONST(1) << rti;
+	}
+
+	return true;
 }
 
 /*
- * Disable feedback loop
+ * Remember the actual rows of a relation of a query, in the parameter bucket
+ * of the plan being analyzed.
  */
-Datum
-pg_plan_advsr_disable_feedback(PG_FUNCTION_ARGS)
+static void
+learn_cardinality(uint64 queryid, Bitmapset *relids, Oid relid, double rows)
 {
-	elog(DEBUG3, "execute pg_plan_advsr_disable_feedback");
-
-	(void) set_config_option("pg_plan_advsr.enabled", "ON",
-							 PGC_USERSET, PGC_S_OVERRIDE,
-							 GUC_ACTION_SAVE, true, 0, false);
+	CardinalityKey key;
+	CardinalityEntry *entry;
 
-	(void) set_config_option("pg_hint_plan.enable_hint_table", "OFF",
-							 PGC_USERSET, PGC_S_OVERRIDE,
-							 GUC_ACTION_SAVE, true, 0, false);
+	if (cardinality_hash == NULL || !analysis_bucket_known ||
+		!cardinality_key(&key, queryid, analysis_bucket, relids))
+		return;
 
-	(void) set_config_option("pg_hint_plan.debug_print", "OFF",
-							 PGC_USERSET, PGC_S_OVERRIDE,
-							 GUC_ACTION_SAVE, true, 0, false);
-	PG_RETURN_VOID();
+	LWLockAcquire(advsr_state->card_lock, LW_EXCLUSIVE);
+	/* If the table is full, the relation is not corrected */
+	entry = (CardinalityEntry *) hash_search(cardinality_hash, &key,
+											 HASH_ENTER_NULL, NULL);
+	if (entry != NULL)
+	{
+		entry->relid = relid;
+		entry->rows = rows;
+	}
+	LWLockRelease(advsr_state->card_lock);
 }
 
+/*
+ * Look up the learned rows of a relation of the query being planned.
+ * Returns false if they are unknown.
+ */
+static bool
+lookup_cardinality(PlannerInfo *root, Bitmapset *relids, Oid relid, double *rows)
+{
+	CardinalityKey key;
+	CardinalityEntry *entry;
+	bool		found = false;
+
+	if (cardinality_hash == NULL ||
+		!cardinality_key(&key, root->parse->queryId, get_param_bucket(root),
+						 relids))
+		return false;
+
+	LWLockAcquire(advsr_state->card_lock, LW_SHARED);
+	entry = (CardinalityEntry *) hash_search(cardinality_hash, &key,
+											 HASH_FIND, NULL);
+	if (entry != NULL && entry->relid == relid)
+	{
+		*rows = entry->rows;
+		found = true;
+	}
+	LWLockRelease(advsr_state->card_lock);
+
+	return found;
+}
 
-/* To get normalized query like a pg_hint_plan.c */
+/*
+ * set_rel_pathlist hook: correct the row estimate of a base relation by the
+ * rows learned from its scan.
+ *
+ * Only relations of the top query level are looked up, because the range
+ * table indexes of the other levels differ from the ones in the plan.  The
+ * paths are already made, so their rows are scaled along; the join size
+ * estimates made later are based on the corrected rows.  An appendrel is not
+ * scanned itself, and takes the rows of its corrected children instead.
+ */
 static void
-pg_plan_advsr_post_parse_analyze_hook(ParseState *pstate, Query *query
-#if PG_VERSION_NUM < 140000
-									  )
-#else
-									  , JumbleState *jstate)
-#endif  /* PG_VERSION_NUM */
+pg_plan_advsr_set_rel_pathlist_hook(PlannerInfo *root, RelOptInfo *rel,
+									Index rti, RangeTblEntry *rte)
 {
-	const char *query_str;
+	double		rows;
 
-	if (prev_post_parse_analyze_hook)
-		prev_post_parse_analyze_hook(pstate, query
-#if PG_VERSION_NUM < 140000
-									  );
-#else
-									  , jstate);
-#endif  /* PG_VERSION_NUM */
+	if (prev_set_rel_pathlist_hook)
+		prev_set_rel_pathlist_hook(root, rel, rti, rte);
 
-	/* Create normalized query for later use */
-	if (pg_plan_advsr_enabled())
-	{
-		int	  		query_len;
-#if PG_VERSION_NUM < 140000
-		pgssJumbleState jstate;
-		Query	   *jumblequery;
-#endif  /* PG_VERSION_NUM */
+	/* all the base relations are sized, so the bucket can be settled */
+	if (root->query_level == 1)
+		(void) get_param_bucket(root);
 
-		elog(DEBUG1, "##pg_plan_advsr_post_parse_analyze_hook start ##");
+	if (!pg_plan_advsr_scan_correction || root->query_level != 1 ||
+		rte->rtekind != RTE_RELATION || IS_DUMMY_REL(rel) || rel->rows <= 0)
+		return;
 
-#if PG_VERSION_NUM < 140000
-		query_str = get_query_string(pstate, query, &jumblequery);
+	if (rte->inh)
+	{
+		correct_appendrel_rows(root, rel, rti);
+		return;
+	}
 
-		if (query_str && jumblequery)
-		{
-			/*
-			 * XXX: normalizing code is copied from pg_stat_statements.c, so
-			 * be careful to PostgreSQL's version up.
-			 */
-			jstate.jumble = (unsigned char *) palloc(JUMBLE_SIZE);
-			jstate.jumble_len = 0;
-			jstate.clocations_buf_size = 32;
-			jstate.clocations = (pgssLocationLen *)
-				palloc(jstate.clocations_buf_size * sizeof(pgssLocationLen));
-			jstate.clocations_count = 0;
+	if (!lookup_cardinality(root, bms_make_singleton(rti), rte->relid, &rows))
+		return;
 
-			JumbleQuery(&jstate, jumblequery);
+	elog(DEBUG1, "pg_plan_advsr: rows of relation %u corrected from %.0f to %.0f",
+		 rti, rel->rows, clamp_row_est(rows));
+	correct_rel_rows(rel, rows);
+}
 
-			/*
-			 * Normalize the query string by replacing constants with '?'
-			 */
-			/*
-			 * Search hint string which is stored keyed by query string and
-			 * application name.  The query string is normalized to allow
-			 * fuzzy matching.
-			 *
-			 * Adding 1 byte to query_len ensures that the returned string has
-			 * a terminating NULL.
-			 */
-			query_len = strlen(query_str) + 1;
-			normalized_query =
-				generate_normalized_query(&jstate, query_str,
-										  query->stmt_location,
-										  &query_len,
-										  GetDatabaseEncoding());
+/*
+ * set_join_pathlist hook: correct the row estimate of a join relation by the
+ * rows learned from its join.
+ *
+ * The hook is called after the paths of each pair of input relations are
+ * added, so the first pair has its paths scaled and the others are made with
+ * the corrected rows.  Joins of the next level are estimated from them.
+ */
+static void
+pg_plan_advsr_set_join_pathlist_hook(PlannerInfo *root, RelOptInfo *joinrel,
+									 RelOptInfo *outerrel, RelOptInfo *innerrel,
+									 JoinType jointype, JoinPathExtraData *extra)
+{
+	Relids		relids = joinrel->relids;
+	double		rows;
 
-		}
-#endif
+	if (prev_set_join_pathlist_hook)
+		prev_set_join_pathlist_hook(root, joinrel, outerrel, innerrel,
+									jointype, extra);
 
-#if PG_VERSION_NUM >= 140000
-		query_str = pstate->p_sourcetext;
+	if (!pg_plan_advsr_join_correction || root->query_level != 1 ||
+		joinrel->reloptkind != RELOPT_JOINREL || IS_DUMMY_REL(joinrel) ||
+		joinrel->rows <= 0)
+		return;
 
-		if (!jstate)
-#endif
 #if PG_VERSION_NUM >= 160000
-			jstate = JumbleQuery(query);
-#elif PG_VERSION_NUM >= 140000
-			jstate = JumbleQuery(query, query_str);
-#endif
+	/* plans don't have the range table indexes of outer joins */
+	relids = bms_difference(relids, root->outer_join_rels);
+#endif  /* PG_VERSION_NUM */
 
-#if PG_VERSION_NUM >= 140000
-		if (!jstate)
-			return;
+	if (!lookup_cardinality(root, relids, InvalidOid, &rows) ||
+		clamp_row_est(rows) == joinrel->rows)
+		return;
 
-		query_len = strlen(query_str) + 1;
-		normalized_query =
-			generate_normalized_query(jstate, query_str, 0, &query_len);
-#endif  /* PG_VERSION_NUM */
+	elog(DEBUG1, "pg_plan_advsr: rows of join corrected from %.0f to %.0f",
+		 joinrel->rows, clamp_row_est(rows));
+	correct_rel_rows(joinrel, rows);
+}
+
+/*
+ * Set the rows of a relation, and scale the rows of its paths made so far.
+ * Parameterized paths have their own row estimates, which are left alone.
+ */
+static void
+correct_rel_rows(RelOptInfo *rel, double rows)
+{
+	double		ratio;
+	ListCell   *lc;
+
+	rows = clamp_row_est(rows);
+	ratio = rows / rel->rows;
+	rel->rows = rows;
+
+	foreach(lc, rel->pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
 
-		elog(DEBUG1, "##pg_plan_advsr_post_parse_analyze_hook end ##");
+		if (path->param_info == NULL)
+			path->rows = clamp_row_est(path->rows * ratio);
 	}
-}
+	foreach(lc, rel->partial_pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
 
+		if (path->param_info == NULL)
+			path->rows = clamp_row_est(path->rows * ratio);
+	}
+}
 
 /*
- * This function setup the "isExplain" flag.
- * If this flag is true, we can create hints for given query.
+ * Sum up the rows of the children of an appendrel again, as
+ * set_append_rel_size() did before the children were corrected.  The hook
+ * is called for the children first, and the Append paths are already made
+ * of the corrected child paths, so only the rows of the relation are set.
  */
 static void
-pg_plan_advsr_ProcessUtility_hook(PlannedStmt *pstmt,
-								  const char *queryString,
-#if PG_VERSION_NUM >= 140000
-											  bool readOnlyTree,
-#endif  /* PG_VERSION_NUM */
-								  ProcessUtilityContext context,
-								  ParamListInfo params,
-								  QueryEnvironment *queryEnv,
-								  DestReceiver *dest,
-#if PG_VERSION_NUM < 130000
-								  char *completionTag)
-#else
-								  QueryCompletion *qc)
-#endif  /* PG_VERSION_NUM */
+correct_appendrel_rows(PlannerInfo *root, RelOptInfo *rel, Index rti)
 {
-	isExplain = query_or_expression_tree_walker((Node *) pstmt,
-												pg_plan_advsr_query_walker,
-												NULL,
-												0);
-	if (isExplain)
+	double		rows = 0;
+	ListCell   *lc;
+
+	foreach(lc, root->append_rel_list)
 	{
-		elog(DEBUG1, "queryString: %s", queryString);
-		explain_query = makeStringInfo();
-		appendStringInfo(explain_query, "%s", queryString);
+		AppendRelInfo *appinfo = (AppendRelInfo *) lfirst(lc);
+		RelOptInfo *childrel;
+
+		if (appinfo->parent_relid != rti)
+			continue;
+
+		childrel = root->simple_rel_array[appinfo->child_relid];
+		if (childrel == NULL || IS_DUMMY_REL(childrel))
+			continue;
+
+		rows += childrel->rows;
 	}
 
-	if (prev_ProcessUtility_hook)
-		prev_ProcessUtility_hook(
-								 pstmt,
-								 queryString,
-#if PG_VERSION_NUM >= 140000
-								 readOnlyTree,
-#endif  /* PG_VERSION_NUM */
-								 context,
-								 params,
-								 queryEnv,
-								 dest,
-#if PG_VERSION_NUM < 130000
-								 completionTag);
-#else
-								 qc);
+	if (rows <= 0 || rows == rel->rows)
+		return;
+
+	elog(DEBUG1, "pg_plan_advsr: rows of appendrel %u corrected from %.0f to %.0f",
+		 rti, rel->rows, rows);
+	rel->rows = rows;
+}
+
+/*
+ * planner hook: remember the parameter bucket of the top-level statement
+ * with its plan, so that the analysis of the plan learns into the bucket.
+ */
+static PlannedStmt *
+pg_plan_advsr_planner_hook(Query *parse,
+#if PG_VERSION_NUM >= 130000
+						   const char *query_string,
 #endif  /* PG_VERSION_NUM */
-	else
-		standard_ProcessUtility(
-								pstmt,
-								queryString,
-#if PG_VERSION_NUM >= 140000
-								 readOnlyTree,
+						   int cursorOptions,
+						   ParamListInfo boundParams)
+{
+	PlannedStmt *result;
+	bool		saved_known = planning_bucket_known;
+	int64		saved_bucket = planning_bucket;
+
+	planning_bucket_known = false;
+	planning_bucket = 0;
+	PG_TRY();
+	{
+		if (prev_planner_hook)
+			result = prev_planner_hook(parse,
+#if PG_VERSION_NUM >= 130000
+									   query_string,
 #endif  /* PG_VERSION_NUM */
-								context,
-								params,
-								queryEnv,
-								dest,
-#if PG_VERSION_NUM < 130000
-								completionTag);
-#else
-								qc);
+									   cursorOptions, boundParams);
+		else
+			result = standard_planner(parse,
+#if PG_VERSION_NUM >= 130000
+									  query_string,
 #endif  /* PG_VERSION_NUM */
-}
+									  cursorOptions, boundParams);
+	}
+	PG_CATCH();
+	{
+		planning_bucket_known = saved_known;
+		planning_bucket = saved_bucket;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
+	/* statements planned while executing another one are not analyzed */
+	if (nested_level == 0)
+	{
+		last_planned_stmt = result;
+		last_planned_bucket = planning_bucket_known ? planning_bucket : 0;
+	}
 
-static void pg_plan_advsr_ExplainOneQuery_hook(Query *query,
-											   int cursorOptions,
-											   IntoClause *into,
-											   ExplainState *es,
-											   const char *queryString,
-											   ParamListInfo params,
-											   QueryEnvironment *queryEnv)
+	planning_bucket_known = saved_known;
+	planning_bucket = saved_bucket;
+
+	return result;
+}
+
+/*
+ * Get the parameter bucket of the statement being planned.
+ *
+ * The bucket classifies the restriction clauses of the base relations by
+ * the order of magnitude of their selectivities, which the planner estimates
+ * from the MCVs and histograms of the constants in them.  So executions with
+ * constants of very different cardinalities go to different buckets, while
+ * the constants of similar cardinalities share one.  It is computed once per
+ * planning, when all the base relations have their sizes.
+ */
+static int64
+get_param_bucket(PlannerInfo *root)
 {
-	PlannedStmt *plan;
-	instr_time	planstart,
-				planduration;
-#if PG_VERSION_NUM > 130000
-	BufferUsage bufusage_start,
-				bufusage;
-#endif  /* PG_VERSION_NUM */
+	uint64		bucket = 0;
+	Index		rti;
 
-	if (prev_ExplainOneQuery_hook)
-		prev_ExplainOneQuery_hook(query,
-								  cursorOptions,
-								  into,
-								  es,
-								  queryString,
-								  params,
-								  queryEnv);
+	if (!pg_plan_advsr_param_buckets)
+		return 0;
 
-	if (run_pg_plan_advsr())
+	if (planning_bucket_known)
+		return planning_bucket;
+
+	for (rti = 1; rti < root->simple_rel_array_size; rti++)
 	{
-		elog(DEBUG1, "##pg_plan_advsr_ExplainOneQuery_hook start ##");
+		RelOptInfo *rel = root->simple_rel_array[rti];
+		ListCell   *lc;
 
-#if PG_VERSION_NUM > 130000
-		if (es->buffers)
-			bufusage_start = pgBufferUsage;
-#endif  /* PG_VERSION_NUM */
+		if (rel == NULL || rel->reloptkind != RELOPT_BASEREL)
+			continue;
 
-		INSTR_TIME_SET_CURRENT(planstart);
+		foreach(lc, rel->baserestrictinfo)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+			Selectivity selec = rinfo->norm_selec;
+			int			magnitude;
+
+			if (selec < 0)
+				selec = clause_selectivity(root, (Node *) rinfo, 0,
+										   JOIN_INNER, NULL);
+			magnitude = (int) floor(log10(Max(selec, 1e-10)));
+			bucket = hash_combine64(bucket,
+									((uint64) rti << 8) | (magnitude + 16));
+		}
+	}
 
-		/* plan the query */
-		plan = pg_plan_query(query,
-#if PG_VERSION_NUM < 130000
-							 cursorOptions, params);
-#else
-							 queryString, cursorOptions, params);
-#endif  /* PG_VERSION_NUM */
+	planning_bucket = (int64) bucket;
+	planning_bucket_known = true;
 
-		INSTR_TIME_SET_CURRENT(planduration);
-		INSTR_TIME_SUBTRACT(planduration, planstart);
+	return planning_bucket;
+}
 
-#if PG_VERSION_NUM > 130000
-		/* calc differences of buffer counters. */
-		if (es->buffers)
-		{
-			memset(&bufusage, 0, sizeof(BufferUsage));
-			BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
-		}
-#endif  /* PG_VERSION_NUM */
+/*
+ * Get the parameter bucket of an executed plan.  Returns false if it is
+ * unknown, i.e. the plan was not planned by the current top-level statement.
+ */
+static bool
+get_plan_param_bucket(PlannedStmt *pstmt, int64 *bucket)
+{
+	*bucket = 0;
 
+	if (!pg_plan_advsr_param_buckets)
+		return true;
 
-		/* run it (if needed) and produce output */
-		ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
-#if PG_VERSION_NUM < 130000
-					   &planduration);
-#else
-					   &planduration, (es->buffers ? &bufusage : NULL));
-#endif  /* PG_VERSION_NUM */
+	if (pstmt == NULL || pstmt != last_planned_stmt)
+		return false;
 
-		if (es->format == EXPLAIN_FORMAT_TEXT && !pg_plan_advsr_is_quieted)
-		{
-			appendStringInfo(es->str, "\nDESCRIBE\n");
-			appendStringInfo(es->str, "------------------------\n");
-			appendStringInfo(es->str, "application:    %s\n", aplname);
-			appendStringInfo(es->str, "pgsp_queryid:   %ld\n", pgsp_queryid);
-			appendStringInfo(es->str, "pgsp_planid:    %u\n", pgsp_planid);
-			appendStringInfo(es->str, "join_cnt:       %d\n", join_cnt);
-			appendStringInfo(es->str, "join_rows_err:  %.0f\n", total_diff_rows_join);
-			appendStringInfo(es->str, "join_err_ratio: %.2f\n", max_diff_ratio_join);
-			appendStringInfo(es->str, "scan_cnt:       %d\n", scan_cnt);
-			appendStringInfo(es->str, "scan_rows_err:  %.0f\n", total_diff_rows_scan);
-			appendStringInfo(es->str, "scan_err_ratio: %.2f\n", max_diff_ratio_scan);
-
-			appendStringInfo(es->str, "lead hint:      %s\n", leadcxt->lead_str->data);
-			replaceAll(join_str->data, "\n", "");
-			appendStringInfo(es->str, "join hint:      %s\n", join_str->data);
-
-			appendStringInfo(es->str, "scan hint:      %s\n", scan_str->data);
-
-			replaceAll(rows_str->data, "\n", "");
-			appendStringInfo(es->str, "rows hint:      %s\n", rows_str->data);
-		}
+	*bucket = last_planned_bucket;
+	return true;
+}
 
-		/* post processing */
-		isExplain = false;
-		normalized_query = NULL;
-		pgsp_queryid = 0;
-		pgsp_planid = 0;
-		pfree(leadcxt);
+/*
+ * Forget the learned cardinalities of the current database.
+ */
+Datum
+pg_plan_advsr_reset_cardinalities(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	CardinalityEntry *entry;
+	int64		removed = 0;
 
-		elog(DEBUG1, "##pg_plan_advsr_ExplainOneQuery_hook end ##");
-	}
-	else
+	if (cardinality_hash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_plan_advsr must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(advsr_state->card_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, cardinality_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		INSTR_TIME_SET_CURRENT(planstart);
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+		hash_search(cardinality_hash, &entry->key, HASH_REMOVE, NULL);
+		removed++;
+	}
+	LWLockRelease(advsr_state->card_lock);
 
-		/* plan the query */
-		plan = pg_plan_query(query,
-#if PG_VERSION_NUM < 130000
-							 cursorOptions, params);
-#else
-							 queryString, cursorOptions, params);
-#endif  /* PG_VERSION_NUM */
+	PG_RETURN_INT64(removed);
+}
 
-		INSTR_TIME_SET_CURRENT(planduration);
-		INSTR_TIME_SUBTRACT(planduration, planstart);
+/*
+ * Size of the queue for the background writer, 0 if the writer is disabled.
+ */
+static Size
+pg_plan_advsr_queue_memsize(void)
+{
+	if (pg_plan_advsr_writer_database == NULL ||
+		pg_plan_advsr_writer_database[0] == '\0')
+		return 0;
 
-		/* run it (if needed) and produce output */
-		ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
-#if PG_VERSION_NUM < 130000
-					   &planduration);
-#else
-					   &planduration, (es->buffers ? &bufusage : NULL));
+	return mul_size(pg_plan_advsr_queue_size, 1024);
+}
+
+/*
+ * Estimate shared memory space needed.
+ */
+static Size
+pg_plan_advsr_memsize(void)
+{
+	Size		size;
+
+	size = MAXALIGN(add_size(offsetof(AdvsrSharedState, queue),
+							 pg_plan_advsr_queue_memsize()));
+	size = add_size(size, hash_estimate_size(pg_plan_advsr_max_cardinalities,
+											 sizeof(CardinalityEntry)));
+
+	return size;
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * shmem_request hook: request shared memory and a LWLock.
+ */
+static void
+pg_plan_advsr_shmem_request_hook(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pg_plan_advsr_memsize());
+	RequestNamedLWLockTranche("pg_plan_advsr", 2);
+}
 #endif  /* PG_VERSION_NUM */
+
+/*
+ * shmem_startup hook: allocate or attach to shared memory.
+ */
+static void
+pg_plan_advsr_shmem_startup_hook(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	advsr_state = NULL;
+	cardinality_hash = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	advsr_state = ShmemInitStruct("pg_plan_advsr",
+								  add_size(offsetof(AdvsrSharedState, queue),
+										   pg_plan_advsr_queue_memsize()),
+								  &found);
+	if (!found)
+	{
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_plan_advsr");
+
+		advsr_state->lock = &locks[0].lock;
+		advsr_state->card_lock = &locks[1].lock;
+		advsr_state->writer_latch = NULL;
+		advsr_state->writer_dbid = InvalidOid;
+		advsr_state->head = 0;
+		advsr_state->tail = 0;
+		advsr_state->queue_size = pg_plan_advsr_queue_memsize();
 	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(CardinalityKey);
+	info.entrysize = sizeof(CardinalityEntry);
+	cardinality_hash = ShmemInitHash("pg_plan_advsr cardinalities",
+									 pg_plan_advsr_max_cardinalities,
+									 pg_plan_advsr_max_cardinalities,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
 }
 
+/*
+ * Return why the background writer can't take our records, or NULL if it
+ * is running on our database.  The caller must hold advsr_state->lock.
+ */
+static const char *
+writer_unavailable_reason(void)
+{
+	if (advsr_state->writer_latch == NULL)
+		return "the writer is not running";
+	if (advsr_state->writer_dbid != MyDatabaseId)
+		return "the writer serves another database";
+	return NULL;
+}
 
-/* ExecutorStart, Run and Finish are came from pg_store_plans.c */
 /*
- * ExecutorStart hook: start up tracking if needed
+ * Copy len bytes from/to the ring buffer at the given byte position.
+ * The caller must hold advsr_state->lock.
  */
 static void
-pg_plan_advsr_ExecutorStart_hook(QueryDesc *queryDesc, int eflags)
+queue_write(uint64 pos, const char *src, Size len)
 {
-	if (prev_ExecutorStart_hook)
-		prev_ExecutorStart_hook(queryDesc, eflags);
+	Size		off = pos % advsr_state->queue_size;
+	Size		first = Min(len, advsr_state->queue_size - off);
+
+	memcpy(advsr_state->queue + off, src, first);
+	if (first < len)
+		memcpy(advsr_state->queue, src + first, len - first);
+}
+
+static void
+queue_read(uint64 pos, char *dst, Size len)
+{
+	Size		off = pos % advsr_state->queue_size;
+	Size		first = Min(len, advsr_state->queue_size - off);
+
+	memcpy(dst, advsr_state->queue + off, first);
+	if (first < len)
+		memcpy(dst + first, advsr_state->queue, len - first);
+}
+
+/*
+ * Push a PlanInfo to the shared queue and wake up the background writer.
+ * Returns false if the writer is not available or the queue is full, in
+ * which case the caller should store the PlanInfo by itself.
+ */
+static bool
+enqueue_plan_info(const PlanInfo *info)
+{
+	PlanInfo	tmp = *info;
+	const char **fields[PLAN_INFO_NSTRINGS];
+	PlanRecordHeader hdr;
+	StringInfoData buf;
+	Latch	   *latch = NULL;
+	const char *reason = NULL;
+	int			i;
+
+	/* don't serialize the record for nothing */
+	if (advsr_state == NULL || advsr_state->queue_size == 0)
+		reason = "the writer is not configured";
 	else
-		standard_ExecutorStart(queryDesc, eflags);
+	{
+		LWLockAcquire(advsr_state->lock, LW_SHARED);
+		reason = writer_unavailable_reason();
+		LWLockRelease(advsr_state->lock);
+	}
+	if (reason != NULL)
+	{
+		elog(DEBUG1, "pg_plan_advsr: %s, storing plan_history synchronously",
+			 reason);
+		return false;
+	}
 
-	/*
-	 * Set up to track total elapsed time in ExecutorRun. Allocate in
-	 * per-query context so as to be free at ExecutorEnd.
-	 */
-	if (pg_plan_advsr_enabled() && queryDesc->totaltime == NULL)
+	/* serialize the record */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.dbid = MyDatabaseId;
+	hdr.norm_query_hash = info->norm_query_hash;
+	hdr.raw_query_limit = info->raw_query_limit;
+	hdr.pgsp_queryid = info->pgsp_queryid;
+	hdr.pgsp_planid = info->pgsp_planid;
+	hdr.pgsp_planid_known = info->pgsp_planid_known;
+	hdr.planid = info->planid;
+	hdr.execution_time = info->execution_time;
+	hdr.execution_time_median = info->execution_time_median;
+	hdr.execution_time_p90 = info->execution_time_p90;
+	hdr.shared_hit_ratio = info->shared_hit_ratio;
+	hdr.cache_differs = info->cache_differs;
+	hdr.param_bucket = info->param_bucket;
+	hdr.param_bucket_known = info->param_bucket_known;
+	hdr.scan_rows_err = info->scan_rows_err;
+	hdr.scan_err_ratio = info->scan_err_ratio;
+	hdr.join_rows_err = info->join_rows_err;
+	hdr.join_err_ratio = info->join_err_ratio;
+	hdr.scan_cnt = info->scan_cnt;
+	hdr.join_cnt = info->join_cnt;
+	hdr.timestamp = info->timestamp;
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, (char *) &hdr, sizeof(hdr));
+
+	plan_info_strings(&tmp, fields);
+	for (i = 0; i < PLAN_INFO_NSTRINGS; i++)
 	{
-		MemoryContext oldcxt;
+		const char *str = *fields[i];
 
-		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL
-#if PG_VERSION_NUM >= 140000
-										  , false
-#endif  /* PG_VERSION_NUM */
-										 );
-		MemoryContextSwitchTo(oldcxt);
+		if (str == NULL)
+		{
+			hdr.str_len[i] = -1;
+			continue;
+		}
+		hdr.str_len[i] = strlen(str);
+		appendBinaryStringInfo(&buf, str, hdr.str_len[i] + 1);
+	}
+	hdr.len = buf.len;
+	memcpy(buf.data, &hdr, sizeof(hdr));
+
+	/* the writer may have exited in the meantime */
+	LWLockAcquire(advsr_state->lock, LW_EXCLUSIVE);
+	reason = writer_unavailable_reason();
+	if (reason == NULL &&
+		advsr_state->queue_size - (advsr_state->head - advsr_state->tail) < hdr.len)
+		reason = "the queue is full";
+	else if (reason == NULL)
+	{
+		queue_write(advsr_state->head, buf.data, hdr.len);
+		advsr_state->head += hdr.len;
+		latch = advsr_state->writer_latch;
 	}
+	LWLockRelease(advsr_state->lock);
+
+	pfree(buf.data);
 
+	if (latch)
+		SetLatch(latch);
+	else
+		elog(DEBUG1, "pg_plan_advsr: %s, storing plan_history synchronously",
+			 reason);
+
+	return latch != NULL;
 }
 
 /*
- * ExecutorRun hook: all we need do is track nesting depth
+ * Store queued PlanInfos with one multi-row INSERT per table, in a
+ * subtransaction.  Returns false, with nothing stored, if any of them can't
+ * be stored.
  */
-static void
-pg_plan_advsr_ExecutorRun_hook(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
-							   bool execute_once)
+static bool
+store_plan_info_batch(const PlanInfo *infos, int ninfos)
 {
-	nested_level++;
+	MemoryContext oldcxt = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	bool		stored = true;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcxt);
+
 	PG_TRY();
 	{
-		if (prev_ExecutorRun_hook)
-			prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
-		else
-			standard_ExecutorRun(queryDesc, direction, count, execute_once);
-		nested_level--;
+		Oid			savedUserId = InvalidOid;
+		int			savedSecurityContext = 0;
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		/* Users have only SELECT privilege on plan_repo tables */
+		GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+		SetUserIdAndSecContext(extensionOwner(), SECURITY_LOCAL_USERID_CHANGE);
+
+		if (!insertPlanHistoryBatch(infos, ninfos))
+			elog(INFO, "\ninsert error: plan_history\n");
+		if (!insertNormQueriesBatch(infos, ninfos))
+			elog(INFO, "\ninsert error: norm_queries\n");
+		if (!insertRawQueriesBatch(infos, ninfos))
+			elog(INFO, "\ninsert error: raw_queries\n");
+
+		SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+		SPI_finish();
+
+		ReleaseCurrentSubTransaction();
 	}
 	PG_CATCH();
 	{
-		nested_level--;
-		PG_RE_THROW();
+		ErrorData  *edata;
+
+		/* the user and the SPI connection are reset by the rollback */
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+
+		ereport(WARNING,
+				(errmsg("pg_plan_advsr writer could not store a batch of %d records, storing them one by one",
+						ninfos),
+				 errdetail_internal("%s", edata->message)));
+		FreeErrorData(edata);
+		stored = false;
 	}
 	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+	CurrentResourceOwner = oldowner;
+
+	return stored;
 }
 
 /*
- * ExecutorFinish hook: all we need do is track nesting depth
+ * Store a queued PlanInfo in a subtransaction, so that a record which can't
+ * be stored is reported and skipped without losing the rest of the batch.
+ * This is used only when store_plan_info_batch() failed.  Returns false if
+ * it was skipped.
  */
-static void
-pg_plan_advsr_ExecutorFinish_hook(QueryDesc *queryDesc)
+static bool
+store_queued_plan_info(const PlanInfo *info)
 {
-	nested_level++;
+	MemoryContext oldcxt = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	bool		stored = true;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcxt);
+
 	PG_TRY();
 	{
-		if (prev_ExecutorFinish_hook)
-			prev_ExecutorFinish_hook(queryDesc);
-		else
-			standard_ExecutorFinish(queryDesc);
-		nested_level--;
+		store_plan_info(info);
+		ReleaseCurrentSubTransaction();
 	}
 	PG_CATCH();
 	{
-		nested_level--;
-		PG_RE_THROW();
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+
+		ereport(WARNING,
+				(errmsg("pg_plan_advsr writer skipped a record of norm_query_hash " INT64_FORMAT,
+						info->norm_query_hash),
+				 errdetail_internal("%s", edata->message)));
+		FreeErrorData(edata);
+		stored = false;
 	}
 	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+	CurrentResourceOwner = oldowner;
+
+	return stored;
 }
 
 /*
- * ExecutorEnd_hook: create hints by using PlannedStmt or ExplainState, and output it.
+ * Take all queued records and store them to plan_repo in one transaction.
+ *
+ * The records are removed from the queue only after the transaction commits,
+ * so that an error on the way leaves them for the restarted writer.
  */
 static void
-pg_plan_advsr_ExecutorEnd_hook(QueryDesc *queryDesc)
+drain_plan_queue(MemoryContext batchcxt)
 {
-	ExplainState *hs;
 	MemoryContext oldcxt;
+	char	   *batch;
+	PlanInfo   *infos;
+	int			ninfos = 0;
+	Size		len;
+	Size		off;
+	int			nrecords = 0;
+	int			nskipped = 0;
+	int			i;
+
+	LWLockAcquire(advsr_state->lock, LW_SHARED);
+	len = advsr_state->head - advsr_state->tail;
+	if (len == 0)
+	{
+		LWLockRelease(advsr_state->lock);
+		return;
+	}
+	/* we are the only reader, so tail and what follows stay as they are */
+	batch = MemoryContextAlloc(batchcxt, len);
+	queue_read(advsr_state->tail, batch, len);
+	LWLockRelease(advsr_state->lock);
 
-	if (queryDesc->totaltime)
-		InstrEndLoop(queryDesc->totaltime);
+	oldcxt = MemoryContextSwitchTo(batchcxt);
 
-	elog(DEBUG1, "isExplain: %d", isExplain);
-	if (isExplain && pg_plan_advsr_enabled()
-				  && strcmp(queryDesc->sourceText, explain_query->data) == 0)
+	infos = palloc(sizeof(PlanInfo) * (len / sizeof(PlanRecordHeader)));
+	off = 0;
+	while (off < len)
 	{
-		elog(DEBUG1, "## pg_plan_advsr_ExecutorEnd start ##");
+		PlanRecordHeader hdr;
+		PlanInfo   *info;
+		const char **fields[PLAN_INFO_NSTRINGS];
+		char	   *str;
 
-		/* Create Hints using HintState like a ExplainState */
-		hs = NewExplainState();
-		hs->analyze = true;
-		hs->verbose = true;
-		hs->buffers = false;
-		hs->timing = false;
-		hs->summary = hs->analyze;
-		hs->format = EXPLAIN_FORMAT_JSON;
-
-		/* Initialize */
-		oldcxt = MemoryContextSwitchTo(TopMemoryContext);
-		leadcxt = (LeadingContext *) palloc0(sizeof(LeadingContext));
-		leadcxt->lead_str = makeStringInfo();
-		MemoryContextSwitchTo(oldcxt);
+		memcpy(&hdr, batch + off, sizeof(hdr));
+		off += hdr.len;
 
-		scan_str = makeStringInfo();
-		join_str = makeStringInfo();
-		rows_str = makeStringInfo();
-		est_rows = 0;
-		act_rows = 0;
-		diff_rows_join  = 0;
-		diff_ratio_join = 0;
-		diff_rows_scan  = 0;
-		diff_ratio_scan = 0;
-		scan_cnt = 0;
-		join_cnt = 0;
-		rows_cnt = 0;
+		/* enqueue_plan_info() queues only records of our database */
+		if (hdr.dbid != MyDatabaseId)
+		{
+			ereport(WARNING,
+					(errmsg("pg_plan_advsr writer skipped a record of another database, OID %u",
+							hdr.dbid)));
+			nskipped++;
+			continue;
+		}
 
-		pg_plan_advsr_ExplainPrintPlan(hs, queryDesc);
+		info = &infos[ninfos++];
+		memset(info, 0, sizeof(PlanInfo));
+		info->norm_query_hash = hdr.norm_query_hash;
+		info->raw_query_limit = hdr.raw_query_limit;
+		info->pgsp_queryid = hdr.pgsp_queryid;
+		info->pgsp_planid = hdr.pgsp_planid;
+		info->pgsp_planid_known = hdr.pgsp_planid_known;
+		info->planid = hdr.planid;
+		info->execution_time = hdr.execution_time;
+		info->execution_time_median = hdr.execution_time_median;
+		info->execution_time_p90 = hdr.execution_time_p90;
+		info->shared_hit_ratio = hdr.shared_hit_ratio;
+		info->cache_differs = hdr.cache_differs;
+		info->param_bucket = hdr.param_bucket;
+		info->param_bucket_known = hdr.param_bucket_known;
+		info->scan_rows_err = hdr.scan_rows_err;
+		info->scan_err_ratio = hdr.scan_err_ratio;
+		info->join_rows_err = hdr.join_rows_err;
+		info->join_err_ratio = hdr.join_err_ratio;
+		info->scan_cnt = hdr.scan_cnt;
+		info->join_cnt = hdr.join_cnt;
+		info->timestamp = hdr.timestamp;
+
+		plan_info_strings(info, fields);
+		str = batch + off - hdr.len + sizeof(hdr);
+		for (i = 0; i < PLAN_INFO_NSTRINGS; i++)
+		{
+			if (hdr.str_len[i] < 0)
+			{
+				*fields[i] = NULL;
+				continue;
+			}
+			*fields[i] = str;
+			str += hdr.str_len[i] + 1;
+		}
+	}
 
-		elog(DEBUG1, "## pg_plan_advsr_ExecutorEnd end ##");
+	MemoryContextSwitchTo(oldcxt);
 
-		/* initialize */
-		/* isExplain = false; */
-	}
+	/*
+	 * Our INSERTs are not statements of an application, so don't analyze nor
+	 * capture them, see pg_plan_advsr_enabled().
+	 */
+	nested_level++;
 
-	if (prev_ExecutorEnd_hook)
-		prev_ExecutorEnd_hook(queryDesc);
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "storing plan_repo records");
+
+	oldcxt = MemoryContextSwitchTo(batchcxt);
+
+	if (ninfos > 0 && store_plan_info_batch(infos, ninfos))
+		nrecords = ninfos;
 	else
-		standard_ExecutorEnd(queryDesc);
+	{
+		/* find and skip the records which can't be stored */
+		for (i = 0; i < ninfos; i++)
+		{
+			if (store_queued_plan_info(&infos[i]))
+				nrecords++;
+			else
+				nskipped++;
+		}
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	/* the records are stored, so free their space in the queue */
+	LWLockAcquire(advsr_state->lock, LW_EXCLUSIVE);
+	advsr_state->tail += len;
+	LWLockRelease(advsr_state->lock);
+
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	nested_level--;
+
+	MemoryContextReset(batchcxt);
+
+	elog(DEBUG1, "pg_plan_advsr writer stored %d records, skipped %d",
+		 nrecords, nskipped);
 }
 
+/* how often the background writer creates the partitions of plan_history */
+#define PREPARE_PARTITIONS_INTERVAL	(60 * 60 * 1000)	/* ms */
+
 /*
- * Create pg_store_plans's planid
- * This function is inspired store_entry() and pgsp_ExecutorEnd() in pg_store_plans.
+ * Create the partitions of plan_history for the current period and the next
+ * one ahead of time, so that rows don't pile up in the default partition.
+ * See plan_repo.prepare_plan_history_partitions().  A failure is reported
+ * and retried next time.
  */
-uint32
-create_pgsp_planid(QueryDesc *queryDesc)
+static void
+prepare_plan_history_partitions(void)
 {
-	ExplainState *es = NewExplainState();
-	StringInfo	es_str = es->str;
-	bool		log_verbose = false;
-	bool		log_buffers = false;
-	bool		log_timing = false;
-	bool		log_triggers = false;
-	char	   *normalized_plan = NULL;
-	int64		planid;			/* plan identifier */
-
-	/* get the current values of pg_store_plans setting */
-	/* GetConfigOptionByName("pg_store_plans.log_analyze", NULL, false); */
-	if (strcmp(GetConfigOptionByName("pg_store_plans.log_verbose", NULL, false), "on") == 0)
-		log_verbose = true;
-	if (strcmp(GetConfigOptionByName("pg_store_plans.log_buffers", NULL, false), "on") == 0)
-		log_buffers = true;
-	if (strcmp(GetConfigOptionByName("pg_store_plans.log_timing", NULL, false), "on") == 0)
-		log_timing = true;
-	if (strcmp(GetConfigOptionByName("pg_store_plans.log_triggers", NULL, false), "on") == 0)
-		log_triggers = true;
-
-	elog(DEBUG1, "pg_store_plans.log_verbose : %s", log_verbose ? "on" : "off");
-	elog(DEBUG1, "pg_store_plans.log_buffers : %s", log_buffers ? "on" : "off");
-	elog(DEBUG1, "pg_store_plans.log_timing  : %s", log_timing ? "on" : "off");
-	elog(DEBUG1, "pg_store_plans.log_triggers: %s", log_triggers ? "on" : "off");
+	MemoryContext oldcxt = CurrentMemoryContext;
+	ResourceOwner oldowner;
 
-	es->analyze = queryDesc->instrument_options;
-	es->verbose = log_verbose;
-	es->buffers = (es->analyze && log_buffers);
-	es->timing = (es->analyze && log_timing);
-	es->format = EXPLAIN_FORMAT_JSON;
+	nested_level++;
 
-	ExplainBeginOutput(es);
-	ExplainPrintPlan(es, queryDesc);
-	/* Trigger is not supported */
-	/*----
-	 if (log_triggers)
-	 	pgspExplainTriggers(es, queryDesc);
-	 *----
-	 */
-	ExplainEndOutput(es);
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "creating plan_history partitions");
 
-	/* Remove last line break */
-	if (es_str->len > 0 && es_str->data[es_str->len - 1] == '\n')
-		es_str->data[--es_str->len] = '\0';
+	oldowner = CurrentResourceOwner;
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcxt);
 
-	/* JSON outmost braces. */
-	es_str->data[0] = '{';
-	es_str->data[es_str->len - 1] = '}';
+	PG_TRY();
+	{
+		Oid			savedUserId = InvalidOid;
+		int			savedSecurityContext = 0;
+
+		/* nothing to do unless pg_plan_advsr is installed */
+		if (getCatalogOids()->plan_history != InvalidOid)
+		{
+			int			ret;
+
+			if (SPI_connect() != SPI_OK_CONNECT)
+				elog(ERROR, "SPI_connect failed");
+
+			/* the partitions are owned by the owner of plan_history */
+			GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+			SetUserIdAndSecContext(extensionOwner(), SECURITY_LOCAL_USERID_CHANGE);
+			ret = SPI_execute("SELECT plan_repo.prepare_plan_history_partitions()",
+							  false, 0);
+			SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+			if (ret != SPI_OK_SELECT)
+				elog(ERROR, "SPI_execute failed: %s", SPI_result_code_string(ret));
+
+			SPI_finish();
+		}
+
+		ReleaseCurrentSubTransaction();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+
+		ereport(WARNING,
+				(errmsg("pg_plan_advsr writer could not create partitions of plan_history"),
+				 errdetail_internal("%s", edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+	CurrentResourceOwner = oldowner;
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	nested_level--;
+}
+
+/*
+ * Signal handlers of the background writer.
+ */
+static void
+pg_plan_advsr_writer_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+pg_plan_advsr_writer_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * on_shmem_exit callback: detach the writer from the shared state.
+ */
+static void
+pg_plan_advsr_writer_detach(int code, Datum arg)
+{
+	LWLockAcquire(advsr_state->lock, LW_EXCLUSIVE);
+	advsr_state->writer_latch = NULL;
+	advsr_state->writer_dbid = InvalidOid;
+	LWLockRelease(advsr_state->lock);
+}
+
+/*
+ * Main loop of the background writer.
+ *
+ * Backends with pg_plan_advsr.async_write enabled push PlanInfo records to
+ * the shared queue instead of inserting into plan_repo by themselves.  The
+ * writer wakes up when a record is queued (or every writer_naptime) and
+ * stores everything queued so far in a single transaction.
+ *
+ * The writer is connected to writer_database only, so only the backends of
+ * that database queue records; the others store them by themselves.  It
+ * also creates the partitions of plan_history there every hour.
+ */
+void
+pg_plan_advsr_writer_main(Datum main_arg)
+{
+	MemoryContext batchcxt;
+	TimestampTz last_prepared;
+
+	pqsignal(SIGHUP, pg_plan_advsr_writer_sighup);
+	pqsignal(SIGTERM, pg_plan_advsr_writer_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	if (advsr_state == NULL)
+		ereport(ERROR,
+				(errmsg("pg_plan_advsr writer started without shared memory")));
+
+	BackgroundWorkerInitializeConnection(pg_plan_advsr_writer_database, NULL, 0);
+
+	batchcxt = AllocSetContextCreate(TopMemoryContext,
+									 "pg_plan_advsr writer batch",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	LWLockAcquire(advsr_state->lock, LW_EXCLUSIVE);
+	advsr_state->writer_latch = &MyProc->procLatch;
+	advsr_state->writer_dbid = MyDatabaseId;
+	LWLockRelease(advsr_state->lock);
+	on_shmem_exit(pg_plan_advsr_writer_detach, (Datum) 0);
+
+	ereport(LOG,
+			(errmsg("pg_plan_advsr writer started on database \"%s\"",
+					pg_plan_advsr_writer_database)));
+
+	prepare_plan_history_partitions();
+	last_prepared = GetCurrentTimestamp();
+
+	while (!got_sigterm)
+	{
+		int			rc;
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   pg_plan_advsr_writer_naptime,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		drain_plan_queue(batchcxt);
+
+		if (TimestampDifferenceExceeds(last_prepared, GetCurrentTimestamp(),
+									   PREPARE_PARTITIONS_INTERVAL))
+		{
+			prepare_plan_history_partitions();
+			last_prepared = GetCurrentTimestamp();
+		}
+	}
+
+	/* store what is left before exiting */
+	drain_plan_queue(batchcxt);
+
+	proc_exit(0);
+}
+
+/* Install hooks */
+void
+_PG_init(void)
+{
+	List       *lib_list;
+	ListCell   *l;
+	int         i = 0;
+
+	if (process_shared_preload_libraries_in_progress == true)
+	{
+		SplitIdentifierString(shared_preload_libraries_string, ',', &lib_list);
+		foreach(l, lib_list)
+		{
+			char *curname = (char *) lfirst(l);
+			if (strcmp(curname, "pg_hint_plan") == 0)
+				i++;
+			else if (strcmp(curname, "pg_store_plans") == 0)
+				i++;
+		}
+		if (i != 2)
+		{
+			ereport(ERROR,
+				(errmsg("pg_hint_plan and/or pg_store_plans are not loaded."),
+				 errhint("pg_plan_advsr needs them. You can check shared_preload_libraries!")));
+		}
+		pfree(lib_list);
+	}
+
+	prev_post_parse_analyze_hook = post_parse_analyze_hook;
+	post_parse_analyze_hook = pg_plan_advsr_post_parse_analyze_hook;
+
+	prev_ProcessUtility_hook = ProcessUtility_hook;
+	ProcessUtility_hook = pg_plan_advsr_ProcessUtility_hook;
+
+	prev_ExplainOneQuery_hook = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = pg_plan_advsr_ExplainOneQuery_hook;
+
+	prev_ExecutorStart_hook = ExecutorStart_hook;
+	ExecutorStart_hook = pg_plan_advsr_ExecutorStart_hook;
+
+	prev_ExecutorRun_hook = ExecutorRun_hook;
+	ExecutorRun_hook = pg_plan_advsr_ExecutorRun_hook;
+
+	prev_ExecutorFinish_hook = ExecutorFinish_hook;
+	ExecutorFinish_hook = pg_plan_advsr_ExecutorFinish_hook;
+
+	prev_ExecutorEnd_hook = ExecutorEnd_hook;
+	ExecutorEnd_hook = pg_plan_advsr_ExecutorEnd_hook;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pg_plan_advsr_shmem_request_hook;
+#endif  /* PG_VERSION_NUM */
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pg_plan_advsr_shmem_startup_hook;
+
+	prev_set_rel_pathlist_hook = set_rel_pathlist_hook;
+	set_rel_pathlist_hook = pg_plan_advsr_set_rel_pathlist_hook;
+
+	prev_set_join_pathlist_hook = set_join_pathlist_hook;
+	set_join_pathlist_hook = pg_plan_advsr_set_join_pathlist_hook;
+
+	prev_planner_hook = planner_hook;
+	planner_hook = pg_plan_advsr_planner_hook;
+
+	DefineCustomBoolVariable("pg_plan_advsr.enabled",
+							 "Enable / Disable pg_plan_advsr",
+							 NULL,
+							 &pg_plan_advsr_is_enabled,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.quieted",
+							 "Enable / Disable pg_plan_advsr's quiet mode",
+							 NULL,
+							 &pg_plan_advsr_is_quieted,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.widely",
+							 "pg_plan_advsr works with EXPLAIN command without ANALYZE option",
+							 NULL,
+							 &pg_plan_advsr_widely,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.async_write",
+							 "Hand plan_repo writes to the background writer",
+							 "Hints are still stored synchronously.",
+							 &pg_plan_advsr_async_write,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_plan_advsr.writer_database",
+							   "Database the background writer connects to",
+							   "An empty string disables the background writer.",
+							   &pg_plan_advsr_writer_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.async_queue_size",
+							"Size of the queue between backends and the background writer",
+							NULL,
+							&pg_plan_advsr_queue_size,
+							1024,
+							64,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.writer_naptime",
+							"Sleep time of the background writer between batches",
+							NULL,
+							&pg_plan_advsr_writer_naptime,
+							1000,
+							10,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.scan_correction",
+							 "Correct the row estimates of relations by the rows learned from scans",
+							 "The rows of scans are learned by EXPLAIN ANALYZE, and the planner uses them for the relations of the same query.",
+							 &pg_plan_advsr_scan_correction,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.join_correction",
+							 "Correct the row estimates of joins by the rows learned from joins",
+							 "The rows of joins are learned by EXPLAIN ANALYZE, and the planner uses them for the joins of the same query without hint_plan.hints.",
+							 &pg_plan_advsr_join_correction,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.param_buckets",
+							 "Learn and correct the rows per bucket of selectivities of the constants in the query",
+							 "If join_correction is on too, ROWS hints are not stored to hint_plan.hints, which can't tell the buckets apart.",
+							 &pg_plan_advsr_param_buckets,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.max_cardinalities",
+							"Number of cardinalities learned in shared memory",
+							NULL,
+							&pg_plan_advsr_max_cardinalities,
+							5000,
+							100,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.raw_query_limit",
+							"Max number of raw query texts stored per normalized query",
+							"-1 means no limit, 0 disables storing raw query texts.",
+							&pg_plan_advsr_raw_query_limit,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_plan_advsr.raw_query_sample_rate",
+							 "Fraction of raw query texts to store",
+							 NULL,
+							 &pg_plan_advsr_raw_query_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_plan_advsr.rows_hint_smoothing",
+							 "Weight of the stored row count when a ROWS hint is updated",
+							 "0 means the latest actual row count replaces the stored one.",
+							 &pg_plan_advsr_rows_hint_smoothing,
+							 0.0,
+							 0.0,
+							 1.0,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.compute_pgsp_planid",
+							 "Compute pgsp_planid from EXPLAIN output as pg_store_plans does",
+							 "If off, pgsp_planid is stored as NULL.",
+							 &pg_plan_advsr_compute_pgsp_planid,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.raw_query_max_length",
+							"Max length of a stored raw query text",
+							"Longer texts are truncated. 0 means no limit.",
+							&pg_plan_advsr_raw_query_max_length,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_BYTE,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_plan_advsr.capture_sample_rate",
+							 "Fraction of regular statements to capture",
+							 "Captured statements are analyzed as EXPLAIN ANALYZE is. 0 disables capturing.",
+							 &pg_plan_advsr_capture_sample_rate,
+							 0.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.capture_min_duration",
+							"Minimum execution time of a captured statement to be stored",
+							"Captured statements that ran faster are discarded.",
+							&pg_plan_advsr_capture_min_duration,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_plan_advsr.instrumentation",
+							 "Selects the instrumentation collected for captured statements and auto_tune",
+							 "Hints only need row counts, and per-node timing slows down large plans.",
+							 &pg_plan_advsr_instrumentation,
+							 ADVSR_INSTRUMENT_ROWS,
+							 instrumentation_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.parallel_hint",
+							 "Recommend parallel workers of each scan by Parallel hints",
+							 NULL,
+							 &pg_plan_advsr_parallel_hint,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.parallel_min_scan_time",
+							"Minimum scan time to recommend parallel workers",
+							"Faster scans are recommended no workers. It is used only if the scan was timed.",
+							&pg_plan_advsr_parallel_min_scan_time,
+							100,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_plan_advsr.auto_pin",
+							 "Stop tuning at the fastest plan when the plans converge or oscillate",
+							 "The hints of the fastest plan replace the ROWS hints in hint_plan.hints.",
+							 &pg_plan_advsr_auto_pin,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.tuning_window",
+							"Number of recent plans kept to detect oscillation",
+							NULL,
+							&pg_plan_advsr_tuning_window,
+							10,
+							2,
+							1000,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_plan_advsr.measure_repeats",
+							"Number of executions of EXPLAIN ANALYZE SELECT to measure its execution time",
+							"The median and 90th percentile of the execution times are stored.",
+							&pg_plan_advsr_measure_repeats,
+							1,
+							1,
+							MEASURE_MAX_REPEATS,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	RegisterXactCallback(pg_plan_advsr_xact_callback, NULL);
+
+	CacheRegisterRelcacheCallback(advsr_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID, advsr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(AUTHOID, advsr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(PROCOID, pgsp_planid_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(OPEROID, pgsp_planid_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(TYPEOID, pgsp_planid_syscache_callback, (Datum) 0);
+
+#if PG_VERSION_NUM < 150000
+	/* Shared memory needs shared_preload_libraries */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		RequestAddinShmemSpace(pg_plan_advsr_memsize());
+		RequestNamedLWLockTranche("pg_plan_advsr", 2);
+	}
+#endif  /* PG_VERSION_NUM */
+
+	/* Background writer needs shared_preload_libraries */
+	if (process_shared_preload_libraries_in_progress &&
+		pg_plan_advsr_queue_memsize() > 0)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 10;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_plan_advsr");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_plan_advsr_writer_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_plan_advsr writer");
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_plan_advsr writer");
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+		RegisterBackgroundWorker(&worker);
+	}
+}
+
+/* Uninstall hooks. */
+void
+_PG_fini(void)
+{
+	post_parse_analyze_hook = prev_post_parse_analyze_hook;
+	ProcessUtility_hook = prev_ProcessUtility_hook;
+	ExecutorStart_hook = prev_ExecutorStart_hook;
+	ExecutorRun_hook = prev_ExecutorRun_hook;
+	ExecutorFinish_hook = prev_ExecutorFinish_hook;
+	ExecutorEnd_hook = prev_ExecutorEnd_hook;
+	shmem_startup_hook = prev_shmem_startup_hook;
+	set_rel_pathlist_hook = prev_set_rel_pathlist_hook;
+	set_join_pathlist_hook = prev_set_join_pathlist_hook;
+	planner_hook = prev_planner_hook;
+}
+
+/*
+ * Enable feedback loop.
+ *
+ * Following GUC parameters will became "ON" when this function executed.
+ *   pg_plan_advsr.enabled
+ *   pg_hint_plan.debug_print
+ *   pg_hint_plan.enable_hint_table
+ */
+Datum
+pg_plan_advsr_enable_feedback(PG_FUNCTION_ARGS)
+{
+	elog(DEBUG3, "execute pg_plan_advsr_enable_feedback");
+
+	(void) set_config_option("pg_plan_advsr.enabled", "ON",
+							 PGC_USERSET, PGC_S_OVERRIDE,
+							 GUC_ACTION_SAVE, true, 0, false);
+
+	(void) set_config_option("pg_hint_plan.enable_hint_table", "ON",
+							 PGC_USERSET, PGC_S_OVERRIDE,
+							 GUC_ACTION_SAVE, true, 0, false);
+
+	(void) set_config_option("pg_hint_plan.debug_print", "ON",
+							 PGC_USERSET, PGC_S_OVERRIDE,
+							 GUC_ACTION_SAVE, true, 0, false);
+	PG_RETURN_VOID();
+}
+
+/*
+ * Disable feedback loop
+ */
+Datum
+pg_plan_advsr_disable_feedback(PG_FUNCTION_ARGS)
+{
+	elog(DEBUG3, "execute pg_plan_advsr_disable_feedback");
+
+	(void) set_config_option("pg_plan_advsr.enabled", "ON",
+							 PGC_USERSET, PGC_S_OVERRIDE,
+							 GUC_ACTION_SAVE, true, 0, false);
+
+	(void) set_config_option("pg_hint_plan.enable_hint_table", "OFF",
+							 PGC_USERSET, PGC_S_OVERRIDE,
+							 GUC_ACTION_SAVE, true, 0, false);
+
+	(void) set_config_option("pg_hint_plan.debug_print", "OFF",
+							 PGC_USERSET, PGC_S_OVERRIDE,
+							 GUC_ACTION_SAVE, true, 0, false);
+	PG_RETURN_VOID();
+}
+
+#define AUTO_TUNE_COLS	6
+
+/*
+ * Run the feedback loop of a query inside this backend.
+ *
+ * plan_repo.auto_tune(query text, max_iterations int, time_budget interval)
+ * runs EXPLAIN ANALYZE of the query up to max_iterations times, with the
+ * options of pg_plan_advsr.instrumentation, and stops
+ * early once tuning converges or time_budget is used up.  Each iteration
+ * is run as if it were a top-level statement, so that pg_plan_advsr stores
+ * its hints and pg_hint_plan looks them up by the query text.  Returns a
+ * row per iteration.
+ */
+Datum
+pg_plan_advsr_auto_tune(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	char	   *query;
+	int32		max_iterations;
+	int64		budget = 0;
+	TimestampTz start;
+	StringInfoData explain;
+	AutoTuneResult result;
+	uint64		prev_planid = 0;
+	int			saved_nested_level = nested_level;
+	const char *saved_debug_query_string = debug_query_string;
+	int			i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("query and max_iterations must not be null")));
+
+	query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	max_iterations = PG_GETARG_INT32(1);
+	if (!PG_ARGISNULL(2))
+	{
+		Interval   *interval = PG_GETARG_INTERVAL_P(2);
+
+		budget = interval->time +
+			((int64) interval->month * DAYS_PER_MONTH + interval->day) * USECS_PER_DAY;
+	}
+
+	if (!pg_plan_advsr_is_enabled)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_plan_advsr.enabled must be on to run auto_tune")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* collect what pg_plan_advsr.instrumentation says, as capture does */
+	initStringInfo(&explain);
+	switch (pg_plan_advsr_instrumentation)
+	{
+		case ADVSR_INSTRUMENT_ROWS:
+			appendStringInfoString(&explain, "EXPLAIN (ANALYZE, TIMING OFF) ");
+			break;
+		case ADVSR_INSTRUMENT_BUFFERS:
+			appendStringInfoString(&explain, "EXPLAIN (ANALYZE, TIMING OFF, BUFFERS) ");
+			break;
+		default:
+			appendStringInfoString(&explain, "EXPLAIN (ANALYZE, BUFFERS) ");
+			break;
+	}
+	appendStringInfoString(&explain, query);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	start = GetCurrentTimestamp();
+	for (i = 1; i <= max_iterations; i++)
+	{
+		Datum		values[AUTO_TUNE_COLS];
+		bool		nulls[AUTO_TUNE_COLS];
+		bool		converged;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/*
+		 * Let the EXPLAIN look like a top-level statement: pg_plan_advsr only
+		 * analyzes at nesting level 0, and pg_hint_plan and the normalization
+		 * on PG13 or below take the query text from debug_query_string.
+		 */
+		memset(&result, 0, sizeof(result));
+		auto_tune_result = &result;
+		nested_level = 0;
+		debug_query_string = explain.data;
+		PG_TRY();
+		{
+			if (SPI_execute(explain.data, false, 0) < 0)
+				elog(ERROR, "failed to run EXPLAIN ANALYZE of the query");
+			SPI_freetuptable(SPI_tuptable);
+		}
+		PG_CATCH();
+		{
+			auto_tune_result = NULL;
+			nested_level = saved_nested_level;
+			debug_query_string = saved_debug_query_string;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+		auto_tune_result = NULL;
+		nested_level = saved_nested_level;
+		debug_query_string = saved_debug_query_string;
+
+		if (!result.stored)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("query was not analyzed by pg_plan_advsr")));
+
+		/* the same rule as pg_plan_advsr.auto_pin, see updateTuningState() */
+		converged = result.stopped || result.join_rows_err == 0 ||
+			(i > 1 && result.planid == prev_planid);
+		prev_planid = result.planid;
+
+		memset(nulls, false, sizeof(nulls));
+		values[0] = Int32GetDatum(i);
+		values[1] = Int64GetDatum((int64) result.planid);
+		values[2] = Float8GetDatum(result.execution_time);
+		values[3] = Float8GetDatum(result.join_rows_err);
+		values[4] = Float8GetDatum(result.scan_rows_err);
+		values[5] = BoolGetDatum(converged);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		if (converged)
+			break;
+		if (budget > 0 &&
+			GetCurrentTimestamp() - start >= budget)
+			break;
+	}
+
+	SPI_finish();
+
+	return (Datum) 0;
+}
+
+
+#if PG_VERSION_NUM < 140000
+typedef pgssLocationLen ConstLocation;
+#else
+typedef LocationLen ConstLocation;
+#endif  /* PG_VERSION_NUM */
+
+/*
+ * Get the texts of the constants replaced by generate_normalized_query(),
+ * which has filled in their lengths, separated by ", ".
+ */
+static char *
+get_constant_texts(const char *query_str, ConstLocation *clocations,
+				   int clocations_count)
+{
+	StringInfoData buf;
+	int			i;
+
+	initStringInfo(&buf);
+	for (i = 0; i < clocations_count; i++)
+	{
+		/* duplicate constants have negative lengths */
+		if (clocations[i].length < 0)
+			continue;
+
+		if (buf.len > 0)
+			appendStringInfoString(&buf, ", ");
+		appendBinaryStringInfo(&buf, query_str + clocations[i].location,
+							   clocations[i].length);
+	}
+
+	return buf.data;
+}
+
+/*
+ * To get normalized query like a pg_hint_plan.c.  The texts of the replaced
+ * constants are returned into *params.
+ */
+static char *
+normalize_query(ParseState *pstate, Query *query,
+#if PG_VERSION_NUM < 140000
+				char **params)
+#else
+				JumbleState *jstate, char **params)
+#endif  /* PG_VERSION_NUM */
+{
+	const char *query_str;
+	char	   *norm_query = NULL;
+	int			query_len;
+#if PG_VERSION_NUM < 140000
+	pgssJumbleState jstate;
+	Query	   *jumblequery;
+#endif  /* PG_VERSION_NUM */
+
+	*params = NULL;
+
+#if PG_VERSION_NUM < 140000
+	query_str = get_query_string(pstate, query, &jumblequery);
+
+	if (query_str && jumblequery)
+	{
+		/*
+		 * XXX: normalizing code is copied from pg_stat_statements.c, so
+		 * be careful to PostgreSQL's version up.
+		 */
+		jstate.jumble = (unsigned char *) palloc(JUMBLE_SIZE);
+		jstate.jumble_len = 0;
+		jstate.clocations_buf_size = 32;
+		jstate.clocations = (pgssLocationLen *)
+			palloc(jstate.clocations_buf_size * sizeof(pgssLocationLen));
+		jstate.clocations_count = 0;
+
+		JumbleQuery(&jstate, jumblequery);
+
+		/*
+		 * Normalize the query string by replacing constants with '?'
+		 */
+		/*
+		 * Search hint string which is stored keyed by query string and
+		 * application name.  The query string is normalized to allow
+		 * fuzzy matching.
+		 *
+		 * Adding 1 byte to query_len ensures that the returned string has
+		 * a terminating NULL.
+		 */
+		query_len = strlen(query_str) + 1;
+		norm_query =
+			generate_normalized_query(&jstate, query_str,
+									  query->stmt_location,
+									  &query_len,
+									  GetDatabaseEncoding());
+		*params = get_constant_texts(query_str, jstate.clocations,
+									 jstate.clocations_count);
+	}
+#endif
+
+#if PG_VERSION_NUM >= 140000
+	query_str = pstate->p_sourcetext;
+
+	if (!jstate)
+#endif
+#if PG_VERSION_NUM >= 160000
+		jstate = JumbleQuery(query);
+#elif PG_VERSION_NUM >= 140000
+		jstate = JumbleQuery(query, query_str);
+#endif
+
+#if PG_VERSION_NUM >= 140000
+	if (!jstate)
+		return NULL;
+
+	query_len = strlen(query_str) + 1;
+	norm_query =
+		generate_normalized_query(jstate, query_str, 0, &query_len);
+	*params = get_constant_texts(query_str, jstate->clocations,
+								 jstate->clocations_count);
+#endif  /* PG_VERSION_NUM */
+
+	return norm_query;
+}
+
+static void
+pg_plan_advsr_post_parse_analyze_hook(ParseState *pstate, Query *query
+#if PG_VERSION_NUM < 140000
+									  )
+#else
+									  , JumbleState *jstate)
+#endif  /* PG_VERSION_NUM */
+{
+	char	   *norm_query;
+	char	   *norm_params;
+
+	if (prev_post_parse_analyze_hook)
+		prev_post_parse_analyze_hook(pstate, query
+#if PG_VERSION_NUM < 140000
+									  );
+#else
+									  , jstate);
+#endif  /* PG_VERSION_NUM */
+
+	if (!pg_plan_advsr_enabled())
+		return;
+
+	/*
+	 * Create normalized query for later use.  Only EXPLAIN statements and
+	 * sampled regular statements are analyzed, so others skip the
+	 * normalization.
+	 */
+	if (query->commandType == CMD_UTILITY)
+	{
+		if (is_target_explain(query->utilityStmt))
+		{
+			elog(DEBUG1, "##pg_plan_advsr_post_parse_analyze_hook start ##");
+			normalized_query = normalize_query(pstate, query,
+#if PG_VERSION_NUM >= 140000
+											   jstate,
+#endif  /* PG_VERSION_NUM */
+											   &normalized_params);
+			elog(DEBUG1, "##pg_plan_advsr_post_parse_analyze_hook end ##");
+		}
+		return;
+	}
+
+	clear_capture();
+	if (pg_plan_advsr_capture_sample_rate <= 0 || pstate->p_sourcetext == NULL ||
+#if PG_VERSION_NUM >= 150000
+		pg_prng_double(&pg_global_prng_state) >= pg_plan_advsr_capture_sample_rate)
+#else
+		random() > (MAX_RANDOM_VALUE * pg_plan_advsr_capture_sample_rate))
+#endif  /* PG_VERSION_NUM */
+		return;
+
+	norm_query = normalize_query(pstate, query,
+#if PG_VERSION_NUM >= 140000
+								 jstate,
+#endif  /* PG_VERSION_NUM */
+								 &norm_params);
+	if (norm_query == NULL)
+		return;
+
+	capture_source_text = MemoryContextStrdup(TopMemoryContext,
+											  pstate->p_sourcetext);
+	capture_norm_query = MemoryContextStrdup(TopMemoryContext, norm_query);
+	capture_norm_params = MemoryContextStrdup(TopMemoryContext, norm_params);
+}
+
+/*
+ * Forget the statement sampled for capture.
+ */
+static void
+clear_capture(void)
+{
+	if (capture_source_text)
+		pfree(capture_source_text);
+	if (capture_norm_query)
+		pfree(capture_norm_query);
+	if (capture_norm_params)
+		pfree(capture_norm_params);
+	capture_norm_params = NULL;
+	capture_source_text = NULL;
+	capture_norm_query = NULL;
+	capture_current = false;
+}
+
+
+/*
+ * This function setup the "isExplain" flag.
+ * If this flag is true, we can create hints for given query.
+ */
+static void
+pg_plan_advsr_ProcessUtility_hook(PlannedStmt *pstmt,
+								  const char *queryString,
+#if PG_VERSION_NUM >= 140000
+											  bool readOnlyTree,
+#endif  /* PG_VERSION_NUM */
+								  ProcessUtilityContext context,
+								  ParamListInfo params,
+								  QueryEnvironment *queryEnv,
+								  DestReceiver *dest,
+#if PG_VERSION_NUM < 130000
+								  char *completionTag)
+#else
+								  QueryCompletion *qc)
+#endif  /* PG_VERSION_NUM */
+{
+	isExplain = query_or_expression_tree_walker((Node *) pstmt,
+												pg_plan_advsr_query_walker,
+												NULL,
+												0);
+	if (isExplain)
+	{
+		elog(DEBUG1, "queryString: %s", queryString);
+		explain_query = makeStringInfo();
+		appendStringInfo(explain_query, "%s", queryString);
+	}
+
+	if (prev_ProcessUtility_hook)
+		prev_ProcessUtility_hook(
+								 pstmt,
+								 queryString,
+#if PG_VERSION_NUM >= 140000
+								 readOnlyTree,
+#endif  /* PG_VERSION_NUM */
+								 context,
+								 params,
+								 queryEnv,
+								 dest,
+#if PG_VERSION_NUM < 130000
+								 completionTag);
+#else
+								 qc);
+#endif  /* PG_VERSION_NUM */
+	else
+		standard_ProcessUtility(
+								pstmt,
+								queryString,
+#if PG_VERSION_NUM >= 140000
+								 readOnlyTree,
+#endif  /* PG_VERSION_NUM */
+								context,
+								params,
+								queryEnv,
+								dest,
+#if PG_VERSION_NUM < 130000
+								completionTag);
+#else
+								qc);
+#endif  /* PG_VERSION_NUM */
+}
+
+
+static void pg_plan_advsr_ExplainOneQuery_hook(Query *query,
+											   int cursorOptions,
+											   IntoClause *into,
+											   ExplainState *es,
+											   const char *queryString,
+											   ParamListInfo params,
+											   QueryEnvironment *queryEnv)
+{
+	PlannedStmt *plan;
+	instr_time	planstart,
+				planduration;
+#if PG_VERSION_NUM > 130000
+	BufferUsage bufusage_start,
+				bufusage;
+#endif  /* PG_VERSION_NUM */
+	bool		repeatable = false;
+
+	if (prev_ExplainOneQuery_hook)
+		prev_ExplainOneQuery_hook(query,
+								  cursorOptions,
+								  into,
+								  es,
+								  queryString,
+								  params,
+								  queryEnv);
+
+	if (run_pg_plan_advsr())
+	{
+		elog(DEBUG1, "##pg_plan_advsr_ExplainOneQuery_hook start ##");
+
+		PG_TRY();
+		{
+
+#if PG_VERSION_NUM > 130000
+			if (es->buffers)
+				bufusage_start = pgBufferUsage;
+#endif  /* PG_VERSION_NUM */
+
+			/*
+			 * Only a plain SELECT can be run again without side effects, and
+			 * volatile functions such as nextval() would see the repeated
+			 * executions.  The planner may scribble on the query, so look at
+			 * it before planning.
+			 */
+			if (es->analyze && into == NULL && pg_plan_advsr_measure_repeats > 1)
+				repeatable = !contain_volatile_functions((Node *) query);
+
+			INSTR_TIME_SET_CURRENT(planstart);
+
+			/* plan the query */
+			plan = pg_plan_query(query,
+#if PG_VERSION_NUM < 130000
+								 cursorOptions, params);
+#else
+								 queryString, cursorOptions, params);
+#endif  /* PG_VERSION_NUM */
+
+			INSTR_TIME_SET_CURRENT(planduration);
+			INSTR_TIME_SUBTRACT(planduration, planstart);
+
+#if PG_VERSION_NUM > 130000
+			/* calc differences of buffer counters. */
+			if (es->buffers)
+			{
+				memset(&bufusage, 0, sizeof(BufferUsage));
+				BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+			}
+#endif  /* PG_VERSION_NUM */
+
+			/*
+			 * Run the query some more times to measure its execution time,
+			 * instrumented as the execution EXPLAIN shows.
+			 */
+			measure_nsamples = 0;
+			if (repeatable && plan->commandType == CMD_SELECT &&
+				!plan->hasModifyingCTE && plan->rowMarks == NIL)
+			{
+				int			instrument_options = explain_instrument_options(es);
+				int			i;
+
+				for (i = 1; i < pg_plan_advsr_measure_repeats; i++)
+					measure_execution(plan, queryString, params, queryEnv,
+									  instrument_options);
+			}
+
+
+			/* run it (if needed) and produce output */
+			ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+#if PG_VERSION_NUM < 130000
+						   &planduration);
+#else
+						   &planduration, (es->buffers ? &bufusage : NULL));
+#endif  /* PG_VERSION_NUM */
+
+			if (es->format == EXPLAIN_FORMAT_TEXT && !pg_plan_advsr_is_quieted &&
+				leadcxt != NULL)
+			{
+				appendStringInfo(es->str, "\nDESCRIBE\n");
+				appendStringInfo(es->str, "------------------------\n");
+				appendStringInfo(es->str, "application:    %s\n", aplname);
+				appendStringInfo(es->str, "pgsp_queryid:   %ld\n", pgsp_queryid);
+				if (pgsp_planid_known)
+					appendStringInfo(es->str, "pgsp_planid:    %u\n", pgsp_planid);
+				else
+					appendStringInfo(es->str, "pgsp_planid:    (not computed)\n");
+				appendStringInfo(es->str, "join_cnt:       %d\n", join_cnt);
+				appendStringInfo(es->str, "join_rows_err:  %.0f\n", total_diff_rows_join);
+				appendStringInfo(es->str, "join_err_ratio: %.2f\n", max_diff_ratio_join);
+				appendStringInfo(es->str, "scan_cnt:       %d\n", scan_cnt);
+				appendStringInfo(es->str, "scan_rows_err:  %.0f\n", total_diff_rows_scan);
+				appendStringInfo(es->str, "scan_err_ratio: %.2f\n", max_diff_ratio_scan);
+
+				appendStringInfo(es->str, "lead hint:      %s\n", leadcxt->lead_str->data);
+				replaceAll(join_str->data, "\n", "");
+				appendStringInfo(es->str, "join hint:      %s\n", join_str->data);
+
+				appendStringInfo(es->str, "scan hint:      %s\n", scan_str->data);
+
+				replaceAll(rows_str->data, "\n", "");
+				appendStringInfo(es->str, "rows hint:      %s\n", rows_str->data);
+			}
+		}
+		PG_CATCH();
+		{
+			reset_analysis_context();
+			measure_nsamples = 0;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		/* post processing */
+		isExplain = false;
+		measure_nsamples = 0;
+		normalized_query = NULL;
+		normalized_params = NULL;
+		pgsp_queryid = 0;
+		pgsp_planid = 0;
+		pgsp_planid_known = false;
+		reset_analysis_context();
+
+		elog(DEBUG1, "##pg_plan_advsr_ExplainOneQuery_hook end ##");
+	}
+	else
+	{
+		INSTR_TIME_SET_CURRENT(planstart);
+
+		/* plan the query */
+		plan = pg_plan_query(query,
+#if PG_VERSION_NUM < 130000
+							 cursorOptions, params);
+#else
+							 queryString, cursorOptions, params);
+#endif  /* PG_VERSION_NUM */
+
+		INSTR_TIME_SET_CURRENT(planduration);
+		INSTR_TIME_SUBTRACT(planduration, planstart);
+
+		/* run it (if needed) and produce output */
+		ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+#if PG_VERSION_NUM < 130000
+					   &planduration);
+#else
+					   &planduration, (es->buffers ? &bufusage : NULL));
+#endif  /* PG_VERSION_NUM */
+	}
+}
+
+
+/*
+ * Instrument options of pg_plan_advsr.instrumentation
+ */
+static int
+advsr_instrument_options(void)
+{
+	switch (pg_plan_advsr_instrumentation)
+	{
+		case ADVSR_INSTRUMENT_TIMING:
+			return INSTRUMENT_ALL;
+		case ADVSR_INSTRUMENT_BUFFERS:
+			return INSTRUMENT_ROWS | INSTRUMENT_BUFFERS;
+		default:
+			return INSTRUMENT_ROWS;
+	}
+}
+
+/* ExecutorStart, Run and Finish are came from pg_store_plans.c */
+/*
+ * ExecutorStart hook: start up tracking if needed
+ */
+static void
+pg_plan_advsr_ExecutorStart_hook(QueryDesc *queryDesc, int eflags)
+{
+	/*
+	 * Instrument the statement sampled for capture as much as
+	 * pg_plan_advsr.instrumentation says.  Nothing can be stored in a
+	 * read-only transaction.
+	 */
+	if (capture_source_text != NULL && !isExplain && pg_plan_advsr_enabled() &&
+		!XactReadOnly && !RecoveryInProgress() &&
+		strcmp(queryDesc->sourceText, capture_source_text) == 0)
+	{
+		capture_current = true;
+		queryDesc->instrument_options |= advsr_instrument_options();
+	}
+
+	if (prev_ExecutorStart_hook)
+		prev_ExecutorStart_hook(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	/*
+	 * Set up to track total elapsed time in ExecutorRun. Allocate in
+	 * per-query context so as to be free at ExecutorEnd.  The total time is
+	 * always needed for execution_time, and the shared buffer usage for
+	 * shared_hit_ratio.
+	 */
+	if (pg_plan_advsr_enabled() && queryDesc->totaltime == NULL)
+	{
+		MemoryContext oldcxt;
+
+		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+		queryDesc->totaltime = InstrAlloc(1, advsr_instrument_options() |
+										  INSTRUMENT_TIMER | INSTRUMENT_BUFFERS
+#if PG_VERSION_NUM >= 140000
+										  , false
+#endif  /* PG_VERSION_NUM */
+										 );
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+}
+
+/*
+ * ExecutorRun hook: all we need do is track nesting depth
+ */
+static void
+pg_plan_advsr_ExecutorRun_hook(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+							   bool execute_once)
+{
+	nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun_hook)
+			prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * ExecutorFinish hook: all we need do is track nesting depth
+ */
+static void
+pg_plan_advsr_ExecutorFinish_hook(QueryDesc *queryDesc)
+{
+	nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish_hook)
+			prev_ExecutorFinish_hook(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Free everything allocated for the hints of the last analyzed query.
+ */
+static void
+reset_analysis_context(void)
+{
+	if (analysis_cxt == NULL)
+		return;
+
+	MemoryContextReset(analysis_cxt);
+	leadcxt = NULL;
+	scan_str = NULL;
+	join_str = NULL;
+	rows_str = NULL;
+}
+
+/*
+ * Instrumentation options of the execution of EXPLAIN ANALYZE, the same as
+ * ExplainOnePlan() sets up.
+ */
+static int
+explain_instrument_options(ExplainState *es)
+{
+	int			instrument_options = 0;
+
+	if (es->analyze && es->timing)
+		instrument_options |= INSTRUMENT_TIMER;
+	else if (es->analyze)
+		instrument_options |= INSTRUMENT_ROWS;
+	if (es->buffers)
+		instrument_options |= INSTRUMENT_BUFFERS;
+#if PG_VERSION_NUM >= 130000
+	if (es->wal)
+		instrument_options |= INSTRUMENT_WAL;
+#endif  /* PG_VERSION_NUM */
+
+	return instrument_options;
+}
+
+/*
+ * Execute a plan once more, discarding its result, and record its execution
+ * time and shared buffer usage as a sample.  This follows ExplainOnePlan(),
+ * and the plan is instrumented with the same options so that its time is
+ * comparable with the execution EXPLAIN shows.
+ */
+static void
+measure_execution(PlannedStmt *plan, const char *queryString,
+				  ParamListInfo params, QueryEnvironment *queryEnv,
+				  int instrument_options)
+{
+	QueryDesc  *queryDesc;
+	Instrumentation *totaltime;
+
+	totaltime = InstrAlloc(1, INSTRUMENT_TIMER | INSTRUMENT_BUFFERS
+#if PG_VERSION_NUM >= 140000
+						   , false
+#endif  /* PG_VERSION_NUM */
+						  );
+
+	/* the extra executions are not the targets */
+	nested_level++;
+	PG_TRY();
+	{
+		PushCopiedSnapshot(GetActiveSnapshot());
+		UpdateActiveSnapshotCommandId();
+
+		queryDesc = CreateQueryDesc(plan, queryString,
+									GetActiveSnapshot(), InvalidSnapshot,
+									None_Receiver, params, queryEnv,
+									instrument_options);
+		ExecutorStart(queryDesc, 0);
+		queryDesc->totaltime = totaltime;
+		ExecutorRun(queryDesc, ForwardScanDirection, 0L, true);
+		ExecutorFinish(queryDesc);
+		ExecutorEnd(queryDesc);
+		FreeQueryDesc(queryDesc);
+
+		PopActiveSnapshot();
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	InstrEndLoop(totaltime);
+	add_measure_sample(totaltime);
+	pfree(totaltime);
+}
+
+/*
+ * Record the execution time and shared buffer usage of an execution.
+ */
+static void
+add_measure_sample(Instrumentation *totaltime)
+{
+	if (measure_nsamples >= MEASURE_MAX_REPEATS)
+		return;
+
+	measure_times[measure_nsamples] = totaltime->total * 1000.0;
+	measure_hits[measure_nsamples] = totaltime->bufusage.shared_blks_hit;
+	measure_reads[measure_nsamples] = totaltime->bufusage.shared_blks_read;
+	measure_nsamples++;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double		da = *(const double *) a;
+	double		db = *(const double *) b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Compute the median and 90th percentile of the execution times and the
+ * shared buffer hit ratio of the recorded samples.  cache_differs is set if
+ * the hit ratios of the executions are far apart, for example the first
+ * execution read from disk and the others didn't.  The samples are consumed.
+ */
+static void
+get_measure_stats(PlanInfo *info)
+{
+	double		times[MEASURE_MAX_REPEATS];
+	double		min_ratio = 1.0;
+	double		max_ratio = 0.0;
+	int64		hits = 0;
+	int64		reads = 0;
+	int			i;
+
+	info->execution_time_median = info->execution_time;
+	info->execution_time_p90 = info->execution_time;
+	info->shared_hit_ratio = -1;
+	info->cache_differs = false;
+
+	if (measure_nsamples == 0)
+		return;
+
+	memcpy(times, measure_times, sizeof(double) * measure_nsamples);
+	qsort(times, measure_nsamples, sizeof(double), double_cmp);
+	if (measure_nsamples % 2 == 1)
+		info->execution_time_median = times[measure_nsamples / 2];
+	else
+		info->execution_time_median = (times[measure_nsamples / 2 - 1] +
+									   times[measure_nsamples / 2]) / 2;
+	/* nearest-rank percentile */
+	info->execution_time_p90 = times[(int) ceil(0.9 * measure_nsamples) - 1];
+
+	for (i = 0; i < measure_nsamples; i++)
+	{
+		double		ratio;
+
+		hits += measure_hits[i];
+		reads += measure_reads[i];
+		if (measure_hits[i] + measure_reads[i] == 0)
+			continue;
+
+		ratio = (double) measure_hits[i] / (measure_hits[i] + measure_reads[i]);
+		min_ratio = Min(min_ratio, ratio);
+		max_ratio = Max(max_ratio, ratio);
+	}
+
+	if (hits + reads > 0)
+		info->shared_hit_ratio = (double) hits / (hits + reads);
+	info->cache_differs = (max_ratio - min_ratio > MEASURE_CACHE_DIFF);
+
+	measure_nsamples = 0;
+}
+
+/*
+ * Create hints of the executed query and store them.  The hints are left in
+ * the analysis context for the DESCRIBE output.
+ */
+static void
+create_hints(QueryDesc *queryDesc)
+{
+	ExplainState *hs;
+	MemoryContext oldcxt;
+
+	/* leftovers of an analysis aborted by an error are freed here */
+	reset_analysis_context();
+	if (analysis_cxt == NULL)
+		analysis_cxt = AllocSetContextCreate(TopMemoryContext,
+											 "pg_plan_advsr analysis",
+											 ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(analysis_cxt);
+
+	/* Create Hints using HintState like a ExplainState */
+	hs = NewExplainState();
+	hs->analyze = true;
+	hs->verbose = true;
+	hs->buffers = false;
+	hs->timing = false;
+	hs->summary = hs->analyze;
+	hs->format = EXPLAIN_FORMAT_JSON;
+
+	/* Initialize */
+	leadcxt = (LeadingContext *) palloc0(sizeof(LeadingContext));
+	leadcxt->lead_str = makeStringInfo();
+	scan_str = makeStringInfo();
+	join_str = makeStringInfo();
+	rows_str = makeStringInfo();
+	est_rows = 0;
+	act_rows = 0;
+	diff_rows_join  = 0;
+	diff_ratio_join = 0;
+	diff_rows_scan  = 0;
+	diff_ratio_scan = 0;
+	scan_cnt = 0;
+	join_cnt = 0;
+	rows_cnt = 0;
+
+	/* statements run to store the hints are not the targets */
+	nested_level++;
+	PG_TRY();
+	{
+		pg_plan_advsr_ExplainPrintPlan(hs, queryDesc);
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * ExecutorEnd_hook: create hints by using PlannedStmt or ExplainState, and output it.
+ */
+static void
+pg_plan_advsr_ExecutorEnd_hook(QueryDesc *queryDesc)
+{
+	if (queryDesc->totaltime)
+		InstrEndLoop(queryDesc->totaltime);
+
+	elog(DEBUG1, "isExplain: %d", isExplain);
+	if (isExplain && pg_plan_advsr_enabled()
+				  && strcmp(queryDesc->sourceText, explain_query->data) == 0)
+	{
+		elog(DEBUG1, "## pg_plan_advsr_ExecutorEnd start ##");
+
+		create_hints(queryDesc);
+
+		elog(DEBUG1, "## pg_plan_advsr_ExecutorEnd end ##");
+
+		/* initialize */
+		/* isExplain = false; */
+	}
+	else if (capture_current && pg_plan_advsr_enabled())
+	{
+		if (queryDesc->planstate->instrument != NULL &&
+			queryDesc->totaltime != NULL &&
+			queryDesc->totaltime->total * 1000.0 >= pg_plan_advsr_capture_min_duration)
+		{
+			elog(DEBUG1, "## pg_plan_advsr_ExecutorEnd capture start ##");
+
+			normalized_query = capture_norm_query;
+			normalized_params = capture_norm_params;
+			create_hints(queryDesc);
+			normalized_query = NULL;
+			normalized_params = NULL;
+			reset_analysis_context();
+
+			elog(DEBUG1, "## pg_plan_advsr_ExecutorEnd capture end ##");
+		}
+		clear_capture();
+	}
+
+	if (prev_ExecutorEnd_hook)
+		prev_ExecutorEnd_hook(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * Create pg_store_plans's planid
+ * This function is inspired store_entry() and pgsp_ExecutorEnd() in pg_store_plans.
+ *
+ * *planid64 is always set.  *planid32 is set to the planid pg_store_plans
+ * gives to the plan, and false is returned if it is not computed.
+ */
+bool
+create_pgsp_planid(QueryDesc *queryDesc, uint32 *planid32, uint64 *planid64)
+{
+	PlanHashContext ctx;
+	PgspPlanidKey key;
+	PgspPlanidEntry *entry;
+	bool		pgsp_settings[PGSP_NUM_SETTINGS];
+	int			i;
+
+	/* 64-bit planid is computed directly from the plan tree */
+	ctx.hash = 0;
+	ctx.exprs = 0;
+	ctx.rtable = queryDesc->plannedstmt->rtable;
+	ctx.deps = NULL;
+	ctx.ndeps = 0;
+	ctx.maxdeps = 0;
+	plan_hash_walker(queryDesc->planstate, &ctx);
+	*planid64 = ctx.hash;
+
+	if (!pg_plan_advsr_compute_pgsp_planid)
+		return false;
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryDesc->plannedstmt->queryId;
+	key.planid = ctx.hash;
+	key.exprs = ctx.exprs;
+	for (i = 0; i < PGSP_NUM_SETTINGS; i++)
+	{
+		pgsp_settings[i] = pgsp_setting_is_on(pgsp_setting_names[i]);
+		key.settings |= (uint64) pgsp_settings[i] << i;
+	}
+	key.settings |= (uint64) queryDesc->instrument_options << PGSP_NUM_SETTINGS;
+	/* they decide how names are qualified and quoted in the plan text */
+	key.settings = hash_combine64(key.settings, quote_all_identifiers);
+	key.settings = hash_combine64(key.settings,
+								  DatumGetUInt64(hash_any_extended((const unsigned char *) namespace_search_path,
+																   strlen(namespace_search_path), 0)));
+
+	/* the whole cache is dropped only when everything is invalidated */
+	if (pgsp_planid_cache != NULL && pgsp_planid_cache_stale)
+	{
+		MemoryContextReset(pgsp_planid_cxt);
+		pgsp_planid_cache = NULL;
+		dlist_init(&pgsp_planid_lru);
+	}
+	if (pgsp_planid_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		if (pgsp_planid_cxt == NULL)
+			pgsp_planid_cxt = AllocSetContextCreate(TopMemoryContext,
+													"pg_plan_advsr pgsp_planid cache",
+													ALLOCSET_DEFAULT_SIZES);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(PgspPlanidKey);
+		ctl.entrysize = sizeof(PgspPlanidEntry);
+		ctl.hcxt = pgsp_planid_cxt;
+		pgsp_planid_cache = hash_create("pg_plan_advsr pgsp_planid cache",
+										PGSP_PLANID_CACHE_SIZE, &ctl,
+										HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		pgsp_planid_cache_stale = false;
+	}
+
+	entry = (PgspPlanidEntry *) hash_search(pgsp_planid_cache, &key,
+											HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		uint32		planid = explain_pgsp_planid(queryDesc, pgsp_settings);
+		PlanHashDep *deps = NULL;
+
+		if (ctx.ndeps > 0)
+		{
+			deps = (PlanHashDep *) MemoryContextAlloc(pgsp_planid_cxt,
+													  sizeof(PlanHashDep) * ctx.ndeps);
+			memcpy(deps, ctx.deps, sizeof(PlanHashDep) * ctx.ndeps);
+		}
+
+		/* evict the least recently used entry */
+		if (hash_get_num_entries(pgsp_planid_cache) >= PGSP_PLANID_CACHE_SIZE)
+			pgsp_planid_remove(dlist_container(PgspPlanidEntry, lru_node,
+											   dlist_tail_node(&pgsp_planid_lru)));
+
+		entry = (PgspPlanidEntry *) hash_search(pgsp_planid_cache, &key,
+												HASH_ENTER, NULL);
+		entry->pgsp_planid = planid;
+		entry->ndeps = ctx.ndeps;
+		entry->deps = deps;
+		dlist_push_head(&pgsp_planid_lru, &entry->lru_node);
+	}
+	else
+		dlist_move_head(&pgsp_planid_lru, &entry->lru_node);
+
+	*planid32 = entry->pgsp_planid;
+	elog(DEBUG3, "planid: %u", *planid32);
+	return true;
+}
+
+/*
+ * Compute pgsp_planid from the EXPLAIN output of the plan, exactly as
+ * pg_store_plans does.
+ */
+static uint32
+explain_pgsp_planid(QueryDesc *queryDesc, const bool *pgsp_settings)
+{
+	ExplainState *es;
+	StringInfo	es_str;
+	char	   *normalized_plan = NULL;
+	uint32		planid;			/* plan identifier */
+
+	elog(DEBUG1, "pg_store_plans.log_verbose : %s",
+		 pgsp_settings[PGSP_LOG_VERBOSE] ? "on" : "off");
+	elog(DEBUG1, "pg_store_plans.log_buffers : %s",
+		 pgsp_settings[PGSP_LOG_BUFFERS] ? "on" : "off");
+	elog(DEBUG1, "pg_store_plans.log_timing  : %s",
+		 pgsp_settings[PGSP_LOG_TIMING] ? "on" : "off");
+	elog(DEBUG1, "pg_store_plans.log_triggers: %s",
+		 pgsp_settings[PGSP_LOG_TRIGGERS] ? "on" : "off");
+
+	es = NewExplainState();
+	es_str = es->str;
+	es->analyze = queryDesc->instrument_options;
+	es->verbose = pgsp_settings[PGSP_LOG_VERBOSE];
+	/* don't print what was not collected */
+	es->buffers = (pgsp_settings[PGSP_LOG_BUFFERS] &&
+				   (queryDesc->instrument_options & INSTRUMENT_BUFFERS) != 0);
+	es->timing = (pgsp_settings[PGSP_LOG_TIMING] &&
+				  (queryDesc->instrument_options & INSTRUMENT_TIMER) != 0);
+	es->format = EXPLAIN_FORMAT_JSON;
+
+	ExplainBeginOutput(es);
+	ExplainPrintPlan(es, queryDesc);
+	/* trigger statistics are collected only with instrumentation */
+	if (pgsp_settings[PGSP_LOG_TRIGGERS] && es->analyze)
+		ExplainPrintTriggers(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* Remove last line break */
+	if (es_str->len > 0 && es_str->data[es_str->len - 1] == '\n')
+		es_str->data[--es_str->len] = '\0';
+
+	/* JSON outmost braces. */
+	es_str->data[0] = '{';
+	es_str->data[es_str->len - 1] = '}';
+
+	/* es_str->data is a Plan formatted Json */
+	normalized_plan = pgsp_json_normalize(es_str->data);
+	planid = hash_any((const unsigned char *) normalized_plan,
+					  strlen(normalized_plan));
+	elog(DEBUG3, "normalized_plan: %s", normalized_plan);
+	pfree(normalized_plan);
+	pfree(es_str->data);
+
+	return planid;
+}
+
+/*
+ * Return true if a bool setting of pg_store_plans is on.  GetConfigOption()
+ * doesn't allocate, and it returns NULL if pg_store_plans is not loaded.
+ */
+static bool
+pgsp_setting_is_on(const char *name)
+{
+	const char *value = GetConfigOption(name, true, false);
+
+	return value != NULL && strcmp(value, "on") == 0;
+}
+
+/*
+ * Remove an entry from the pgsp_planid cache.
+ */
+static void
+pgsp_planid_remove(PgspPlanidEntry *entry)
+{
+	dlist_delete(&entry->lru_node);
+	if (entry->deps != NULL)
+		pfree(entry->deps);
+	hash_search(pgsp_planid_cache, &entry->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Remove the cached pgsp_planids of the plans which print the invalidated
+ * catalog entry.
+ */
+static void
+pgsp_planid_invalidate(int cacheid, uint32 value)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PgspPlanidEntry *entry;
+
+	if (pgsp_planid_cache == NULL || pgsp_planid_cache_stale)
+		return;
+
+	hash_seq_init(&hash_seq, pgsp_planid_cache);
+	while ((entry = (PgspPlanidEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			i;
+
+		for (i = 0; i < entry->ndeps; i++)
+		{
+			if (entry->deps[i].cacheid == cacheid &&
+				entry->deps[i].value == value)
+			{
+				/* removing the current entry doesn't break the scan */
+				pgsp_planid_remove(entry);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Syscache callback for pg_proc, pg_operator and pg_type: their names are
+ * printed in the plan texts, so the cached pgsp_planids may be outdated.
+ */
+static void
+pgsp_planid_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if (hashvalue == 0)
+		pgsp_planid_cache_stale = true;
+	else
+		pgsp_planid_invalidate(cacheid, hashvalue);
+}
+
+/*
+ * Remember a catalog entry printed in the plan text, so that the cached
+ * pgsp_planid is dropped when the entry is invalidated.
+ */
+static void
+plan_hash_dep(PlanHashContext *ctx, int cacheid, Oid oid)
+{
+	PlanHashDep dep;
+	int			i;
+
+	if (!OidIsValid(oid))
+		return;
+
+	dep.cacheid = cacheid;
+	if (cacheid == PLAN_HASH_DEP_RELATION)
+		dep.value = oid;
+	else
+		dep.value = GetSysCacheHashValue1(cacheid, ObjectIdGetDatum(oid));
+
+	for (i = 0; i < ctx->ndeps; i++)
+	{
+		if (ctx->deps[i].cacheid == dep.cacheid &&
+			ctx->deps[i].value == dep.value)
+			return;
+	}
+
+	if (ctx->ndeps >= ctx->maxdeps)
+	{
+		ctx->maxdeps = Max(16, ctx->maxdeps * 2);
+		if (ctx->deps == NULL)
+			ctx->deps = (PlanHashDep *) palloc(sizeof(PlanHashDep) * ctx->maxdeps);
+		else
+			ctx->deps = (PlanHashDep *) repalloc(ctx->deps,
+												 sizeof(PlanHashDep) * ctx->maxdeps);
+	}
+	ctx->deps[ctx->ndeps++] = dep;
+}
+
+/*
+ * Mix a relation scanned by a plan node into the plan hash.
+ */
+static void
+plan_hash_scan(PlanHashContext *ctx, Index scanrelid)
+{
+	RangeTblEntry *rte;
+
+	if (scanrelid == 0 || scanrelid > list_length(ctx->rtable))
+		return;
+
+	rte = rt_fetch(scanrelid, ctx->rtable);
+	ctx->hash = hash_combine64(ctx->hash, rte->relid);
+	plan_hash_dep(ctx, PLAN_HASH_DEP_RELATION, rte->relid);
+	if (rte->eref && rte->eref->aliasname)
+		ctx->hash = hash_combine64(ctx->hash,
+								   DatumGetUInt64(hash_any_extended((const unsigned char *) rte->eref->aliasname,
+																	strlen(rte->eref->aliasname), 0)));
+}
+
+/*
+ * Mix a column list of a plan node into the expression hash.
+ */
+static void
+plan_hash_columns(PlanHashContext *ctx, int ncols, const AttrNumber *cols)
+{
+	int			i;
+
+	ctx->exprs = hash_combine64(ctx->exprs, ncols);
+	for (i = 0; i < ncols; i++)
+		ctx->exprs = hash_combine64(ctx->exprs, cols[i]);
+}
+
+/*
+ * Mix an expression, or a list of them, of a plan node into the expression
+ * hash.  An empty one counts too, so that expressions can't move between
+ * the fields of a node without changing the hash.
+ */
+static void
+plan_hash_exprs(PlanHashContext *ctx, void *node)
+{
+	(void) plan_hash_expr_walker((Node *) node, ctx);
+	ctx->exprs = hash_combine64(ctx->exprs, ';');
+}
+
+/*
+ * Mix an expression tree into ctx->exprs: node types, columns, functions,
+ * operators and the types of the constants.  The values of the constants
+ * are not used, as pg_store_plans normalizes them away.
+ */
+static bool
+plan_hash_expr_walker(Node *node, void *context)
+{
+	PlanHashContext *ctx = (PlanHashContext *) context;
+	uint64		h;
+	bool		result;
+
+	if (node == NULL)
+		return false;
+
+	h = nodeTag(node);
+	switch (nodeTag(node))
+	{
+		case T_Var:
+			h = hash_combine64(h, ((Var *) node)->varno);
+			h = hash_combine64(h, ((Var *) node)->varattno);
+			h = hash_combine64(h, ((Var *) node)->varlevelsup);
+			break;
+		case T_Const:
+			h = hash_combine64(h, ((Const *) node)->consttype);
+			plan_hash_dep(ctx, TYPEOID, ((Const *) node)->consttype);
+			break;
+		case T_Param:
+			h = hash_combine64(h, ((Param *) node)->paramkind);
+			h = hash_combine64(h, ((Param *) node)->paramid);
+			break;
+		case T_Aggref:
+			h = hash_combine64(h, ((Aggref *) node)->aggfnoid);
+			plan_hash_dep(ctx, PROCOID, ((Aggref *) node)->aggfnoid);
+			break;
+		case T_WindowFunc:
+			h = hash_combine64(h, ((WindowFunc *) node)->winfnoid);
+			plan_hash_dep(ctx, PROCOID, ((WindowFunc *) node)->winfnoid);
+			break;
+		case T_FuncExpr:
+			h = hash_combine64(h, ((FuncExpr *) node)->funcid);
+			plan_hash_dep(ctx, PROCOID, ((FuncExpr *) node)->funcid);
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:
+		case T_NullIfExpr:
+			h = hash_combine64(h, ((OpExpr *) node)->opno);
+			plan_hash_dep(ctx, OPEROID, ((OpExpr *) node)->opno);
+			break;
+		case T_ScalarArrayOpExpr:
+			h = hash_combine64(h, ((ScalarArrayOpExpr *) node)->opno);
+			plan_hash_dep(ctx, OPEROID, ((ScalarArrayOpExpr *) node)->opno);
+			h = hash_combine64(h, ((ScalarArrayOpExpr *) node)->useOr);
+			break;
+		case T_BoolExpr:
+			h = hash_combine64(h, ((BoolExpr *) node)->boolop);
+			break;
+		case T_SubPlan:
+			h = hash_combine64(h, ((SubPlan *) node)->plan_id);
+			h = hash_combine64(h, ((SubPlan *) node)->subLinkType);
+			break;
+		case T_RelabelType:
+			h = hash_combine64(h, ((RelabelType *) node)->resulttype);
+			plan_hash_dep(ctx, TYPEOID, ((RelabelType *) node)->resulttype);
+			break;
+		case T_CoerceViaIO:
+			h = hash_combine64(h, ((CoerceViaIO *) node)->resulttype);
+			plan_hash_dep(ctx, TYPEOID, ((CoerceViaIO *) node)->resulttype);
+			break;
+		case T_NullTest:
+			h = hash_combine64(h, ((NullTest *) node)->nulltesttype);
+			break;
+		case T_BooleanTest:
+			h = hash_combine64(h, ((BooleanTest *) node)->booltesttype);
+			break;
+		case T_TargetEntry:
+			h = hash_combine64(h, ((TargetEntry *) node)->resno);
+			break;
+		default:
+			break;
+	}
+	ctx->exprs = hash_combine64(ctx->exprs, h);
+
+	/* bracket the arguments so that the shape of the tree counts */
+	ctx->exprs = hash_combine64(ctx->exprs, '(');
+	result = expression_tree_walker(node, plan_hash_expr_walker, context);
+	ctx->exprs = hash_combine64(ctx->exprs, ')');
+
+	return result;
+}
+
+/*
+ * Compute the plan identity of a plan tree without EXPLAIN.  It mixes the
+ * shape of the tree, node types, join types, strategies, scanned relations
+ * and indexes into ctx->hash; costs, rows and expressions are not used.
+ * The expressions and columns are mixed into ctx->exprs separately, so
+ * that the pair identifies the plan text pg_store_plans normalizes.
+ */
+static bool
+plan_hash_walker(PlanState *planstate, void *context)
+{
+	PlanHashContext *ctx = (PlanHashContext *) context;
+	Plan	   *plan = planstate->plan;
+
+	ctx->hash = hash_combine64(ctx->hash, nodeTag(plan));
+	ctx->hash = hash_combine64(ctx->hash, plan->parallel_aware);
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+#if PG_VERSION_NUM >= 140000
+		case T_TidRangeScan:
+#endif  /* PG_VERSION_NUM */
+		case T_SubqueryScan:
+		case T_FunctionScan:
+		case T_TableFuncScan:
+		case T_ValuesScan:
+		case T_CteScan:
+		case T_NamedTuplestoreScan:
+		case T_WorkTableScan:
+		case T_ForeignScan:
+		case T_CustomScan:
+			plan_hash_scan(ctx, ((Scan *) plan)->scanrelid);
+			break;
+		case T_IndexScan:
+			plan_hash_scan(ctx, ((Scan *) plan)->scanrelid);
+			ctx->hash = hash_combine64(ctx->hash, ((IndexScan *) plan)->indexid);
+			plan_hash_dep(ctx, PLAN_HASH_DEP_RELATION, ((IndexScan *) plan)->indexid);
+			ctx->hash = hash_combine64(ctx->hash, ((IndexScan *) plan)->indexorderdir);
+			break;
+		case T_IndexOnlyScan:
+			plan_hash_scan(ctx, ((Scan *) plan)->scanrelid);
+			ctx->hash = hash_combine64(ctx->hash, ((IndexOnlyScan *) plan)->indexid);
+			plan_hash_dep(ctx, PLAN_HASH_DEP_RELATION, ((IndexOnlyScan *) plan)->indexid);
+			ctx->hash = hash_combine64(ctx->hash, ((IndexOnlyScan *) plan)->indexorderdir);
+			break;
+		case T_BitmapIndexScan:
+			plan_hash_scan(ctx, ((Scan *) plan)->scanrelid);
+			ctx->hash = hash_combine64(ctx->hash, ((BitmapIndexScan *) plan)->indexid);
+			plan_hash_dep(ctx, PLAN_HASH_DEP_RELATION, ((BitmapIndexScan *) plan)->indexid);
+			break;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			ctx->hash = hash_combine64(ctx->hash, ((Join *) plan)->jointype);
+			break;
+		case T_Agg:
+			ctx->hash = hash_combine64(ctx->hash, ((Agg *) plan)->aggstrategy);
+			break;
+		case T_SetOp:
+			ctx->hash = hash_combine64(ctx->hash, ((SetOp *) plan)->strategy);
+			ctx->hash = hash_combine64(ctx->hash, ((SetOp *) plan)->cmd);
+			break;
+		case T_ModifyTable:
+			ctx->hash = hash_combine64(ctx->hash, ((ModifyTable *) plan)->operation);
+			break;
+		default:
+			break;
+	}
+
+	/* expressions and columns, which EXPLAIN prints as Output, Filter, ... */
+	plan_hash_exprs(ctx, plan->targetlist);
+	plan_hash_exprs(ctx, plan->qual);
+	plan_hash_exprs(ctx, plan->initPlan);
+
+	switch (nodeTag(plan))
+	{
+		case T_IndexScan:
+			plan_hash_exprs(ctx, ((IndexScan *) plan)->indexqualorig);
+			plan_hash_exprs(ctx, ((IndexScan *) plan)->indexorderbyorig);
+			break;
+		case T_IndexOnlyScan:
+			plan_hash_exprs(ctx, ((IndexOnlyScan *) plan)->indexqual);
+			plan_hash_exprs(ctx, ((IndexOnlyScan *) plan)->indexorderby);
+			break;
+		case T_BitmapIndexScan:
+			plan_hash_exprs(ctx, ((BitmapIndexScan *) plan)->indexqualorig);
+			break;
+		case T_BitmapHeapScan:
+			plan_hash_exprs(ctx, ((BitmapHeapScan *) plan)->bitmapqualorig);
+			break;
+		case T_TidScan:
+			plan_hash_exprs(ctx, ((TidScan *) plan)->tidquals);
+			break;
+#if PG_VERSION_NUM >= 140000
+		case T_TidRangeScan:
+			plan_hash_exprs(ctx, ((TidRangeScan *) plan)->tidrangequals);
+			break;
+		case T_Memoize:
+			plan_hash_exprs(ctx, ((Memoize *) plan)->param_exprs);
+			break;
+#endif  /* PG_VERSION_NUM */
+		case T_FunctionScan:
+			plan_hash_exprs(ctx, ((FunctionScan *) plan)->functions);
+			ctx->exprs = hash_combine64(ctx->exprs, ((FunctionScan *) plan)->funcordinality);
+			break;
+		case T_TableFuncScan:
+			plan_hash_exprs(ctx, ((TableFuncScan *) plan)->tablefunc);
+			break;
+		case T_ValuesScan:
+			plan_hash_exprs(ctx, ((ValuesScan *) plan)->values_lists);
+			break;
+		case T_CteScan:
+			ctx->exprs = hash_combine64(ctx->exprs, ((CteScan *) plan)->ctePlanId);
+			break;
+		case T_NestLoop:
+			{
+				ListCell   *lc;
+
+				plan_hash_exprs(ctx, ((Join *) plan)->joinqual);
+				foreach(lc, ((NestLoop *) plan)->nestParams)
+				{
+					NestLoopParam *nlp = (NestLoopParam *) lfirst(lc);
+
+					ctx->exprs = hash_combine64(ctx->exprs, nlp->paramno);
+					plan_hash_exprs(ctx, nlp->paramval);
+				}
+			}
+			break;
+		case T_MergeJoin:
+			plan_hash_exprs(ctx, ((Join *) plan)->joinqual);
+			plan_hash_exprs(ctx, ((MergeJoin *) plan)->mergeclauses);
+			break;
+		case T_HashJoin:
+			plan_hash_exprs(ctx, ((Join *) plan)->joinqual);
+			plan_hash_exprs(ctx, ((HashJoin *) plan)->hashclauses);
+			break;
+		case T_Result:
+			plan_hash_exprs(ctx, ((Result *) plan)->resconstantqual);
+			break;
+		case T_Limit:
+			plan_hash_exprs(ctx, ((Limit *) plan)->limitOffset);
+			plan_hash_exprs(ctx, ((Limit *) plan)->limitCount);
+#if PG_VERSION_NUM >= 130000
+			ctx->exprs = hash_combine64(ctx->exprs, ((Limit *) plan)->limitOption);
+#endif  /* PG_VERSION_NUM */
+			break;
+		case T_Sort:
+#if PG_VERSION_NUM >= 130000
+		case T_IncrementalSort:
+			if (IsA(plan, IncrementalSort))
+				ctx->exprs = hash_combine64(ctx->exprs,
+											((IncrementalSort *) plan)->nPresortedCols);
+#endif  /* PG_VERSION_NUM */
+			{
+				Sort	   *sort = (Sort *) plan;
+				int			i;
+
+				plan_hash_columns(ctx, sort->numCols, sort->sortColIdx);
+				for (i = 0; i < sort->numCols; i++)
+				{
+					ctx->exprs = hash_combine64(ctx->exprs, sort->sortOperators[i]);
+					plan_hash_dep(ctx, OPEROID, sort->sortOperators[i]);
+					ctx->exprs = hash_combine64(ctx->exprs, sort->nullsFirst[i]);
+				}
+			}
+			break;
+		case T_Group:
+			plan_hash_columns(ctx, ((Group *) plan)->numCols,
+							  ((Group *) plan)->grpColIdx);
+			break;
+		case T_Agg:
+			ctx->exprs = hash_combine64(ctx->exprs, ((Agg *) plan)->aggsplit);
+			ctx->exprs = hash_combine64(ctx->exprs, list_length(((Agg *) plan)->chain));
+			plan_hash_columns(ctx, ((Agg *) plan)->numCols,
+							  ((Agg *) plan)->grpColIdx);
+			break;
+		case T_WindowAgg:
+			plan_hash_columns(ctx, ((WindowAgg *) plan)->partNumCols,
+							  ((WindowAgg *) plan)->partColIdx);
+			plan_hash_columns(ctx, ((WindowAgg *) plan)->ordNumCols,
+							  ((WindowAgg *) plan)->ordColIdx);
+			break;
+		case T_Unique:
+			plan_hash_columns(ctx, ((Unique *) plan)->numCols,
+							  ((Unique *) plan)->uniqColIdx);
+			break;
+		case T_Gather:
+			ctx->exprs = hash_combine64(ctx->exprs, ((Gather *) plan)->num_workers);
+			break;
+		case T_GatherMerge:
+			ctx->exprs = hash_combine64(ctx->exprs, ((GatherMerge *) plan)->num_workers);
+			plan_hash_columns(ctx, ((GatherMerge *) plan)->numCols,
+							  ((GatherMerge *) plan)->sortColIdx);
+			break;
+		case T_Append:
+			/* "Subplans Removed" */
+			ctx->exprs = hash_combine64(ctx->exprs,
+										list_length(((Append *) plan)->appendplans) -
+										((AppendState *) planstate)->as_nplans);
+			break;
+		case T_MergeAppend:
+			ctx->exprs = hash_combine64(ctx->exprs,
+										list_length(((MergeAppend *) plan)->mergeplans) -
+										((MergeAppendState *) planstate)->ms_nplans);
+			break;
+		case T_ModifyTable:
+			{
+				ModifyTable *mt = (ModifyTable *) plan;
+				ListCell   *lc;
+
+				/* the targets are printed as "Relation Name" */
+				foreach(lc, mt->resultRelations)
+				{
+					Oid			relid = rt_fetch(lfirst_int(lc), ctx->rtable)->relid;
+
+					ctx->exprs = hash_combine64(ctx->exprs, relid);
+					plan_hash_dep(ctx, PLAN_HASH_DEP_RELATION, relid);
+				}
+				ctx->exprs = hash_combine64(ctx->exprs, mt->onConflictAction);
+				plan_hash_exprs(ctx, mt->onConflictWhere);
+			}
+			break;
+		default:
+			break;
+	}
 
-	/* es_str->data is a Plan formatted Json */
-	normalized_plan = pgsp_json_normalize(es_str->data);
-	planid = hash_any((const unsigned char *) normalized_plan,
-					  strlen(normalized_plan));
-	elog(DEBUG3, "normalized_plan: %s", normalized_plan);
-	pfree(normalized_plan);
+	/* bracket the children so that the shape of the tree counts */
+	ctx->hash = hash_combine64(ctx->hash, '(');
+	planstate_tree_walker(planstate, plan_hash_walker, context);
+	ctx->hash = hash_combine64(ctx->hash, ')');
 
-	elog(DEBUG3, "planid: %ld", planid);
-	return planid;
+	return false;
 }
 
 #if PG_VERSION_NUM < 140000
@@ -1350,28 +5255,33 @@ pg_plan_advsr_query_walker(Node *parsetree)
 	if (parsetree == NULL)
 		return false;
 
-	switch (nodeTag(parsetree))
-	{
-		case T_ExplainStmt:
-			{
-				ListCell   *lc;
+	return is_target_explain(parsetree);
+}
+
+/*
+ * Return true if the utility statement is an EXPLAIN that pg_plan_advsr
+ * analyzes, that is EXPLAIN ANALYZE or any EXPLAIN if pg_plan_advsr.widely
+ * is on.
+ */
+static bool
+is_target_explain(Node *utilityStmt)
+{
+	ListCell   *lc;
 
-				if (pg_plan_advsr_widely == 1) /* 1 equals "true" or "on" */
-					return true;
+	if (utilityStmt == NULL || !IsA(utilityStmt, ExplainStmt))
+		return false;
 
-				foreach(lc, ((ExplainStmt *) parsetree)->options)
-				{
-					DefElem    *opt = (DefElem *) lfirst(lc);
+	if (pg_plan_advsr_widely == 1) /* 1 equals "true" or "on" */
+		return true;
 
-					if (strcmp(opt->defname, "analyze") == 0)
-						return true;
-				}
-			}
-			return false;
-			break;
-		default:
-			return false;
+	foreach(lc, ((ExplainStmt *) utilityStmt)->options)
+	{
+		DefElem    *opt = (DefElem *) lfirst(lc);
+
+		if (strcmp(opt->defname, "analyze") == 0)
+			return true;
 	}
+
 	return false;
 }
 
@@ -1519,6 +5429,8 @@ get_relnames(ExplainState *es, Relids relids)
 	int			first = true;
 	StringInfo	relnames = makeStringInfo();
 
+	relids = get_parent_relids(relids);
+
 	x = -1;
 	while ((x = bms_next_member(relids, x)) >= 0)
 	{
@@ -1535,15 +5447,23 @@ get_relnames(ExplainState *es, Relids relids)
  * ExplainPreScanNode -
  *    Prescan the planstate tree to identify which RTEs are referenced
  *
- * Adds the relid of each referenced RTE to *rels_used.  The result controls
- * which RTEs are assigned aliases by select_rtable_names_for_explain.
+ * Adds the relid of each referenced RTE to context->relids.  The result
+ * controls which RTEs are assigned aliases by select_rtable_names_for_explain.
  * This ensures that we don't confusingly assign un-suffixed aliases to RTEs
  * that never appear in the EXPLAIN output (such as inheritance parents).
+ *
+ * The relids of the subtree of each node are also saved in
+ * context->node_relids, so that join hints don't scan the subtree again.
  */
 bool
-ExplainPreScanNode(PlanState *planstate, Bitmapset **rels_used)
+ExplainPreScanNode(PlanState *planstate, PlanRelidsContext *context)
 {
 	Plan	   *plan = planstate->plan;
+	Bitmapset  *parent_relids = context->relids;
+	Bitmapset **rels_used = &context->relids;
+	int			id = plan->plan_node_id;
+
+	context->relids = NULL;
 
 	switch (nodeTag(plan))
 	{
@@ -1585,11 +5505,171 @@ ExplainPreScanNode(PlanState *planstate, Bitmapset **rels_used)
 				*rels_used = bms_add_member(*rels_used,
 											((ModifyTable *) plan)->exclRelRTI);
 			break;
+#if PG_VERSION_NUM >= 140000
+		case T_Append:
+			*rels_used = bms_add_members(*rels_used,
+										 ((Append *) plan)->apprelids);
+			break;
+		case T_MergeAppend:
+			*rels_used = bms_add_members(*rels_used,
+										 ((MergeAppend *) plan)->apprelids);
+			break;
+#endif  /* PG_VERSION_NUM */
 		default:
 			break;
 	}
 
-	return planstate_tree_walker(planstate, ExplainPreScanNode, rels_used);
+	context->all_relids = bms_add_members(context->all_relids, context->relids);
+
+	planstate_tree_walker(planstate, ExplainPreScanNode, context);
+
+	/* leave out the relations of other query blocks */
+	if (IsA(plan, SubqueryScan))
+	{
+		bms_free(context->relids);
+		context->relids = bms_make_singleton(((Scan *) plan)->scanrelid);
+	}
+	else
+	{
+		ListCell   *lc;
+
+		foreach(lc, planstate->initPlan)
+			context->relids = bms_del_members(context->relids,
+											  lookup_node_relids(context, ((SubPlanState *) lfirst(lc))->planstate));
+		foreach(lc, planstate->subPlan)
+			context->relids = bms_del_members(context->relids,
+											  lookup_node_relids(context, ((SubPlanState *) lfirst(lc))->planstate));
+	}
+
+	if (id >= 0)
+	{
+		if (id >= context->num_node_relids)
+		{
+			int			newlen = Max(id + 1, context->num_node_relids * 2);
+
+			if (context->node_relids == NULL)
+				context->node_relids = (Bitmapset **) palloc0(newlen * sizeof(Bitmapset *));
+			else
+			{
+				context->node_relids = (Bitmapset **)
+					repalloc(context->node_relids, newlen * sizeof(Bitmapset *));
+				memset(context->node_relids + context->num_node_relids, 0,
+					   (newlen - context->num_node_relids) * sizeof(Bitmapset *));
+			}
+			context->num_node_relids = newlen;
+		}
+		context->node_relids[id] = context->relids;
+	}
+
+	/* add to the parent; the saved set of this node is left as is */
+	context->relids = bms_add_members(parent_relids, context->relids);
+
+	return false;
+}
+
+/*
+ * Return the relids of the subtree of planstate saved in context, or NULL if
+ * it is not there.
+ */
+static Bitmapset *
+lookup_node_relids(PlanRelidsContext *context, PlanState *planstate)
+{
+	int			id = planstate->plan->plan_node_id;
+
+	if (id >= 0 && id < context->num_node_relids)
+		return context->node_relids[id];
+
+	return NULL;
+}
+
+/*
+ * Return the relids of the subtree of planstate saved by ExplainPreScanNode.
+ */
+static Bitmapset *
+get_plan_relids(PlanState *planstate)
+{
+	Bitmapset  *relids = lookup_node_relids(&plan_relids, planstate);
+	PlanRelidsContext context;
+
+	if (relids != NULL)
+		return relids;
+
+	/* not prescanned, e.g. a subtree of a plan found later */
+	memset(&context, 0, sizeof(context));
+	ExplainPreScanNode(planstate, &context);
+	return context.relids;
+}
+
+/*
+ * Cache the refname of each rtable entry in an array, so that looking up a
+ * name doesn't walk es->rtable and es->rtable_names.
+ */
+static void
+build_refnames(ExplainState *es)
+{
+	ListCell   *lc1;
+	ListCell   *lc2;
+	int			rti = 1;
+
+	num_refnames = list_length(es->rtable) + 1;
+	refnames = (char **) palloc0(num_refnames * sizeof(char *));
+	forboth(lc1, es->rtable, lc2, es->rtable_names)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc1);
+		char	   *refname = (char *) lfirst(lc2);
+
+		refnames[rti++] = refname ? refname : rte->eref->aliasname;
+	}
+	refnames_rtable = es->rtable;
+
+	refparents = NULL;
+#if PG_VERSION_NUM >= 140000
+	if (es->pstmt->appendRelations != NIL)
+	{
+		refparents = (Index *) palloc0(num_refnames * sizeof(Index));
+		foreach(lc1, es->pstmt->appendRelations)
+		{
+			AppendRelInfo *appinfo = (AppendRelInfo *) lfirst(lc1);
+
+			if (appinfo->child_relid < num_refnames)
+				refparents[appinfo->child_relid] = appinfo->parent_relid;
+		}
+	}
+#endif  /* PG_VERSION_NUM */
+}
+
+/*
+ * Return the rti of the topmost appendrel parent of rti, or rti itself if it
+ * is not a child.  The parents are known on PG14 and later.
+ */
+static Index
+get_parent_rti(Index rti)
+{
+	if (refparents == NULL)
+		return rti;
+
+	while (rti < num_refnames && refparents[rti] != 0)
+		rti = refparents[rti];
+
+	return rti;
+}
+
+/*
+ * Replace the appendrel children in relids with their topmost parents.
+ */
+static Bitmapset *
+get_parent_relids(Bitmapset *relids)
+{
+	Bitmapset  *result = NULL;
+	int			x = -1;
+
+	if (refparents == NULL)
+		return relids;
+
+	while ((x = bms_next_member(relids, x)) >= 0)
+		result = bms_add_member(result, get_parent_rti(x));
+
+	return result;
 }
 
 /* For creating Leading hint */
@@ -1598,10 +5678,10 @@ CreateLeadingHint(PlanState *planstate, LeadingContext *lead)
 {
 	Plan	   *plan = planstate->plan;
 
-	/* skip initPlans and subPlans */
-	if (planstate->initPlan || planstate->subPlan)
-		return false;
-
+	/*
+	 * pg_hint_plan takes one Leading hint, so it is for the top query block.
+	 * initPlans and subPlans are not walked.
+	 */
 	switch (nodeTag(plan))
 	{
 		case T_SeqScan:
@@ -1609,12 +5689,14 @@ CreateLeadingHint(PlanState *planstate, LeadingContext *lead)
 		case T_BitmapHeapScan:
 		case T_FunctionScan:
 			elog(DEBUG1, "seqscan: %u", ((Scan *) plan)->scanrelid);
-			appendStringInfo(lead->lead_str, "%s ", get_target_relname(((Scan *) plan)->scanrelid, lead->es));
+			appendStringInfo(lead->lead_str, "%s ",
+							 get_target_relname(get_parent_rti(((Scan *) plan)->scanrelid), lead->es));
 			break;
 		case T_IndexScan:
 		case T_IndexOnlyScan:
 			elog(DEBUG1, "indscan: %u", ((Scan *) plan)->scanrelid);
-			appendStringInfo(lead->lead_str, "%s ", get_target_relname(((Scan *) plan)->scanrelid, lead->es));
+			appendStringInfo(lead->lead_str, "%s ",
+							 get_target_relname(get_parent_rti(((Scan *) plan)->scanrelid), lead->es));
 			break;
 		case T_HashJoin:
 			elog(DEBUG1, "HJ(");
@@ -1637,12 +5719,53 @@ CreateLeadingHint(PlanState *planstate, LeadingContext *lead)
 			appendStringInfo(lead->lead_str, ")");
 			elog(DEBUG1, ")");
 			break;
+#if PG_VERSION_NUM >= 140000
+		case T_Append:
+		case T_MergeAppend:
+			{
+				PlanState **subplans;
+				int			nsubplans = get_append_subplans(planstate, &subplans);
+				Bitmapset  *apprelids = IsA(plan, Append) ?
+					((Append *) plan)->apprelids : ((MergeAppend *) plan)->apprelids;
+
+				/*
+				 * Every child of an appendrel scans or joins the same parent
+				 * relations, so the first one stands for all of them.
+				 * UNION ALL of separate queries can't be in a Leading hint.
+				 */
+				if (!bms_is_empty(apprelids) && nsubplans > 0)
+					CreateLeadingHint(subplans[0], lead);
+			}
+			break;
+#endif  /* PG_VERSION_NUM */
 		default:
 			pg_plan_advsr_planstate_tree_walker(planstate, CreateLeadingHint, lead);
 	}
 	return false;
 }
 
+/*
+ * Return the subplans of Append or MergeAppend that are left after the
+ * partition pruning at executor startup.
+ */
+static int
+get_append_subplans(PlanState *planstate, PlanState ***subplans)
+{
+	if (IsA(planstate, AppendState))
+	{
+		*subplans = ((AppendState *) planstate)->appendplans;
+		return ((AppendState *) planstate)->as_nplans;
+	}
+	if (IsA(planstate, MergeAppendState))
+	{
+		*subplans = ((MergeAppendState *) planstate)->mergeplans;
+		return ((MergeAppendState *) planstate)->ms_nplans;
+	}
+
+	*subplans = NULL;
+	return 0;
+}
+
 /* This function is entory point */
 /*
  * pg_plan_advsr_ExplainPrintPlan -
@@ -1658,7 +5781,6 @@ CreateLeadingHint(PlanState *planstate, LeadingContext *lead)
 void
 pg_plan_advsr_ExplainPrintPlan(ExplainState *es, QueryDesc *queryDesc)
 {
-	Bitmapset  *rels_used = NULL;
 	PlanState  *ps;
 	double		totaltime;
 
@@ -1672,9 +5794,14 @@ pg_plan_advsr_ExplainPrintPlan(ExplainState *es, QueryDesc *queryDesc)
 	es->pstmt = queryDesc->plannedstmt;
 	es->rtable = queryDesc->plannedstmt->rtable;
 
-	ExplainPreScanNode(queryDesc->planstate, &rels_used);
+	analysis_bucket_known = get_plan_param_bucket(queryDesc->plannedstmt,
+												  &analysis_bucket);
+
+	memset(&plan_relids, 0, sizeof(plan_relids));
+	ExplainPreScanNode(queryDesc->planstate, &plan_relids);
 
-	es->rtable_names = select_rtable_names_for_explain(es->rtable, rels_used);
+	es->rtable_names = select_rtable_names_for_explain(es->rtable, plan_relids.all_relids);
+	build_refnames(es);
 #if PG_VERSION_NUM < 130000
 	es->deparse_cxt = deparse_context_for_plan_rtable(es->rtable,
 													  es->rtable_names);
@@ -1706,6 +5833,13 @@ pg_plan_advsr_ExplainPrintPlan(ExplainState *es, QueryDesc *queryDesc)
 	CreateLeadingHint(ps, leadcxt);
 	appendStringInfo(leadcxt->lead_str, " )");
 
+	/* the caches point into this plan, don't let them outlive it */
+	memset(&plan_relids, 0, sizeof(plan_relids));
+	refnames_rtable = NIL;
+	refnames = NULL;
+	num_refnames = 0;
+	refparents = NULL;
+
 #if PG_VERSION_NUM < 140000
 	/* queryId is made by pg_stat_statements */
 	pgsp_queryid = (queryid_t) hash_query(queryDesc->sourceText);
@@ -1714,8 +5848,11 @@ pg_plan_advsr_ExplainPrintPlan(ExplainState *es, QueryDesc *queryDesc)
 	pgsp_queryid = queryDesc->plannedstmt->queryId;
 #endif  /* PG_VERSION_NUM */
 
-	pgsp_planid = create_pgsp_planid(queryDesc);
+	pgsp_planid_known = create_pgsp_planid(queryDesc, &pgsp_planid,
+										   &advsr_planid);
 	totaltime = queryDesc->totaltime ? queryDesc->totaltime->total * 1000.0 : 0;
+	if (queryDesc->totaltime)
+		add_measure_sample(queryDesc->totaltime);
 
 	aplname = GetConfigOptionByName("application_name", NULL, false);
 
@@ -1732,118 +5869,439 @@ pg_plan_advsr_ExplainPrintPlan(ExplainState *es, QueryDesc *queryDesc)
 }
 
 /*
- * Store query, hints and diffs to tables
+ * Store query, hints and diffs to tables
+ */
+void
+store_info_to_tables(double totaltime, const char *sourcetext)
+{
+	int64		norm_query_hash;
+	StringInfo	prev_rows_hint;
+	StringInfo	new_hint;
+	StringInfo	other_hints;
+	List	   *rows_hints;
+	PlanInfo	info;
+	const char *raw_query = NULL;
+	TuningAction action = TUNING_CONTINUE;
+	char	   *best_hints = NULL;
+
+	/*
+	 * Calculate 64-bit hash of the normalized query as a norm_query_hash.
+	 * It is the same as hashtextextended(norm_query_string, 0) in SQL.
+	 */
+	norm_query_hash = DatumGetInt64(hash_any_extended((const unsigned char *) normalized_query,
+													  strlen(normalized_query), 0));
+
+	/*
+	 * Sample the raw query text, and cut it down to raw_query_max_length.
+	 * Whether norm_query_hash has enough raw texts is checked when storing.
+	 */
+	if (pg_plan_advsr_raw_query_limit != 0 &&
+		pg_plan_advsr_raw_query_sample_rate > 0 &&
+#if PG_VERSION_NUM >= 150000
+		pg_prng_double(&pg_global_prng_state) < pg_plan_advsr_raw_query_sample_rate)
+#else
+		random() <= (MAX_RANDOM_VALUE * pg_plan_advsr_raw_query_sample_rate))
+#endif  /* PG_VERSION_NUM */
+	{
+		int			len = strlen(sourcetext);
+
+		raw_query = sourcetext;
+		if (pg_plan_advsr_raw_query_max_length > 0 &&
+			len > pg_plan_advsr_raw_query_max_length)
+			raw_query = pnstrdup(sourcetext,
+								 pg_mbcliplen(sourcetext, len,
+											  pg_plan_advsr_raw_query_max_length));
+	}
+
+	info.norm_query_hash = norm_query_hash;
+	info.norm_query = normalized_query;
+	info.raw_query = raw_query;
+	info.raw_query_limit = pg_plan_advsr_raw_query_limit;
+	info.pgsp_queryid = pgsp_queryid;
+	info.pgsp_planid = pgsp_planid;
+	info.pgsp_planid_known = pgsp_planid_known;
+	info.planid = advsr_planid;
+	info.execution_time = totaltime;
+	info.rows_hint = rows_str->data;
+	info.scan_hint = scan_str->data;
+	info.join_hint = join_str->data;
+	info.lead_hint = leadcxt->lead_str->data;
+	info.scan_rows_err = total_diff_rows_scan;
+	info.scan_err_ratio = max_diff_ratio_scan;
+	info.join_rows_err = total_diff_rows_join;
+	info.join_err_ratio = max_diff_ratio_join;
+	info.scan_cnt = scan_cnt;
+	info.join_cnt = join_cnt;
+	info.application_name = aplname;
+	info.timestamp = GetCurrentTimestamp();
+	get_measure_stats(&info);
+	info.param_values = normalized_params;
+	info.param_bucket = analysis_bucket;
+	info.param_bucket_known = pg_plan_advsr_param_buckets && analysis_bucket_known;
+
+	if (auto_tune_result)
+	{
+		auto_tune_result->stored = true;
+		auto_tune_result->planid = info.planid;
+		auto_tune_result->execution_time = info.execution_time_median;
+		auto_tune_result->join_rows_err = info.join_rows_err;
+		auto_tune_result->scan_rows_err = info.scan_rows_err;
+	}
+
+	/*
+	 * Store to plan_repo, or let the background writer do it if async_write
+	 * is on.  We store it by ourselves if the queue can't take it.
+	 */
+	if (!pg_plan_advsr_async_write || !enqueue_plan_info(&info))
+		store_plan_info(&info);
+
+	/*
+	 * A captured statement runs in a transaction of the application, which
+	 * must not wait for the lock of the hints nor write hint_plan.hints and
+	 * tuning_state.  Its plan is only recorded to plan_repo.
+	 */
+	if (capture_current)
+		return;
+
+	/*
+	 * upsert hints to hint_plan.hints
+	 *
+	 * This is always done synchronously because the next iteration of the
+	 * feedback loop plans with these hints.
+	 */
+	prev_rows_hint = makeStringInfo();
+	new_hint = makeStringInfo();
+	other_hints = makeStringInfo();
+
+	lockHints(normalized_query, aplname);
+
+	if (pg_plan_advsr_auto_pin)
+		action = updateTuningState(&info, &best_hints);
+	if (auto_tune_result && action != TUNING_CONTINUE)
+		auto_tune_result->stopped = true;
+
+	/* tuning of this query has ended at the plan pinned in hint_plan.hints */
+	if (action == TUNING_STOPPED)
+		return;
+
+	selectHints(normalized_query, aplname, prev_rows_hint);
+
+	/* delete previous rows_hint */
+	if (deleteHints(normalized_query, aplname))
+		elog(DEBUG3, "\ndelete success: hint_plan.hints\n");
+	else
+		elog(INFO, "\ndelete error: hint_plan.hints\n");
+
+	if (action == TUNING_PIN)
+	{
+		/*
+		 * The hints of the fastest plan replace the ROWS hints, and follow
+		 * the other hints of the query.  They stay at the end, so that
+		 * plan_repo.unpin_hints() can strip them when the tuning state is
+		 * deleted.
+		 */
+		(void) parse_hints(prev_rows_hint->data, other_hints, NIL, false);
+		build_hints(new_hint, other_hints->data, NIL);
+		appendStringInfo(new_hint, "%s%s", new_hint->len > 0 ? " " : "",
+						 best_hints);
+	}
+	else
+	{
+		/*
+		 * create new rows_hint: keep one ROWS hint per relation set, so that
+		 * the hint doesn't grow however many iterations run
+		 */
+		rows_hints = parse_hints(prev_rows_hint->data, other_hints, NIL, false);
+		rows_hints = parse_hints(rows_str->data, other_hints, rows_hints, true);
+
+		/*
+		 * ROWS hints would apply to every parameter bucket, the learned
+		 * join cardinalities of the bucket do their job instead.  Without
+		 * join_correction nothing would correct the joins, so keep them.
+		 */
+		if (pg_plan_advsr_param_buckets && pg_plan_advsr_join_correction)
+			rows_hints = NIL;
+		build_hints(new_hint, other_hints->data, rows_hints);
+	}
+
+	/* insert new rows_hint to table for auto tune */
+	if (insertHints(normalized_query, aplname, new_hint->data))
+		elog(DEBUG3, "\ninsert success: hint_plan.hints\n");
+	else
+		elog(INFO, "\ninsert error: hint_plan.hints\n");
+}
+
+
+/*
+ * Return false if an ancestor may have stopped reading its input before the
+ * end, so that the actual rows of planstate, a scan or join below it, are
+ * less than the rows of the relation.
+ */
+static bool
+runs_to_completion(PlanState *planstate, List *ancestors)
+{
+	PlanState  *child = planstate;
+	ListCell   *lc;
+
+	foreach(lc, ancestors)
+	{
+		PlanState  *ps = (PlanState *) lfirst(lc);
+		Plan	   *plan = ps->plan;
+
+		/* a merge join stops as soon as either side is used up */
+		if (IsA(plan, Limit) || IsA(plan, MergeJoin))
+			return false;
+
+		/*
+		 * A nested loop leaves its inner side at the first match of an outer
+		 * row if the join is a semi or anti join, or if the planner proved the
+		 * inner side unique.  The inner side of a hash join is read to the end
+		 * by the Hash node in any case.
+		 */
+		if (IsA(plan, NestLoop) && child == innerPlanState(ps))
+		{
+			Join	   *join = (Join *) plan;
+
+			if (join->jointype == JOIN_SEMI || join->jointype == JOIN_ANTI ||
+				join->inner_unique)
+				return false;
+		}
+
+		/* the outer side isn't read to the end if the hash table is empty */
+		if (IsA(plan, HashJoin) && child == outerPlanState(ps) &&
+			innerPlanState(ps) != NULL &&
+			innerPlanState(ps)->instrument != NULL &&
+			innerPlanState(ps)->instrument->ntuples == 0)
+			return false;
+
+		child = ps;
+	}
+
+	return true;
+}
+
+/*
+ * Get target relation name of a scan
+ */
+char *
+get_target_relname(Index rti, ExplainState *es)
+{
+	RangeTblEntry *rte;
+	char	   *refname;
+
+	elog(DEBUG1, "    #get_target_relname#");
+
+	if (es->rtable == refnames_rtable && rti < num_refnames)
+		return refnames[rti];
+
+	rte = rt_fetch(rti, es->rtable);
+	refname = (char *) list_nth(es->rtable_names, rti - 1);
+	if (refname == NULL)
+		refname = rte->eref->aliasname;
+
+	return refname;
+}
+
+
+/*
+ * Return the nearest Gather or Gather Merge in ancestors, or NULL if the node
+ * is not run by parallel workers.
+ */
+static PlanState *
+get_parallel_gather(List *ancestors)
+{
+	ListCell   *lc;
+
+	foreach(lc, ancestors)
+	{
+		PlanState  *ps = (PlanState *) lfirst(lc);
+
+		if (IsA(ps, GatherState) || IsA(ps, GatherMergeState))
+			return ps;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return true if each participant of a parallel plan produces a different
+ * part of the output of the plan node, that is the node is parallel aware
+ * or it reads a partial outer input.  The inner side of a join is run in
+ * full by every participant unless it is parallel aware itself.
+ */
+static bool
+plan_is_partial(Plan *plan)
+{
+	while (plan != NULL)
+	{
+		if (plan->parallel_aware)
+			return true;
+		if (IsA(plan, Gather) || IsA(plan, GatherMerge))
+			return false;
+		plan = outerPlan(plan);
+	}
+
+	return false;
+}
+
+/*
+ * Actual and estimated rows of a plan node.  A node run more than once
+ * produces its rows per loop, and the planner estimates them per loop too,
+ * so both are compared per loop.  If the node is parameterized by a Nested
+ * Loop above it, the rows of each loop are those for one outer row only:
+ * neither the rows per loop nor the total of the loops are the rows of its
+ * relation, so they must not correct the relation.
  */
-void
-store_info_to_tables(double totaltime, const char *sourcetext)
+typedef struct NodeRows
 {
-	char		md5[33];
-
-#if PG_VERSION_NUM >= 150000
-	const char *errstr = NULL;
-#endif  /* PG_VERSION_NUM */
+	double		loops;			/* executions of the node, 0 if unknown */
+	double		est_per_loop;	/* estimated rows per loop */
+	double		act_per_loop;	/* actual rows per loop, -1 if unknown */
+	double		act_total;		/* actual rows of all the loops */
+	bool		parameterized;	/* rows depend on Nested Loop parameters */
+} NodeRows;
 
-	StringInfo	prev_rows_hint;
-	StringInfo	new_hint;
+/*
+ * Return true if a plan node reads a parameter of a Nested Loop above it,
+ * that is it is in a parameterized inner side of the Nested Loop.
+ */
+static bool
+is_nestloop_parameterized(Plan *plan, List *ancestors)
+{
+	ListCell   *lc;
 
-	char	   *before = "'";
-	char	   *after = "\'\'";
-	char	   *output;
+	if (bms_is_empty(plan->extParam))
+		return false;
 
-	/*
-	 * Calculate MD5 hash of the normalized query as a norm_query_hash
-	 */
-	if (!pg_md5_hash(normalized_query, strlen(normalized_query), md5
-#if PG_VERSION_NUM >= 150000
-					 , &errstr))
-#else
-					))
-#endif  /* PG_VERSION_NUM */
+	foreach(lc, ancestors)
 	{
-		ereport(ERROR,
-				(errcode(ERRCODE_OUT_OF_MEMORY),
-				 errmsg("pg_md5_hash: out of memory")));
+		PlanState  *ps = (PlanState *) lfirst(lc);
+		ListCell   *lc2;
+
+		if (!IsA(ps->plan, NestLoop))
+			continue;
+
+		foreach(lc2, ((NestLoop *) ps->plan)->nestParams)
+		{
+			NestLoopParam *nlp = (NestLoopParam *) lfirst(lc2);
+
+			if (bms_is_member(nlp->paramno, plan->extParam))
+				return true;
+		}
 	}
 
-	/* insert totaltime and hints to plan_repo.plan_history */
-	if (insertPlanHistory(md5, pgsp_queryid, pgsp_planid, totaltime,
-				rows_str->data, scan_str->data, join_str->data,
-				leadcxt->lead_str->data,
-				total_diff_rows_scan, max_diff_ratio_scan,
-				total_diff_rows_join, max_diff_ratio_join, scan_cnt, join_cnt, aplname))
-		elog(DEBUG3, "\ninsert success: plan_history\n");
-	else
-		elog(INFO, "\ninsert error: plan_history\n");
+	return false;
+}
 
-	/* insert queryhash and normalized query text to plan_repo.norm_queries */
-	if (insertNormQueries(md5, normalized_query))
-		elog(DEBUG3, "\ninsert success: norm_queries\n");
-	else
-		elog(INFO, "\ninsert error: norm_queries\n");
+/*
+ * Get the actual and estimated rows of a plan node.
+ */
+static void
+get_node_rows(PlanState *planstate, List *ancestors, NodeRows *nrows)
+{
+	Plan	   *plan = planstate->plan;
+	PlanState  *gather;
 
-	/* insert queryhash and raw query text to plan_repo.raw_queries */
-	/* should be replaced "'" to "''" in sql */
-	output = (char *) palloc((int) strlen(sourcetext) * 1.5);
-	strcpy(output, sourcetext);
-	elog(DEBUG3, "output(before): %s", output);
-	replaceAll(output, before, after);
-	elog(DEBUG3, "output(after): %s", output);
-
-	if (insertRawQueries(md5, output))
-		elog(DEBUG3, "\ninsert success: raw_queries\n");
-	else
-		elog(INFO, "\ninsert error: raw_queries\n");
-	pfree(output);
+	nrows->loops = 0;
+	nrows->est_per_loop = plan->plan_rows;
+	nrows->act_per_loop = -1;
+	nrows->act_total = -1;
+	nrows->parameterized = is_nestloop_parameterized(plan, ancestors);
 
-	/* upsert hints to hint_plan.hints */
-	prev_rows_hint = makeStringInfo();
-	new_hint = makeStringInfo();
+	/* EXPLAIN, or never executed, e.g. a partition pruned at run time */
+	if (planstate->instrument == NULL || planstate->instrument->nloops == 0)
+		return;
 
-	selectHints(normalized_query, aplname, prev_rows_hint);
+	nrows->loops = planstate->instrument->nloops;
+	nrows->act_total = planstate->instrument->ntuples;
+	nrows->act_per_loop = nrows->act_total / nrows->loops;
 
-	if (prev_rows_hint)
+	/*
+	 * Below Gather, the instrumentation of the workers is accumulated to the
+	 * leader's one.  A partial node produces a part of its relation in each
+	 * participant and the planner estimates the part, so count the rows of
+	 * all the participants per execution of the Gather.
+	 */
+	gather = get_parallel_gather(ancestors);
+	if (gather != NULL && gather->instrument != NULL &&
+		gather->instrument->nloops > 0 && plan_is_partial(plan))
 	{
-		/* delete previous rows_hint */
-		if (deleteHints(normalized_query, aplname))
-			elog(DEBUG3, "\ndelete success: hint_plan.hints\n");
-		else
-			elog(INFO, "\ndelete error: hint_plan.hints\n");
+		double		gather_loops = gather->instrument->nloops;
 
-		/* create new rows_hint */
-		appendStringInfo(new_hint, "%s %s", prev_rows_hint->data, rows_str->data);
-	}
-	else
-	{
-		appendStringInfo(new_hint, "%s", rows_str->data);
+		nrows->act_per_loop = nrows->act_total / gather_loops;
+		nrows->est_per_loop = plan->plan_rows * nrows->loops / gather_loops;
+		nrows->loops = gather_loops;
 	}
-
-	/* insert new rows_hint to table for auto tune */
-	if (insertHints(normalized_query, aplname, new_hint->data))
-		elog(DEBUG3, "\ninsert success: hint_plan.hints\n");
-	else
-		elog(INFO, "\ninsert error: hint_plan.hints\n");
 }
 
-
 /*
- * Get target relation name of a scan
+ * Recommend the number of parallel workers of a scan, or -1 if no Parallel
+ * hint applies to it.
+ *
+ * The number grows with the pages the scan actually read, in the same way
+ * as compute_parallel_worker() does with min_parallel_table_scan_size.  A
+ * scan run more than once per query is the inner side of a join, and a
+ * timed scan that finished within parallel_min_scan_time doesn't pay for
+ * starting workers, so both get 0.  A scan which the planner would not run
+ * in parallel anyway gets no hint, so that the hint doesn't override a plan
+ * without evidence against it.  rows are per execution.
  */
-char *
-get_target_relname(Index rti, ExplainState *es)
+static int
+recommend_parallel_workers(PlanState *planstate, Index rti, ExplainState *es,
+						   double rows, double executions)
 {
-	RangeTblEntry *rte;
-	char	   *refname;
+	RangeTblEntry *rte = rt_fetch(rti, es->rtable);
+	Instrumentation *instr = planstate->instrument;
+	Relation	rel;
+	double		pages;
+	double		reltuples;
+	double		threshold;
+	int			workers;
 
-	elog(DEBUG1, "    #get_target_relname#");
+	if (rte->rtekind != RTE_RELATION || max_parallel_workers_per_gather == 0)
+		return -1;
 
-	rte = rt_fetch(rti, es->rtable);
-	refname = (char *) list_nth(es->rtable_names, rti - 1);
-	if (refname == NULL)
-		refname = rte->eref->aliasname;
+	if (executions > 1)
+		return 0;
 
-	return refname;
-}
+	/*
+	 * The time of the participants of a parallel query is accumulated, and
+	 * so are their loops.  The time per loop is what one participant spent
+	 * for one execution.
+	 */
+	if (instr->need_timer &&
+		instr->total * 1000.0 / instr->nloops < pg_plan_advsr_parallel_min_scan_time)
+		return 0;
+
+	/* the relation is still locked by the query */
+	rel = table_open(rte->relid, NoLock);
+	if (!RELKIND_HAS_STORAGE(rel->rd_rel->relkind))
+	{
+		table_close(rel, NoLock);
+		return -1;
+	}
+	pages = RelationGetNumberOfBlocks(rel);
+	reltuples = rel->rd_rel->reltuples;
+	table_close(rel, NoLock);
+
+	/* index and bitmap scans read the pages holding the rows they return */
+	if (!IsA(planstate->plan, SeqScan) && reltuples > 0)
+		pages = Min(pages, ceil(pages * rows / reltuples));
+
+	/* too small to be scanned in parallel, as the planner sees it */
+	threshold = Max(min_parallel_table_scan_size, 1);
+	if (pages < threshold)
+		return -1;
+
+	workers = 1;
+	while (pages >= threshold * 3 && workers < max_parallel_workers_per_gather)
+	{
+		workers++;
+		threshold *= 3;
+	}
 
+	return Min(workers, max_parallel_workers_per_gather);
+}
 
 /*
  * Create scan, join and rows hints.
@@ -1871,15 +6329,15 @@ CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 {
 	Plan	   *plan = planstate->plan;
 	bool		haschildren;
-	double		nloops;
+	NodeRows	nrows;
 	double		rows;
+	double		est_plan_rows;
+	double		executions;
 	StringInfo	tmp_relnames = makeStringInfo();
 
 	elog(DEBUG1, "### CreateScanJoinRowsHints ###");
 	elog(DEBUG1, "    Parent Relationship: %s", relationship != NULL ? relationship : "");
 
-	/* Skip initPlan-s such as CTE and subPlan-s */
-
 	/* Create scan hints using ExplainScanTarget */
 	switch (nodeTag(plan))
 	{
@@ -1944,17 +6402,11 @@ CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 	if (planstate->instrument)
 		InstrEndLoop(planstate->instrument);
 
-	if (planstate->instrument)
-	{
-		/* EXPLAIN ANALYZE */
-		nloops = planstate->instrument->nloops;
-		rows = planstate->instrument->ntuples / nloops; /* actual rows */
-	}
-	else
-	{
-		/* EXPLAIN */
-		rows = -1;
-	}
+	/* the rows are compared per loop, see NodeRows */
+	get_node_rows(planstate, ancestors, &nrows);
+	est_plan_rows = nrows.est_per_loop;
+	rows = nrows.act_per_loop;
+	executions = nrows.loops;
 
 	/*
 	 * Create join and rows hints. In this current design, we use actual rows
@@ -1978,7 +6430,7 @@ CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 		case T_IndexOnlyScan:
 		case T_BitmapIndexScan:
 			{
-				est_rows = ((Plan *) planstate->plan)->plan_rows;
+				est_rows = est_plan_rows;
 				act_rows = rows == -1 ? est_rows : clamp_row_est(rows);
 
 				if (est_rows != act_rows)
@@ -1992,17 +6444,63 @@ CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 					if (diff_ratio_scan > max_diff_ratio_scan)
 						max_diff_ratio_scan = diff_ratio_scan;
 				}
+
+				/*
+				 * The rows of a scan are the rows of its relation unless the
+				 * scan is parameterized or stopped early.
+				 */
+				if (pg_plan_advsr_scan_correction && rows != -1 &&
+					!IsA(plan, BitmapIndexScan) &&
+					((Scan *) plan)->scanrelid > 0 &&
+					bms_is_empty(plan->extParam) &&
+					runs_to_completion(planstate, ancestors))
+				{
+					Index		rti = ((Scan *) plan)->scanrelid;
+					RangeTblEntry *rte = rt_fetch(rti, es->rtable);
+
+					if (rte->rtekind == RTE_RELATION)
+						learn_cardinality(es->pstmt->queryId,
+										  bms_make_singleton(rti),
+										  rte->relid, act_rows);
+				}
+
+				if (pg_plan_advsr_parallel_hint && rows != -1 && executions > 0 &&
+					(IsA(plan, SeqScan) || IsA(plan, IndexScan) ||
+					 IsA(plan, IndexOnlyScan) || IsA(plan, BitmapHeapScan)))
+				{
+					Index		rti = ((Scan *) plan)->scanrelid;
+					int			workers;
+
+					workers = recommend_parallel_workers(planstate, rti, es,
+														 rows, executions);
+					if (workers >= 0)
+						appendStringInfo(scan_str, "PARALLEL(%s %d) ",
+										 quote_identifier(get_target_relname(rti, es)),
+										 workers);
+				}
 			}
 			break;
 		case T_NestLoop:
 		case T_MergeJoin:
 		case T_HashJoin:
 			{
-				Bitmapset  *relids = NULL;
+				Bitmapset  *relids = get_plan_relids(planstate);
+
+				/*
+				 * A join of partitions in a partitionwise join reads a part of
+				 * the join of the parents.  The Append above it gives the
+				 * ROWS hint of the parents.
+				 */
+				bool		child_join = !bms_is_subset(get_parent_relids(relids),
+														relids);
 
-				ExplainPreScanNode(planstate, &relids);
 				tmp_relnames->data = get_relnames(es, relids);
 
+				if (nrows.parameterized)
+					elog(DEBUG1, "pg_plan_advsr: rows of parameterized join (%s) are not hinted: %.0f per loop, %.0f in %.0f loops",
+						 tmp_relnames->data, nrows.act_per_loop,
+						 nrows.act_total, nrows.loops);
+
 				if (join_cnt > 0)
 					appendStringInfo(join_str, "\n");
 
@@ -2016,10 +6514,14 @@ CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 				appendStringInfo(join_str, "(%s) ", tmp_relnames->data);
 				join_cnt++;
 
-				est_rows = ((Plan *) planstate->plan)->plan_rows;
+				est_rows = est_plan_rows;
 				act_rows = rows == -1 ? est_rows : clamp_row_est(rows);
 
-				if (est_rows != act_rows)
+				/*
+				 * The errors of a parameterized join are left out as well,
+				 * because no ROWS hint can correct them.
+				 */
+				if (est_rows != act_rows && !child_join && !nrows.parameterized)
 				{
 					if (rows_cnt > 0)
 						appendStringInfo(rows_str, "\n");
@@ -2035,8 +6537,55 @@ CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 					if (diff_ratio_join > max_diff_ratio_join)
 						max_diff_ratio_join = diff_ratio_join;
 				}
+
+				/* the same conditions as scans, see above */
+				if (pg_plan_advsr_join_correction && rows != -1 && !child_join &&
+					bms_is_empty(plan->extParam) &&
+					runs_to_completion(planstate, ancestors))
+					learn_cardinality(es->pstmt->queryId,
+									  get_parent_relids(relids),
+									  InvalidOid, act_rows);
+			}
+			break;
+#if PG_VERSION_NUM >= 140000
+		case T_Append:
+		case T_MergeAppend:
+			{
+				Bitmapset  *apprelids = IsA(plan, Append) ?
+					((Append *) plan)->apprelids : ((MergeAppend *) plan)->apprelids;
+
+				/* the appendrel of a partitionwise join */
+				if (bms_num_members(apprelids) < 2)
+					break;
+
+				tmp_relnames->data = get_relnames(es, apprelids);
+
+				est_rows = est_plan_rows;
+				act_rows = rows == -1 ? est_rows : clamp_row_est(rows);
+
+				if (est_rows != act_rows && !nrows.parameterized)
+				{
+					if (rows_cnt > 0)
+						appendStringInfo(rows_str, "\n");
+					appendStringInfo(rows_str, "ROWS(%s #%.0f) ", tmp_relnames->data, act_rows);
+					rows_cnt++;
+
+					diff_rows_join = get_diff_rows(est_rows, act_rows);
+					total_diff_rows_join = total_diff_rows_join + diff_rows_join;
+
+					diff_ratio_join = get_diff_ratio(est_rows, act_rows);
+					if (diff_ratio_join > max_diff_ratio_join)
+						max_diff_ratio_join = diff_ratio_join;
+				}
+
+				if (pg_plan_advsr_join_correction && rows != -1 &&
+					bms_is_empty(plan->extParam) &&
+					runs_to_completion(planstate, ancestors))
+					learn_cardinality(es->pstmt->queryId, apprelids,
+									  InvalidOid, act_rows);
 			}
 			break;
+#endif  /* PG_VERSION_NUM */
 		default:
 			break;
 	}
@@ -2070,12 +6619,56 @@ CreateScanJoinRowsHints(PlanState *planstate, List *ancestors,
 		CreateScanJoinRowsHints(innerPlanState(planstate), ancestors,
 								"Inner", NULL, es);
 
+	/* initPlan-s, such as CTEs */
+	if (planstate->initPlan)
+		CreateSubPlanHints(planstate->initPlan, ancestors, "InitPlan", es);
+
+	/* special child plans */
+	if (IsA(plan, SubqueryScan))
+		CreateScanJoinRowsHints(((SubqueryScanState *) planstate)->subplan,
+								ancestors, "Subquery", NULL, es);
+	else if (IsA(plan, Append) || IsA(plan, MergeAppend))
+	{
+		PlanState **subplans;
+		int			nsubplans = get_append_subplans(planstate, &subplans);
+		int			i;
+
+		for (i = 0; i < nsubplans; i++)
+			CreateScanJoinRowsHints(subplans[i], ancestors, "Member", NULL, es);
+	}
+
+	/* subPlan-s */
+	if (planstate->subPlan)
+		CreateSubPlanHints(planstate->subPlan, ancestors, "SubPlan", es);
+
 	if (haschildren)
 	{
 		ancestors = list_delete_first(ancestors);
 	}
 }
 
+/*
+ * Create hints of the plans of initPlans or subPlans.  The relations in them
+ * have their own aliases, so pg_hint_plan applies the scan, join and ROWS
+ * hints in the query block they belong to.  The rows of a correlated subPlan
+ * are per execution, which is what its ROWS hints should be.
+ */
+static void
+CreateSubPlanHints(List *plans, List *ancestors, const char *relationship,
+				   ExplainState *es)
+{
+	ListCell   *lst;
+
+	foreach(lst, plans)
+	{
+		SubPlanState *sps = (SubPlanState *) lfirst(lst);
+		SubPlan    *sp = sps->subplan;
+
+		CreateScanJoinRowsHints(sps->planstate, ancestors,
+								relationship, sp->plan_name, es);
+	}
+}
+
 /*
  * Show the target of a Scan node
  */
@@ -2093,15 +6686,11 @@ pg_plan_advsr_ExplainScanTarget(Scan *plan, ExplainState *es)
 void
 pg_plan_advsr_ExplainTargetRel(Plan *plan, Index rti, ExplainState *es)
 {
-	RangeTblEntry *rte;
 	char	   *refname;
 
 	elog(DEBUG1, "    # pg_plan_advsr_ExplainTargetRel #");
 
-	rte = rt_fetch(rti, es->rtable);
-	refname = (char *) list_nth(es->rtable_names, rti - 1);
-	if (refname == NULL)
-		refname = rte->eref->aliasname;
+	refname = get_target_relname(rti, es);
 
 	switch (nodeTag(plan))
 	{
@@ -2175,6 +6764,295 @@ replaceAll(char *buf, const char *before, const char *after)
 	pfree(dup);
 }
 
+/*
+ * Find the next hint in str and return the position after it.  A hint is
+ * "Keyword(...)"; *start and *body point to the keyword and the text in the
+ * parentheses, and *bodylen is the length of the latter.  If the next word is
+ * not a complete hint, *body is set to NULL and the word is skipped.  Returns
+ * NULL at the end of str.
+ */
+static const char *
+next_hint(const char *str, const char **start, const char **body, int *bodylen)
+{
+	const char *p = str;
+	bool		quoted = false;
+	int			depth = 0;
+
+	while (isspace((unsigned char) *p))
+		p++;
+	if (*p == '\0')
+		return NULL;
+
+	/* find the end of "Keyword(...)", skipping quotes and nested parens */
+	*start = p;
+	*body = NULL;
+	while (isalpha((unsigned char) *p))
+		p++;
+	while (isspace((unsigned char) *p))
+		p++;
+	if (p == *start || *p != '(')
+	{
+		p = *start;
+		while (*p && !isspace((unsigned char) *p))
+			p++;
+		return p;
+	}
+	p++;
+	while (*p && (quoted || depth > 0 || *p != ')'))
+	{
+		if (*p == '"')
+			quoted = !quoted;
+		else if (!quoted && *p == '(')
+			depth++;
+		else if (!quoted && *p == ')')
+			depth--;
+		p++;
+	}
+	if (*p != ')')
+		return p;
+
+	*body = strchr(*start, '(') + 1;
+	*bodylen = p - *body;
+
+	return p + 1;
+}
+
+/*
+ * Split the body of a hint into words, keeping quoted names in one word.
+ */
+static char **
+split_hint_words(const char *body, int len, int *nwords)
+{
+	char	   *buf = pnstrdup(body, len);
+	char	   *p = buf;
+	char	  **words = (char **) palloc(sizeof(char *) * (len / 2 + 1));
+
+	*nwords = 0;
+	while (*p)
+	{
+		char	   *word;
+		bool		quoted = false;
+
+		while (isspace((unsigned char) *p))
+			p++;
+		if (*p == '\0')
+			break;
+		word = p;
+		while (*p && (quoted || !isspace((unsigned char) *p)))
+		{
+			if (*p == '"')
+				quoted = !quoted;
+			p++;
+		}
+		if (*p)
+			*p++ = '\0';
+		words[(*nwords)++] = word;
+	}
+
+	return words;
+}
+
+/*
+ * Parse hints and add its ROWS hints with an absolute row count to
+ * rows_hints.  If merge is true, an entry of the same relation set is
+ * updated according to rows_hint_smoothing, otherwise the first one wins.
+ * Other hints are appended to others as they are.
+ */
+static List *
+parse_hints(const char *hints, StringInfo others, List *rows_hints, bool merge)
+{
+	const char *p = hints;
+	const char *start;
+	const char *body;
+	int			bodylen;
+
+	while ((p = next_hint(p, &start, &body, &bodylen)) != NULL)
+	{
+		RowsHintEntry entry;
+		ListCell   *lc;
+
+		if (body == NULL ||
+			pg_strncasecmp(start, "ROWS", 4) != 0 ||
+			isalpha((unsigned char) start[4]) ||
+			!parse_rows_hint(body, bodylen, &entry))
+		{
+			appendStringInfo(others, "%s%.*s", others->len > 0 ? " " : "",
+							 (int) (p - start), start);
+			continue;
+		}
+
+		foreach(lc, rows_hints)
+		{
+			RowsHintEntry *e = (RowsHintEntry *) lfirst(lc);
+
+			if (strcmp(e->relnames, entry.relnames) == 0)
+			{
+				if (merge)
+					e->rows = pg_plan_advsr_rows_hint_smoothing * e->rows +
+						(1.0 - pg_plan_advsr_rows_hint_smoothing) * entry.rows;
+				break;
+			}
+		}
+		if (lc == NULL)
+		{
+			RowsHintEntry *e = (RowsHintEntry *) palloc(sizeof(RowsHintEntry));
+
+			*e = entry;
+			rows_hints = lappend(rows_hints, e);
+		}
+	}
+
+	return rows_hints;
+}
+
+static int
+relname_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Parse the body of a ROWS hint like "a b #100" into entry.  Returns false
+ * unless it has two or more relation names and an absolute row count.
+ */
+static bool
+parse_rows_hint(const char *body, int len, RowsHintEntry *entry)
+{
+	char	  **words;
+	int			nwords;
+	char	   *end;
+	StringInfoData relnames;
+	int			i;
+
+	words = split_hint_words(body, len, &nwords);
+	if (nwords < 3 || words[nwords - 1][0] != '#' || words[nwords - 1][1] == '\0')
+		return false;
+	entry->rows = strtod(words[nwords - 1] + 1, &end);
+	if (*end != '\0')
+		return false;
+
+	qsort(words, nwords - 1, sizeof(char *), relname_cmp);
+	initStringInfo(&relnames);
+	for (i = 0; i < nwords - 1; i++)
+		appendStringInfo(&relnames, "%s%s", i > 0 ? " " : "", words[i]);
+	entry->relnames = relnames.data;
+
+	return true;
+}
+
+/*
+ * Write other hints and then ROWS hints into buf in canonical form.
+ */
+static void
+build_hints(StringInfo buf, const char *others, List *rows_hints)
+{
+	ListCell   *lc;
+
+	appendStringInfoString(buf, others);
+	foreach(lc, rows_hints)
+	{
+		RowsHintEntry *e = (RowsHintEntry *) lfirst(lc);
+
+		appendStringInfo(buf, "%sROWS(%s #%.0f)", buf->len > 0 ? " " : "",
+						 e->relnames, e->rows);
+	}
+}
+
+/*
+ * Make a plan_repo.hint[] datum of the scan, join and rows hints of a plan.
+ * Each hint becomes (method, relation names, rows), rows being NULL except
+ * for ROWS hints.  Returns false if the type doesn't exist.
+ */
+static bool
+make_hint_set(const PlanInfo *info, Datum *result)
+{
+	const char *hints[3];
+	TupleDesc	tupdesc;
+	Datum	   *elems = NULL;
+	int			nelems = 0;
+	int			maxelems = 0;
+	int			i;
+
+	if (!OidIsValid(getCatalogOids()->hint_type))
+		return false;
+
+	hints[0] = info->scan_hint;
+	hints[1] = info->join_hint;
+	hints[2] = info->rows_hint;
+
+	tupdesc = lookup_rowtype_tupdesc_copy(catalog_oids.hint_type, -1);
+
+	for (i = 0; i < lengthof(hints); i++)
+	{
+		const char *p = hints[i];
+		const char *start;
+		const char *body;
+		int			bodylen;
+
+		if (p == NULL)
+			continue;
+
+		while ((p = next_hint(p, &start, &body, &bodylen)) != NULL)
+		{
+			Datum		values[Natts_hint];
+			bool		isNulls[Natts_hint];
+			Datum	   *relids;
+			char	  **words;
+			int			nwords;
+			int			nrelids;
+			char	   *end;
+			int			j;
+
+			if (body == NULL)
+				continue;
+
+			words = split_hint_words(body, bodylen, &nwords);
+			nrelids = nwords;
+
+			memset(isNulls, false, sizeof(isNulls));
+			isNulls[Anum_hint_rows - 1] = true;
+			isNulls[Anum_hint_workers - 1] = true;
+			if (nwords > 0 && words[nwords - 1][0] == '#')
+			{
+				values[Anum_hint_rows - 1] =
+					Float8GetDatum(strtod(words[nwords - 1] + 1, &end));
+				isNulls[Anum_hint_rows - 1] = false;
+				nrelids--;
+			}
+			else if (nwords > 1 && pg_strncasecmp(start, "PARALLEL(", 9) == 0)
+			{
+				values[Anum_hint_workers - 1] =
+					Int32GetDatum((int32) strtol(words[nwords - 1], &end, 10));
+				isNulls[Anum_hint_workers - 1] = false;
+				nrelids--;
+			}
+
+			relids = (Datum *) palloc(sizeof(Datum) * (nrelids + 1));
+			for (j = 0; j < nrelids; j++)
+				relids[j] = CStringGetTextDatum(words[j]);
+
+			values[Anum_hint_method - 1] =
+				CStringGetTextDatum(pnstrdup(start, strcspn(start, "( \t\n")));
+			values[Anum_hint_relids - 1] =
+				PointerGetDatum(construct_array(relids, nrelids, TEXTOID, -1, false, 'i'));
+
+			if (nelems >= maxelems)
+			{
+				maxelems = Max(8, maxelems * 2);
+				elems = elems ? (Datum *) repalloc(elems, sizeof(Datum) * maxelems) :
+					(Datum *) palloc(sizeof(Datum) * maxelems);
+			}
+			elems[nelems++] = heap_copy_tuple_as_datum(heap_form_tuple(tupdesc, values, isNulls),
+													   tupdesc);
+		}
+	}
+
+	*result = PointerGetDatum(construct_array(elems, nelems, catalog_oids.hint_type,
+											  -1, false, 'd'));
+
+	return true;
+}
+
 double
 get_diff_rows(double est_rows, double act_rows)
 {
@@ -0,0 +1,30 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+
+set max_parallel_workers_per_gather to 0;
+set pg_plan_advsr.quieted to on;
+
+create table pt (k int, c1 int, c2 int) partition by range (k);
+create table pt_low partition of pt for values from (minvalue) to (5001);
+create table pt_high partition of pt for values from (5001) to (maxvalue);
+insert into pt select i, i, i from generate_series(1, 10000) i;
+analyze pt;
+
+-- The join of the partitions is hinted by the name of their parent
+\o results/append.tmpout
+explain analyze select * from pt join table_b b on pt.c1 = b.c1 and pt.c2 = b.c2;
+\o
+select h.relids, h.rows
+from plan_repo.plan_history p, unnest(p.hint_set) h
+where h.method = 'ROWS';
+select lead_hint like '%pt %' and lead_hint not like '%pt\_%' as leading_parent
+from plan_repo.plan_history;
+
+-- Clean-up
+drop table pt;
+truncate plan_repo.plan_history;
+reset max_parallel_workers_per_gather;
+\! rm -f results/append.tmpout
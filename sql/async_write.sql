@@ -0,0 +1,21 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.norm_queries;
+truncate plan_repo.plan_history;
+
+set pg_plan_advsr.quieted to on;
+
+-- Without the background writer (writer_database is not set), the backend
+-- stores the records by itself
+set pg_plan_advsr.async_write to on;
+\o results/async_write.tmpout
+explain analyze select * from table_a where c1 = 1;
+\o
+select count(*) from plan_repo.plan_history;
+select count(*) from plan_repo.norm_queries;
+reset pg_plan_advsr.async_write;
+
+-- Clean-up
+\! rm -f results/async_write.tmpout
@@ -0,0 +1,48 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.tuning_state;
+truncate hint_plan.hints;
+truncate plan_repo.norm_queries;
+truncate plan_repo.plan_history;
+
+set max_parallel_workers_per_gather to 0;
+set random_page_cost = 2;
+set pg_plan_advsr.quieted to on;
+set pg_plan_advsr.auto_pin to on;
+select pg_plan_advsr_enable_feedback();
+
+-- The first iteration stores ROWS hints, and then the user adds a hint
+select iteration, converged from plan_repo.auto_tune($$
+select * from table_a a, table_b b, table_c c
+where a.c1 = b.c1 and a.c2 = b.c2 and b.c1 = c.c1 and b.c2 = c.c2$$, 1);
+select state, iterations from plan_repo.tuning_state;
+update hint_plan.hints set hints = 'Set(geqo_threshold 20) ' || hints;
+
+-- Tune until the fastest plan is pinned after the hint of the user
+select bool_or(converged) as converged from plan_repo.auto_tune($$
+select * from table_a a, table_b b, table_c c
+where a.c1 = b.c1 and a.c2 = b.c2 and b.c1 = c.c1 and b.c2 = c.c2$$, 10);
+select state <> 'tuning' as stopped from plan_repo.tuning_state;
+select h.hints like 'Set(geqo_threshold 20) %' as other_hints_kept,
+       h.hints like '%LEADING(%' as plan_pinned,
+       h.hints not like '%ROWS(%' as rows_hints_dropped,
+       right(h.hints, length(s.best_hints)) = s.best_hints as pinned_at_end
+from hint_plan.hints h, plan_repo.tuning_state s;
+
+-- Deleting the tuning state strips the pinned hints and restarts tuning
+delete from plan_repo.tuning_state;
+select hints from hint_plan.hints;
+select iteration, converged from plan_repo.auto_tune($$
+select * from table_a a, table_b b, table_c c
+where a.c1 = b.c1 and a.c2 = b.c2 and b.c1 = c.c1 and b.c2 = c.c2$$, 1);
+select state, iterations from plan_repo.tuning_state;
+select hints like 'Set(geqo_threshold 20) ROWS(%' as retuning,
+       hints not like '%LEADING(%' as unpinned
+from hint_plan.hints;
+
+-- Clean-up
+reset pg_plan_advsr.auto_pin;
+truncate plan_repo.tuning_state;
+truncate hint_plan.hints;
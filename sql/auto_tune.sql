@@ -0,0 +1,27 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+truncate plan_repo.norm_queries;
+
+set pg_plan_advsr.quieted to on;
+
+-- Arguments
+select count(*) from plan_repo.auto_tune(null);
+
+-- A single scan has no estimation error and converges at once
+select iteration, converged
+from plan_repo.auto_tune('select * from table_a where c1 = 1', 5);
+
+-- The EXPLAIN options follow pg_plan_advsr.instrumentation
+set pg_plan_advsr.instrumentation to buffers;
+select count(*) from plan_repo.auto_tune('select * from table_a where c1 = 1', 1);
+set pg_plan_advsr.instrumentation to timing;
+select count(*) from plan_repo.auto_tune('select * from table_a where c1 = 1', 1);
+reset pg_plan_advsr.instrumentation;
+select norm_query_string from plan_repo.norm_queries order by 1;
+
+-- Clean-up
+truncate plan_repo.plan_history;
+truncate plan_repo.norm_queries;
@@ -48,6 +48,18 @@ on t1.c1 = t2.c1 and t1.c2 = t2.c2;
 select rows_hint, join_rows_err, lead_hint, join_hint, scan_hint, join_cnt from plan_repo.plan_history order by id desc limit 4;
 select norm_query_string, hints from hint_plan.hints;
 
+-- hint_set holds the same hints with their relations and rows
+select h.relids, h.rows
+from plan_repo.plan_history p, unnest(p.hint_set) h
+where p.rows_hint like 'ROWS(a b c %' and h.method = 'ROWS'
+order by 2;
+
+-- planid is computed from the plan tree without EXPLAIN, and it must
+-- identify the same plans as pgsp_planid does
+select count(distinct pgsp_planid) = count(distinct (pgsp_planid, planid)) and
+       count(distinct planid) = count(distinct (pgsp_planid, planid)) as one_to_one
+from plan_repo.plan_history;
+
 -- Clean-up
 \! rm -f results/auto-tuning.tmpout
 
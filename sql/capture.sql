@@ -0,0 +1,36 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate hint_plan.hints;
+truncate plan_repo.norm_queries;
+truncate plan_repo.plan_history;
+
+-- A captured statement is recorded to plan_repo only
+set pg_plan_advsr.capture_sample_rate to 1;
+select count(*) from table_a where c1 < 10;
+reset pg_plan_advsr.capture_sample_rate;
+select count(*) from plan_repo.plan_history;
+select norm_query_string from plan_repo.norm_queries;
+select count(*) from hint_plan.hints;
+
+-- Statements faster than capture_min_duration are discarded
+set pg_plan_advsr.capture_min_duration to '1h';
+set pg_plan_advsr.capture_sample_rate to 1;
+select count(*) from table_a where c1 < 10;
+reset pg_plan_advsr.capture_sample_rate;
+reset pg_plan_advsr.capture_min_duration;
+select count(*) from plan_repo.plan_history;
+
+-- Every instrumentation level gives the rows of the hints
+set pg_plan_advsr.instrumentation to buffers;
+set pg_plan_advsr.capture_sample_rate to 1;
+select count(*) from table_a where c1 < 10;
+reset pg_plan_advsr.capture_sample_rate;
+set pg_plan_advsr.instrumentation to timing;
+set pg_plan_advsr.capture_sample_rate to 1;
+select count(*) from table_a where c1 < 10;
+reset pg_plan_advsr.capture_sample_rate;
+reset pg_plan_advsr.instrumentation;
+select count(*), count(distinct planid) as plans, bool_and(scan_cnt = 1) as scanned
+from plan_repo.plan_history;
@@ -0,0 +1,40 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+select plan_repo.reset_cardinalities() >= 0 as reset;
+
+set compute_query_id to on;
+set max_parallel_workers_per_gather to 0;
+set pg_plan_advsr.quieted to on;
+set pg_plan_advsr.join_correction to on;
+
+create function est_rows(query text) returns double precision
+language plpgsql as $$
+declare
+	plan json;
+begin
+	execute 'explain (format json) ' || query into plan;
+	return plan->0->'Plan'->>'Plan Rows';
+end
+$$;
+
+-- A join on correlated columns is underestimated until it is learned
+select est_rows('select * from table_a a join table_b b on a.c1 = b.c1 and a.c2 = b.c2') < 10 as underestimated;
+\o results/join_correction.tmpout
+explain analyze select * from table_a a join table_b b on a.c1 = b.c1 and a.c2 = b.c2;
+\o
+select est_rows('select * from table_a a join table_b b on a.c1 = b.c1 and a.c2 = b.c2') as corrected;
+
+-- Forgotten rows are not corrected any more
+select plan_repo.reset_cardinalities() > 0 as reset;
+select est_rows('select * from table_a a join table_b b on a.c1 = b.c1 and a.c2 = b.c2') < 10 as underestimated;
+
+-- Clean-up
+drop function est_rows(text);
+truncate plan_repo.plan_history;
+reset pg_plan_advsr.join_correction;
+reset max_parallel_workers_per_gather;
+reset compute_query_id;
+\! rm -f results/join_correction.tmpout
@@ -0,0 +1,28 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+
+set pg_plan_advsr.quieted to on;
+set pg_plan_advsr.measure_repeats to 3;
+
+-- A SELECT is run measure_repeats times and the statistics are stored
+\o results/measure.tmpout
+explain analyze select * from table_a where c1 = 1;
+\o
+select execution_time_median is not null and
+       execution_time_p90 >= execution_time_median as measured
+from plan_repo.plan_history;
+
+-- A query calling volatile functions is run only once
+create sequence measure_seq;
+\o results/measure.tmpout
+explain analyze select nextval('measure_seq');
+\o
+select currval('measure_seq');
+
+-- Clean-up
+drop sequence measure_seq;
+reset pg_plan_advsr.measure_repeats;
+\! rm -f results/measure.tmpout
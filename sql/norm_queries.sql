@@ -0,0 +1,30 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.norm_queries;
+truncate plan_repo.plan_history;
+
+set pg_plan_advsr.quieted to on;
+
+-- A normalized query is stored once
+\o results/norm_queries.tmpout
+explain analyze select * from table_a where c1 = 1;
+explain analyze select * from table_a where c1 = 2;
+\o
+select count(*) from plan_repo.plan_history;
+select norm_query_string from plan_repo.norm_queries;
+
+-- It is stored again after the table is truncated
+truncate plan_repo.norm_queries;
+\o results/norm_queries.tmpout
+explain analyze select * from table_a where c1 = 3;
+explain analyze select * from table_a where c1 = 4;
+\o
+select norm_query_string from plan_repo.norm_queries;
+select count(*) as hashed_by_text
+from plan_repo.plan_history h join plan_repo.norm_queries n using (norm_query_hash)
+where h.norm_query_hash = hashtextextended(n.norm_query_string, 0);
+
+-- Clean-up
+\! rm -f results/norm_queries.tmpout
@@ -0,0 +1,47 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+
+set max_parallel_workers_per_gather to 2;
+set min_parallel_table_scan_size to '64kB';
+set pg_plan_advsr.quieted to on;
+set pg_plan_advsr.parallel_hint to on;
+
+-- Workers grow with the pages read by the scan
+\o results/parallel_hint.tmpout
+explain (analyze, timing off) select count(*) from table_a;
+\o
+select h.method, h.relids, h.workers
+from plan_repo.plan_history p, unnest(p.hint_set) h
+where h.method = 'PARALLEL';
+
+-- A timed scan faster than parallel_min_scan_time gets no workers
+truncate plan_repo.plan_history;
+set pg_plan_advsr.parallel_min_scan_time to '1h';
+\o results/parallel_hint.tmpout
+explain analyze select count(*) from table_a;
+\o
+select h.method, h.relids, h.workers
+from plan_repo.plan_history p, unnest(p.hint_set) h
+where h.method = 'PARALLEL';
+
+-- A scan too small to be run in parallel gets no hint
+truncate plan_repo.plan_history;
+reset pg_plan_advsr.parallel_min_scan_time;
+set min_parallel_table_scan_size to '8MB';
+\o results/parallel_hint.tmpout
+explain (analyze, timing off) select count(*) from table_a;
+\o
+select h.method, h.relids, h.workers
+from plan_repo.plan_history p, unnest(p.hint_set) h
+where h.method = 'PARALLEL';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+reset pg_plan_advsr.parallel_min_scan_time;
+reset pg_plan_advsr.parallel_hint;
+reset min_parallel_table_scan_size;
+reset max_parallel_workers_per_gather;
+\! rm -f results/parallel_hint.tmpout
@@ -0,0 +1,32 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate hint_plan.hints;
+truncate plan_repo.plan_history;
+
+set pg_plan_advsr.quieted to on;
+set pg_plan_advsr.param_buckets to on;
+
+-- Without join_correction, ROWS hints are still stored
+\o results/param_buckets.tmpout
+explain analyze select * from table_a a, table_b b
+where a.c1 = b.c1 and a.c2 = b.c2 and a.c1 < 100;
+\o
+select param_values from plan_repo.plan_history;
+select hints like '%ROWS(a b #99)%' as rows_hint_stored from hint_plan.hints;
+
+-- With join_correction, the learned rows of the bucket replace ROWS hints
+set pg_plan_advsr.join_correction to on;
+\o results/param_buckets.tmpout
+explain analyze select * from table_a a, table_b b
+where a.c1 = b.c1 and a.c2 = b.c2 and a.c1 < 100;
+\o
+select hints not like '%ROWS(%' as rows_hint_dropped from hint_plan.hints;
+
+-- Clean-up
+select plan_repo.reset_cardinalities() >= 0 as reset;
+reset pg_plan_advsr.join_correction;
+reset pg_plan_advsr.param_buckets;
+truncate hint_plan.hints;
+\! rm -f results/param_buckets.tmpout
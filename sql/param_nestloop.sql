@@ -0,0 +1,27 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+
+set max_parallel_workers_per_gather to 0;
+set pg_plan_advsr.quieted to on;
+
+-- The join of b and c is run once per row of a, for the rows of that row
+-- only, so it gets a join hint but no ROWS hint
+\o results/param_nestloop.tmpout
+explain analyze
+select * from table_a a,
+	lateral (select b.c1 from table_b b join table_c c on b.c1 = c.c1 and b.c2 = c.c2
+			 where b.c2 < a.c2 offset 0) s
+where a.c1 < 10;
+\o
+select bool_or(h.method <> 'ROWS') as join_hinted,
+	   bool_or(h.method = 'ROWS') as rows_hinted
+from plan_repo.plan_history p, unnest(p.hint_set) h
+where h.relids = '{b,c}';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+reset max_parallel_workers_per_gather;
+\! rm -f results/param_nestloop.tmpout
@@ -0,0 +1,53 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+
+set pg_plan_advsr.quieted to on;
+
+-- CREATE EXTENSION created the partitions of today and tomorrow
+create temp view current_partitions as
+select 'plan_history_' || to_char(d, 'YYYYMMDD') || '_000000' as relname
+from generate_series(date_trunc('day', now() at time zone 'UTC'),
+					 date_trunc('day', now() at time zone 'UTC') + interval '1 day',
+					 interval '1 day') d;
+select count(*) from current_partitions join pg_class c using (relname)
+where c.relispartition;
+select plan_repo.prepare_plan_history_partitions();
+
+-- Rows of the current period go to its partition
+\o results/partitions.tmpout
+explain analyze select * from table_a where c1 = 1;
+\o
+select tableoid::regclass::text in (select 'plan_repo.' || relname
+									from current_partitions) as current_partition,
+	   count(*)
+from plan_repo.plan_history group by 1;
+
+-- A partition is named after its lower bound, and the rows of its range
+-- are moved out of the default partition
+insert into plan_repo.plan_history (norm_query_hash, timestamp)
+values (1, '2000-01-01 12:00');
+select plan_repo.create_plan_history_partition('2000-01-01', '2000-01-02');
+select tableoid::regclass, count(*) from plan_repo.plan_history
+where timestamp < '2001-01-01' group by 1;
+
+-- Partitions older than the interval are dropped, and newer rows are kept.
+-- A partition without an upper bound is kept, whatever DateStyle is.
+create table plan_repo.plan_history_max partition of plan_repo.plan_history
+	for values from ('2100-01-01') to (maxvalue);
+set datestyle to 'SQL, DMY';
+select plan_repo.drop_plan_history_partitions('1 day');
+reset datestyle;
+select count(*) from plan_repo.plan_history;
+select c.relname
+from pg_inherits i join pg_class c on c.oid = i.inhrelid
+where i.inhparent = 'plan_repo.plan_history'::regclass and
+	  c.relname not in (select relname from current_partitions)
+order by 1;
+
+-- Clean-up
+drop table plan_repo.plan_history_max;
+truncate plan_repo.plan_history;
+\! rm -f results/partitions.tmpout
@@ -0,0 +1,68 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+LOAD 'pg_store_plans';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+select pg_store_plans_reset();
+
+set max_parallel_workers_per_gather to 0;
+set pg_plan_advsr.quieted to on;
+set pg_store_plans.track to 'all';
+
+-- Counts the stored plans and those found in pg_store_plans by pgsp_planid
+create temp view pgsp_planids as
+select count(*) as stored, count(s.planid) as in_pg_store_plans
+from plan_repo.plan_history h
+left join (select distinct planid from pg_store_plans) s
+	   on s.planid = h.pgsp_planid;
+
+-- The same plan with different constants has the same planid
+\o results/planid.tmpout
+explain analyze select * from table_a where c1 = 1;
+explain analyze select * from table_a where c1 = 2;
+\o
+select count(*), count(distinct planid), count(distinct pgsp_planid)
+from plan_repo.plan_history;
+select * from pgsp_planids;
+
+-- Another join method gives another planid
+truncate plan_repo.plan_history;
+set enable_nestloop to off;
+set enable_mergejoin to off;
+\o results/planid.tmpout
+explain analyze select count(*) from table_a a join table_b b on a.c1 = b.c1;
+reset enable_mergejoin;
+set enable_hashjoin to off;
+explain analyze select count(*) from table_a a join table_b b on a.c1 = b.c1;
+\o
+select count(*), count(distinct planid), count(distinct pgsp_planid)
+from plan_repo.plan_history;
+select * from pgsp_planids;
+
+-- pgsp_planid follows the settings of pg_store_plans
+truncate plan_repo.plan_history;
+set pg_store_plans.log_verbose to on;
+\o results/planid.tmpout
+explain analyze select count(*) from table_a a join table_b b on a.c1 = b.c1;
+\o
+reset pg_store_plans.log_verbose;
+select * from pgsp_planids;
+
+-- pgsp_planid is NULL unless compute_pgsp_planid is on
+truncate plan_repo.plan_history;
+set pg_plan_advsr.compute_pgsp_planid to off;
+\o results/planid.tmpout
+explain analyze select * from table_a where c1 = 1;
+\o
+select count(*), count(planid), count(pgsp_planid) from plan_repo.plan_history;
+
+-- Clean-up
+truncate plan_repo.plan_history;
+drop view pgsp_planids;
+reset pg_plan_advsr.compute_pgsp_planid;
+reset pg_store_plans.track;
+reset enable_hashjoin;
+reset enable_nestloop;
+reset max_parallel_workers_per_gather;
+\! rm -f results/planid.tmpout
@@ -0,0 +1,41 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.raw_queries;
+
+set pg_plan_advsr.quieted to on;
+
+-- Up to raw_query_limit texts are stored per normalized query
+set pg_plan_advsr.raw_query_limit to 2;
+\o results/raw_queries.tmpout
+explain analyze select * from table_a where c1 = 1;
+explain analyze select * from table_a where c1 = 2;
+explain analyze select * from table_a where c1 = 3;
+\o
+select raw_query_string from plan_repo.raw_queries order by raw_query_id;
+reset pg_plan_advsr.raw_query_limit;
+
+-- No text is sampled at raw_query_sample_rate 0
+set pg_plan_advsr.raw_query_sample_rate to 0;
+\o results/raw_queries.tmpout
+explain analyze select * from table_a where c1 = 4;
+\o
+select count(*) from plan_repo.raw_queries;
+reset pg_plan_advsr.raw_query_sample_rate;
+
+-- Texts are cut down to raw_query_max_length
+set pg_plan_advsr.raw_query_max_length to 20;
+\o results/raw_queries.tmpout
+explain analyze select * from table_a where c1 = 5;
+\o
+select raw_query_string from plan_repo.raw_queries order by raw_query_id;
+reset pg_plan_advsr.raw_query_max_length;
+
+-- purge_raw_queries() deletes texts older than the interval
+select plan_repo.purge_raw_queries('1 day');
+select plan_repo.purge_raw_queries('-1 day');
+select count(*) from plan_repo.raw_queries;
+
+-- Clean-up
+\! rm -f results/raw_queries.tmpout
@@ -0,0 +1,55 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+select plan_repo.reset_cardinalities() >= 0 as reset;
+
+set compute_query_id to on;
+set max_parallel_workers_per_gather to 0;
+set enable_mergejoin to off;
+set pg_plan_advsr.quieted to on;
+set pg_plan_advsr.scan_correction to on;
+
+create function est_rows(query text) returns double precision
+language plpgsql as $$
+declare
+	plan json;
+begin
+	execute 'explain (format json) ' || query into plan;
+	return plan->0->'Plan'->>'Plan Rows';
+end
+$$;
+
+-- Correlated columns are underestimated until the scan is learned
+select est_rows('select * from table_a where c1 < 100 and c2 < 100') < 10 as underestimated;
+\o results/scan_correction.tmpout
+explain analyze select * from table_a where c1 < 100 and c2 < 100;
+\o
+select est_rows('select * from table_a where c1 < 100 and c2 < 100') as corrected;
+
+-- The rows of a partitioned table are summed up from its corrected partitions
+create table pt (k int, c1 int, c2 int) partition by range (k);
+create table pt_1 partition of pt for values from (minvalue) to (5001);
+create table pt_2 partition of pt for values from (5001) to (maxvalue);
+insert into pt select i, i, i from generate_series(1, 10000) i;
+analyze pt;
+select est_rows('select * from pt join table_b b on pt.c1 = b.c1 where pt.c1 < 100 and pt.c2 < 100') < 10 as underestimated;
+\o results/scan_correction.tmpout
+explain analyze select * from pt join table_b b on pt.c1 = b.c1 where pt.c1 < 100 and pt.c2 < 100;
+\o
+select est_rows('select * from pt join table_b b on pt.c1 = b.c1 where pt.c1 < 100 and pt.c2 < 100') between 50 and 200 as corrected;
+
+-- Forgotten rows are not corrected any more
+select plan_repo.reset_cardinalities() > 0 as reset;
+select est_rows('select * from table_a where c1 < 100 and c2 < 100') < 10 as underestimated;
+
+-- Clean-up
+drop table pt;
+drop function est_rows(text);
+truncate plan_repo.plan_history;
+reset pg_plan_advsr.scan_correction;
+reset enable_mergejoin;
+reset max_parallel_workers_per_gather;
+reset compute_query_id;
+\! rm -f results/scan_correction.tmpout
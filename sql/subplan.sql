@@ -0,0 +1,23 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+
+set max_parallel_workers_per_gather to 0;
+set pg_plan_advsr.quieted to on;
+
+-- A join in a CTE gets its ROWS hint under its own aliases
+\o results/subplan.tmpout
+explain analyze
+with t as materialized (select b.c1 from table_b b join table_c c on b.c1 = c.c1 and b.c2 = c.c2)
+select count(*) from t;
+\o
+select h.relids, h.rows
+from plan_repo.plan_history p, unnest(p.hint_set) h
+where h.method = 'ROWS';
+
+-- Clean-up
+truncate plan_repo.plan_history;
+reset max_parallel_workers_per_gather;
+\! rm -f results/subplan.tmpout
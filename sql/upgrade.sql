@@ -0,0 +1,86 @@
+LOAD 'pg_hint_plan';
+LOAD 'pg_plan_advsr';
+
+set pg_plan_advsr.quieted to on;
+
+-- Objects of the extension, which must not depend on how it was installed
+create temp view advsr_objects as
+select 'member ' || pg_describe_object(d.classid, d.objid, d.objsubid) as object
+from pg_depend d
+join pg_extension e on e.oid = d.refobjid
+where d.refclassid = 'pg_extension'::regclass and d.deptype = 'e' and
+	  e.extname = 'pg_plan_advsr'
+union all
+select 'relation ' || c.relname || ' ' || c.relkind || ' ' || coalesce(c.relacl::text, '')
+from pg_class c
+join pg_namespace n on n.oid = c.relnamespace
+where n.nspname = 'plan_repo'
+union all
+select 'column ' || c.relname || '.' || a.attname || ' ' ||
+	   format_type(a.atttypid, a.atttypmod) ||
+	   case when a.attnotnull then ' not null' else '' end ||
+	   coalesce(' default ' || pg_get_expr(ad.adbin, ad.adrelid), '')
+from pg_attribute a
+join pg_class c on c.oid = a.attrelid
+join pg_namespace n on n.oid = c.relnamespace
+left join pg_attrdef ad on ad.adrelid = a.attrelid and ad.adnum = a.attnum
+where n.nspname = 'plan_repo' and a.attnum > 0 and not a.attisdropped
+union all
+select 'index ' || pg_get_indexdef(i.indexrelid)
+from pg_index i
+join pg_class c on c.oid = i.indrelid
+join pg_namespace n on n.oid = c.relnamespace
+where n.nspname = 'plan_repo'
+union all
+select 'trigger ' || pg_get_triggerdef(t.oid)
+from pg_trigger t
+join pg_class c on c.oid = t.tgrelid
+join pg_namespace n on n.oid = c.relnamespace
+where n.nspname = 'plan_repo' and not t.tgisinternal
+union all
+select 'function ' || p.oid::regprocedure || ' ' || p.provolatile || ' ' ||
+	   p.proisstrict || ' ' || p.prosecdef || ' ' || md5(p.prosrc)
+from pg_proc p
+join pg_depend d on d.classid = 'pg_proc'::regclass and d.objid = p.oid
+join pg_extension e on e.oid = d.refobjid
+where d.refclassid = 'pg_extension'::regclass and d.deptype = 'e' and
+	  e.extname = 'pg_plan_advsr';
+
+create temp table fresh_objects as select * from advsr_objects;
+
+-- Install 0.1 with some rows, and update it to 0.2
+drop extension pg_plan_advsr;
+create extension pg_plan_advsr version '0.1';
+insert into plan_repo.norm_queries
+values (md5('select 1'), 'select 1'), (md5('lost'), null);
+insert into plan_repo.raw_queries (norm_query_hash, raw_query_string, timestamp)
+values (md5('select 1'), 'select 1', '2000-01-01');
+insert into plan_repo.plan_history (norm_query_hash, pgsp_planid, timestamp)
+values (md5('select 1'), 1, '2000-01-01'), (md5('lost'), 2, null);
+alter extension pg_plan_advsr update to '0.2';
+
+-- The hashes are migrated consistently between the tables
+select h.pgsp_planid, n.norm_query_string, h.planid is null as no_planid,
+	   h.timestamp = '-infinity' as no_timestamp
+from plan_repo.plan_history h
+join plan_repo.norm_queries n using (norm_query_hash)
+order by 1;
+select count(*) from plan_repo.raw_queries r
+join plan_repo.norm_queries n using (norm_query_hash)
+where n.norm_query_hash = hashtextextended('select 1', 0);
+
+-- The updated objects are the same as the ones of a fresh install
+select object from advsr_objects except select object from fresh_objects;
+select object from fresh_objects except select object from advsr_objects;
+
+-- The updated extension stores plans
+\o results/upgrade.tmpout
+explain analyze select * from table_a where c1 = 1;
+\o
+select count(*) from plan_repo.plan_history;
+
+-- Clean-up
+truncate plan_repo.plan_history;
+truncate plan_repo.norm_queries;
+truncate plan_repo.raw_queries;
+\! rm -f results/upgrade.tmpout
@@ -0,0 +1,154 @@
+#
+# Copyright (c) 2020-2024, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+#
+# Test the background writer.  The regression tests run on a server without
+# it, so this starts one with pg_plan_advsr.writer_database set.
+#
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('writer');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_hint_plan, pg_plan_advsr, pg_store_plans'
+max_prepared_transactions = 2
+log_min_messages = debug1
+pg_plan_advsr.writer_database = 'postgres'
+pg_plan_advsr.async_queue_size = '4MB'
+pg_plan_advsr.async_write = on
+pg_plan_advsr.quieted = on
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+create extension pg_hint_plan;
+create extension pg_store_plans;
+create extension pg_plan_advsr;
+create table table_a (c1, c2) as (select i, i from generate_series(1, 10000) as s(i));
+create index ind_a_c1 on table_a (c1);
+analyze table_a;
+});
+
+# The literal makes each queued record a little over 2kB; it is kept in
+# raw_queries, but normalized away from norm_queries.
+my $padding = 'x' x 2000;
+
+# Run EXPLAIN ANALYZE once for each of the given c1 values in one session
+sub run_explains
+{
+	my ($tag, @values) = @_;
+	my $sql = "\\o /dev/null\n";
+
+	foreach my $c1 (@values)
+	{
+		$sql .= "explain analyze select * from table_a "
+		  . "where c1 = $c1 and c2::text <> '$tag$padding';\n";
+	}
+	$node->safe_psql('postgres', $sql);
+}
+
+sub count_rows
+{
+	my ($table) = @_;
+
+	return $node->safe_psql('postgres', "select count(*) from plan_repo.$table");
+}
+
+sub wait_for_plan_history
+{
+	my ($count) = @_;
+
+	$node->poll_query_until('postgres',
+		"select count(*) = $count from plan_repo.plan_history")
+	  or die "timed out waiting for $count rows in plan_history";
+}
+
+# Hold the writer in a transaction storing one record.  The lock is held by
+# a prepared transaction, and SHARE mode conflicts with the INSERTs of the
+# writer but not with the backends queueing records.
+sub block_writer
+{
+	$node->safe_psql(
+		'postgres', q{
+begin;
+lock table plan_repo.raw_queries in share mode;
+prepare transaction 'block_writer';
+});
+	run_explains('', 0);
+	$node->poll_query_until(
+		'postgres', q{
+select count(*) = 1 from pg_stat_activity
+where backend_type = 'pg_plan_advsr writer' and wait_event_type = 'Lock'
+})
+	  or die "timed out waiting for the writer to be blocked";
+}
+
+sub unblock_writer
+{
+	$node->safe_psql('postgres', "commit prepared 'block_writer'");
+}
+
+# Records go through the queue, 2MB in total
+run_explains('', 1 .. 1000);
+wait_for_plan_history(1000);
+is(count_rows('raw_queries'), '1000', 'queued raw queries are stored');
+is(count_rows('norm_queries'), '1', 'queued normalized query is stored once');
+
+# Records piling up while the writer is blocked are stored at once.  They
+# wrap around the end of the 4MB queue, and they are more than one INSERT
+# takes (PLAN_REPO_BATCH_ROWS).
+block_writer();
+run_explains('', 1001 .. 2100);
+is(count_rows('plan_history'), '1000',
+	'records are not stored while the writer is blocked');
+unblock_writer();
+wait_for_plan_history(2101);
+is(count_rows('raw_queries'), '2101', 'raw queries of a large batch are stored');
+is(count_rows('norm_queries'), '1', 'normalized query is stored once');
+
+my $log = slurp_file($node->logfile);
+my ($max_stored) =
+  sort { $b <=> $a } ($log =~ /pg_plan_advsr writer stored (\d+) records/g);
+cmp_ok($max_stored, '>', 1000, 'the writer stored more than one INSERT batch at once');
+unlike($log, qr/queue is full/, 'no record is stored synchronously for lack of space');
+unlike($log, qr/could not store a batch/, 'no batch has failed');
+
+# A record which can't be stored is skipped, and the others of the batch are
+# stored one by one
+$node->safe_psql(
+	'postgres', q{
+alter table plan_repo.raw_queries
+	add constraint raw_queries_no_failure
+	check (raw_query_string not like '%fail_me%');
+});
+block_writer();
+run_explains('', 2101);
+run_explains('fail_me', 2102);
+run_explains('', 2103);
+unblock_writer();
+wait_for_plan_history(2104);
+is(count_rows('raw_queries'), '2104', 'raw queries but the failing one are stored');
+is($node->safe_psql('postgres',
+		"select count(*) from plan_repo.raw_queries where raw_query_string like '%fail_me%'"),
+	'0', 'the failing record is skipped');
+
+$log = slurp_file($node->logfile);
+like($log, qr/pg_plan_advsr writer could not store a batch of 3 records/,
+	'the batch with the failing record is stored one by one');
+like($log, qr/pg_plan_advsr writer skipped a record of norm_query_hash/,
+	'the failing record is reported');
+
+# The skipped record is not retried
+$node->safe_psql('postgres', 'alter table plan_repo.raw_queries drop constraint raw_queries_no_failure');
+run_explains('', 2104);
+wait_for_plan_history(2105);
+is(count_rows('raw_queries'), '2105', 'the writer goes on after a skipped record');
+
+$node->stop;
+done_testing();